@@ -21,11 +21,119 @@
 #define FTP_PORT 1337
 #define NET_INIT_SIZE (64 * 1024)
 #define DEFAULT_FILE_BUF_SIZE (4 * 1024 * 1024)
+#define DEFAULT_INTERACTIVE_SIZE (256 * 1024)
+#define MIN_XFER_BUF_SIZE (32 * 1024)
+
+#define FTP_THREAD_PRIORITY 0x10000100
+#define FTP_THREAD_PRIORITY_BOOST (FTP_THREAD_PRIORITY - 0x20)
+#define FTP_THREAD_STACK_SIZE 0x10000
+/* Handlers keep at most a few FTPVITA_PATH_MAX buffers on the stack */
+#define FTP_CLIENT_STACK_SIZE 0x4000
+#define DEFAULT_MAX_SESSIONS 8
+#define MAX_SESSIONS 64
+/* Session IDs are the registry slot tagged with the slot's generation */
+#define SESSION_SLOT_BITS 8
+
+/* Core 3 is reserved for the system and background applications */
+#define FTP_CPU_MASK_RESERVED (0x01 << 19)
+#define FTP_CPU_MASK_WIDE (0x0F << 16)
+/* Cores 0-2, the ones a game runs on */
+#define FTP_CPU_MASK_USER (0x07 << 16)
+
+/* The load probe sleeps LOAD_PROBE_DELAY at a time and measures how late
+ * it wakes up; a late wakeup means higher priority threads (a game)
+ * are keeping the cores busy */
+#define LOAD_PROBE_DELAY (10 * 1000)
+#define LOAD_PROBE_SAMPLES 25
+#define LOAD_CONTENDED_LATENCY 1000
+#define LOAD_IDLE_LATENCY 300
+
+/* A command arriving after this much silence signals an activity event */
+#define ACTIVITY_SIGNAL_GAP (1000 * 1000)
+
+#define SCHED_MAX_WEIGHT 16
+#define SCHED_MAX_DELAY (100 * 1000)
+#define SCHED_YIELD_DELAY (1 * 1000)
 
 #define FTP_DEFAULT_PATH   "/"
 
+#define DEFAULT_PASV_PORT_MIN 1338
+#define DEFAULT_PASV_PORT_MAX 1353
+#define MAX_PASV_LISTENERS 16
+#define PASV_BACKLOG 4
+
 #define MAX_DEVICES 16
+#define MAX_DEVNAME 16
+/* Concurrent transfers per device, interleaved writes to the same
+ * memory card are slower than running them one after another */
+#define DEFAULT_DEVICE_IO_SLOTS 1
+/* Queued FTP transfers look for ABOR and STAT this often */
+#define DEVICE_WAIT_POLL (250 * 1000)
 #define MAX_CUSTOM_COMMANDS 16
+#define MAX_CUSTOM_TUNABLES 8
+#define MAX_CONFIG_SIZE (8 * 1024)
+
+/* Subtrees with fewer entries than DU_CACHE_MIN_ENTRIES are cheap to walk
+ * again and are not cached, except for the directory that was asked for */
+#define DU_CACHE_ENTRIES 64
+#define DU_CACHE_MIN_ENTRIES 256
+#define DU_MAX_DEPTH 64
+#define DU_PROGRESS_INTERVAL (1000 * 1000)
+
+/* SITE FIND filename index: the index thread crawls FIDX_CRAWL_BATCH
+ * directories at a time and backs off further while transfers run */
+#define DEFAULT_FIDX_MAX_NODES (64 * 1024)
+#define FIDX_MAGIC 0x58444946
+#define FIDX_VERSION 1
+#define FIDX_NONE 0xFFFFFFFF
+#define FIDX_TOMBSTONE 0xFFFFFFFE
+#define FIDX_DIR 0x01
+#define FIDX_DELETED 0x02
+#define FIDX_MAX_DEPTH 64
+#define FIDX_THREAD_PRIORITY (FTP_THREAD_PRIORITY + 0x20)
+#define FIDX_CRAWL_BATCH 16
+#define FIDX_CRAWL_DELAY (20 * 1000)
+#define FIDX_CRAWL_BUSY_DELAY (200 * 1000)
+#define FIDX_SAVE_INTERVAL (60 * 1000 * 1000)
+#define FIND_OUT_SIZE (32 * 1024)
+
+#define LIST_BATCH_SIZE (8 * 1024)
+
+/* Read-only HTTP frontend, off unless http_port is set */
+#define HTTP_HEADER_MAX (4 * 1024)
+#define HTTP_BODY_BUF_SIZE (8 * 1024)
+#define HTTP_KEEPALIVE_TIMEOUT (15 * 1000 * 1000)
+/* Path buffers live in the connection's http_scratch, the stack only
+ * holds the frames of the request handlers and the sce* calls */
+#define HTTP_CLIENT_STACK_SIZE 0x8000
+
+/* SITE BLOCKSUMS / SITE DELTA */
+#define MIN_BLOCKSUM_SIZE 512
+#define MAX_BLOCKSUM_SIZE (1024 * 1024)
+#define BLOCKSUM_RECORD_SIZE 12
+#define DELTA_OP_END 0x00
+#define DELTA_OP_COPY 0x01
+#define DELTA_OP_LITERAL 0x02
+#define FNV64_INIT 0xCBF29CE484222325ULL
+#define FNV64_PRIME 0x00000100000001B3ULL
+
+/* Read-ahead of the next file of a listing */
+#define PREFETCH_THREAD_PRIORITY (FTP_THREAD_PRIORITY + 0x10)
+#define PREFETCH_LIST_SIZE (64 * 1024)
+#define DEFAULT_PREFETCH_SIZE (256 * 1024)
+#define DEFAULT_PREFETCH_MAX (1024 * 1024)
+
+/* Partial uploads journal */
+#define JOURNAL_MAX_ENTRIES 16
+#define JOURNAL_MAGIC 0x314A5055 /* "UPJ1" */
+/* Bytes before the journaled offset that must still match on resume */
+#define JOURNAL_TAIL_SIZE (64 * 1024)
+/* Running uploads are synced and journaled this often */
+#define JOURNAL_CHECKPOINT_SIZE (8 * 1024 * 1024)
+#define LIST_RECURSIVE 0x01
+#define LIST_MLSD 0x02
+#define DEFAULT_LIST_MAX_DEPTH 32
+#define DEFAULT_LIST_STACK_SIZE (64 * 1024)
 
 /* PSVita paths are in the form:
  *     <device name>:<filename in device>
@@ -40,8 +148,15 @@ typedef struct {
 } cmd_dispatch_entry;
 
 static struct {
-	char name[PATH_MAX];
+	char name[MAX_DEVNAME];
 	int valid;
+	/* I/O scheduling, protected by sched_mtx. io_slots 0 is unlimited */
+	unsigned int io_slots;
+	unsigned int io_active;
+	unsigned int io_waiting;
+	/* Running transfers and their weight, for the buffer budget */
+	unsigned int xfer_count;
+	unsigned int xfer_weight;
 } device_list[MAX_DEVICES];
 
 static struct {
@@ -50,1036 +165,6698 @@ static struct {
 	int valid;
 } custom_command_dispatchers[MAX_CUSTOM_COMMANDS];
 
+static struct {
+	const char *cmd;
+	cmd_dispatch_func func;
+	int valid;
+} custom_site_dispatchers[MAX_CUSTOM_COMMANDS];
+
 static void *net_memory = NULL;
 static int ftp_initialized = 0;
+static unsigned int ftp_port = FTP_PORT;
+static unsigned int net_init_size = NET_INIT_SIZE;
+static unsigned int client_stack_size = FTP_CLIENT_STACK_SIZE;
+static unsigned int data_sndbuf = 0;
+static unsigned int data_rcvbuf = 0;
 static unsigned int file_buf_size = DEFAULT_FILE_BUF_SIZE;
-static unsigned int active_op_count = 0;
+/* Bumped on every setting change, transfers check it between buffers */
+static unsigned int config_generation = 0;
+static unsigned int interactive_xfer_size = DEFAULT_INTERACTIVE_SIZE;
 static SceNetInAddr vita_addr;
-static SceUID server_thid;
-static int server_sockfd;
-static int number_clients = 0;
-static ftpvita_client_info_t *client_list = NULL;
+static SceUID server_thid = -1;
+static int server_sockfd = -1;
+static volatile int number_clients = 0;
+/* Set while client_list_thread_end() is closing the sessions */
+static volatile int sessions_closing = 0;
+static unsigned int max_sessions = DEFAULT_MAX_SESSIONS;
+static unsigned int http_port = 0;
+static SceUID http_server_thid = -1;
+static int http_server_sockfd = -1;
+static unsigned int list_max_depth = DEFAULT_LIST_MAX_DEPTH;
+static unsigned int list_stack_size = DEFAULT_LIST_STACK_SIZE;
+
+/* Passive mode listeners, bound once and leased to one client at a time */
+static struct {
+	int sockfd;
+	unsigned short port;
+	ftpvita_client_info_t *owner;
+} pasv_pool[MAX_PASV_LISTENERS];
+static SceUID pasv_pool_mtx;
+static unsigned int pasv_port_min = DEFAULT_PASV_PORT_MIN;
+static unsigned int pasv_port_max = DEFAULT_PASV_PORT_MAX;
+/* Session registry:
+ * slots are claimed with atomics and hold the thread of their session,
+ * which can be read without locking. Dereferencing the client needs
+ * client_list_mtx, sessions unregister under it before freeing themselves */
+static struct {
+	volatile int used;
+	unsigned int generation;
+	volatile SceUID thid;
+	ftpvita_client_info_t *client;
+} session_slots[MAX_SESSIONS];
 static SceUID client_list_mtx;
+static unsigned int shutdown_sessions = 0;
+static SceUInt64 shutdown_time = 0;
+
+/* Transfer scheduler state, protected by sched_mtx */
+static SceUID sched_mtx;
+static ftpvita_token_bucket_t global_bucket;
+static unsigned int session_rate_limit = 0;
+static unsigned int sched_total_weight = 0;
+static int sched_interactive_count = 0;
+static int sched_xfer_count = 0;
+/* Transfers without a device slot (listings, extensions) */
+static unsigned int sched_other_count = 0;
+static unsigned int sched_other_weight = 0;
+/* Bit n is set when device n frees an I/O slot */
+static SceUID device_evf;
+
+/* Transfer buffer accounting, protected by sched_mtx */
+static unsigned int mem_xfer_bufs = 0;
+static unsigned int mem_xfer_bufs_peak = 0;
+
+/* Activity events for the power management of the application */
+static SceUID activity_evf;
+static SceUInt64 last_activity;
+static unsigned int activity_wakeups = 0;
+
+/* Load-aware thread policy, protected by sched_mtx */
+static SceUID load_thid;
+static SceUID load_sema;
+static int load_thread_run = 0;
+static SceUInt64 load_stamp;
+static ftpvita_sched_stats_t load_stats;
+
+/* SITE DU subtree cache, protected by du_cache_mtx */
+typedef struct {
+	SceOff bytes;
+	unsigned int files;
+	unsigned int dirs;
+} du_totals;
+
+/* A directory being walked by SITE DU. Its subdirectory names are
+ * kept in the walk's name stack from names_start to names_end */
+typedef struct {
+	unsigned int path_len;
+	unsigned int names_start;
+	unsigned int names_end;
+	unsigned int next;
+	/* Something below could not be read, the totals are not cached */
+	int partial;
+	du_totals totals;
+} du_frame;
+
+typedef struct {
+	char *buf;
+	unsigned int len;
+	unsigned int size;
+} du_names;
+
+static struct {
+	char *path;
+	du_totals totals;
+	SceUInt64 stamp;
+} du_cache[DU_CACHE_ENTRIES];
+static SceUID du_cache_mtx;
+static unsigned int du_cache_generation = 0;
+static unsigned int du_cache_hits = 0;
+static unsigned int du_cache_misses = 0;
+
+/* SITE FIND filename index, one per device. Node 0 is the device root,
+ * names are kept in a single pool and looked up through an open
+ * addressing hash of (parent, name). Protected by fidx_mtx; only the
+ * index thread renumbers nodes. */
+typedef struct {
+	unsigned int parent;
+	unsigned int name;
+	unsigned short flags;
+	unsigned short round;
+} fidx_node;
+
+typedef struct {
+	char device[MAX_DEVNAME];
+	fidx_node *nodes;
+	unsigned int count;
+	unsigned int cap;
+	char *names;
+	unsigned int names_len;
+	unsigned int names_cap;
+	unsigned int *hash;
+	unsigned int hash_cap;
+	unsigned int hash_used;
+	unsigned int cursor;
+	unsigned short round;
+	int scanning;
+	int ready;
+	int full;
+	int dirty;
+} fidx_index;
+
+typedef struct {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int count;
+	unsigned int names_len;
+	unsigned int round;
+} fidx_file_header;
+
+static fidx_index *fidx_list[MAX_DEVICES];
+static SceUID fidx_mtx;
+static SceUID fidx_thid;
+static SceUID fidx_sema;
+static int fidx_thread_run = 0;
+static unsigned int fidx_max_nodes = DEFAULT_FIDX_MAX_NODES;
+static char fidx_dir[256];
+static SceUID journal_mtx;
+static char journal_path[256];
 
 static int netctl_init = -1;
 static int net_init = -1;
 
-static void(*notif_log_cb)(const char *) = NULL;
-static void (*info_log_cb)(const char *) = NULL;
-static void (*debug_log_cb)(const char *) = NULL;
+static ftpvita_xfer_cb_t xfer_cb = NULL;
+static ftpvita_addr_cb_t addr_cb = NULL;
+
+/* Network state is followed through netctl events, the listeners run
+ * only while an IP address is held */
+#define NET_THREAD_PRIORITY (FTP_THREAD_PRIORITY - 1)
+/* netctl callbacks are only delivered by sceNetCtlCheckCallback() */
+#define NET_CHECK_INTERVAL (250 * 1000)
+#define NET_RETRY_DELAY (1000 * 1000)
+#define NET_EVENT_CHANGED 1
+#define NET_EVENT_LISTEN_FAILED 2
+#define NET_EVENT_STOP 4
+
+static SceUID net_thid = -1;
+static SceUID net_evf = -1;
+static int net_thread_run = 0;
+static volatile int net_listening = 0;
+static int netctl_cid = -1;
+
+/* Log records go through a lock-free ring and are written out by a low
+ * priority drain thread, logging never waits on file or notification I/O.
+ * A slot is free for position pos when its seq equals the round base of
+ * pos and holds a record when it equals base + 1, so the zeroed ring is
+ * ready before ftpvita_init() */
+#define LOG_RING_SLOTS 256
+#define LOG_RING_MASK (LOG_RING_SLOTS - 1)
+#define LOG_MSG_SIZE 200
+#define LOG_WRITE_BUF_SIZE (4 * 1024)
+#define LOG_THREAD_PRIORITY (FTP_THREAD_PRIORITY + 0x20)
+#define LOG_DRAIN_EVENT 1
+#define DEFAULT_LOG_FILE_SIZE (256 * 1024)
+
+enum {
+	LOG_LEVEL_NOTIF,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG,
+	LOG_LEVELS
+};
 
-static void log_func(ftpvita_log_cb_t log_cb, const char *s, ...)
+typedef struct {
+	volatile int seq;
+	int level;
+	SceUInt64 time;
+	char msg[LOG_MSG_SIZE];
+} log_record;
+
+static log_record log_ring[LOG_RING_SLOTS];
+static volatile int log_head = 0;
+static int log_tail = 0;
+static volatile int log_dropped = 0;
+static volatile int log_drain_idle = 0;
+static ftpvita_log_cb_t log_cbs[LOG_LEVELS];
+
+static unsigned int log_level = LOG_LEVEL_INFO;
+static unsigned int log_file_size = DEFAULT_LOG_FILE_SIZE;
+static char log_path[256];
+static SceUID log_thid;
+static SceUID log_evf;
+static volatile int log_thread_run = 0;
+static SceUID log_fd = -1;
+static SceOff log_file_pos;
+static char log_write_buf[LOG_WRITE_BUF_SIZE];
+static unsigned int log_write_len = 0;
+
+static void log_func(int level, const char *s, ...)
 {
-	if (log_cb) {
-		char buf[256];
-		va_list argptr;
-		va_start(argptr, s);
-		vsnprintf(buf, sizeof(buf), s, argptr);
-		va_end(argptr);
-		log_cb(buf);
+	log_record *rec;
+	va_list argptr;
+	int pos, diff;
+
+	if (!log_cbs[level] && (level > (int)log_level || !log_path[0]))
+		return;
+
+	pos = log_head;
+	while (1) {
+		rec = &log_ring[pos & LOG_RING_MASK];
+		diff = rec->seq - (pos & ~LOG_RING_MASK);
+		if (diff == 0) {
+			if (sceKernelAtomicCompareAndSet32(&log_head, pos, pos + 1) == pos)
+				break;
+			pos = log_head;
+		} else if (diff < 0) {
+			/* Full, the drain thread is behind */
+			sceKernelAtomicAddAndGet32(&log_dropped, 1);
+			return;
+		} else {
+			pos = log_head;
+		}
 	}
+
+	rec->level = level;
+	rec->time = sceKernelGetProcessTimeWide();
+	va_start(argptr, s);
+	vsnprintf(rec->msg, sizeof(rec->msg), s, argptr);
+	va_end(argptr);
+
+	/* Publish the record */
+	sceKernelAtomicGetAndSet32(&rec->seq, (pos & ~LOG_RING_MASK) + 1);
+
+	if (log_thread_run && log_drain_idle && sceKernelAtomicGetAndSet32(&log_drain_idle, 0))
+		sceKernelSetEventFlag(log_evf, LOG_DRAIN_EVENT);
 }
 
-#define NOTIFICATION(...) log_func(notif_log_cb, __VA_ARGS__)
-#define INFO(...) log_func(info_log_cb, __VA_ARGS__)
-#define DEBUG(...) log_func(debug_log_cb, __VA_ARGS__)
+#define NOTIFICATION(...) log_func(LOG_LEVEL_NOTIF, __VA_ARGS__)
+#define INFO(...) log_func(LOG_LEVEL_INFO, __VA_ARGS__)
+#define DEBUG(...) log_func(LOG_LEVEL_DEBUG, __VA_ARGS__)
 
-#define client_send_ctrl_msg(cl, str) \
-	sceNetSend(cl->ctrl_sockfd, str, strlen(str), 0)
+static void log_file_open(void)
+{
+	if (!log_path[0])
+		return;
 
-static inline void client_send_data_msg(ftpvita_client_info_t *client, const char *str)
+	log_fd = sceIoOpen(log_path, SCE_O_CREAT | SCE_O_WRONLY | SCE_O_APPEND, 0777);
+	if (log_fd >= 0)
+		log_file_pos = sceIoLseek(log_fd, 0, SCE_SEEK_END);
+}
+
+static void log_flush(void)
 {
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		sceNetSend(client->data_sockfd, str, strlen(str), 0);
-	} else {
-		sceNetSend(client->pasv_sockfd, str, strlen(str), 0);
+	char old_path[sizeof(log_path) + 2];
+
+	if (log_fd < 0 || log_write_len == 0)
+		return;
+
+	/* Keep one previous file around */
+	if (log_file_pos + log_write_len > log_file_size) {
+		sceIoClose(log_fd);
+		snprintf(old_path, sizeof(old_path), "%s.1", log_path);
+		sceIoRemove(old_path);
+		sceIoRename(log_path, old_path);
+		log_file_open();
+		if (log_fd < 0) {
+			log_write_len = 0;
+			return;
+		}
 	}
+
+	sceIoWrite(log_fd, log_write_buf, log_write_len);
+	log_file_pos += log_write_len;
+	log_write_len = 0;
 }
 
-static inline int client_recv_data_raw(ftpvita_client_info_t *client, void *buf, unsigned int len)
+static void log_write(const log_record *rec)
 {
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		return sceNetRecv(client->data_sockfd, buf, len, 0);
-	} else {
-		return sceNetRecv(client->pasv_sockfd, buf, len, 0);
-	}
+	static const char level_chars[LOG_LEVELS] = {'N', 'I', 'D'};
+	unsigned int len = strlen(rec->msg);
+
+	/* Most messages carry their own newline */
+	if (len > 0 && rec->msg[len - 1] == '\n')
+		len--;
+
+	if (log_write_len + len + 32 > sizeof(log_write_buf))
+		log_flush();
+
+	log_write_len += snprintf(log_write_buf + log_write_len, sizeof(log_write_buf) - log_write_len,
+		"%u.%03u %c %.*s\n", (unsigned int)(rec->time / 1000000), (unsigned int)(rec->time / 1000 % 1000),
+		level_chars[rec->level], (int)len, rec->msg);
 }
 
-static inline void client_send_data_raw(ftpvita_client_info_t *client, const void *buf, unsigned int len)
+/* Only called by the drain thread, or once it has stopped */
+static int log_drain(void)
 {
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		sceNetSend(client->data_sockfd, buf, len, 0);
-	} else {
-		sceNetSend(client->pasv_sockfd, buf, len, 0);
+	log_record *rec;
+	ftpvita_log_cb_t cb;
+	int count = 0;
+
+	while (1) {
+		rec = &log_ring[log_tail & LOG_RING_MASK];
+		if (rec->seq - (log_tail & ~LOG_RING_MASK) != 1)
+			break;
+
+		if ((cb = log_cbs[rec->level]))
+			cb(rec->msg);
+		if (log_fd >= 0 && rec->level <= (int)log_level)
+			log_write(rec);
+
+		/* Hand the slot back for the next round */
+		sceKernelAtomicGetAndSet32(&rec->seq, (log_tail & ~LOG_RING_MASK) + LOG_RING_SLOTS);
+		log_tail++;
+		count++;
 	}
+
+	return count;
 }
 
-static inline const char *get_vita_path(const char *path)
+static int log_thread(SceSize args, void *argp)
 {
-	if (strlen(path) > 1)
-		/* /cache0:/foo/bar -> cache0:/foo/bar */
-		return &path[1];
-	else
-		return NULL;
+	log_file_open();
+
+	while (log_thread_run) {
+		/* Producers seeing the idle flag wake us up, the ring is
+		 * checked once more after setting it so nothing is missed */
+		log_drain_idle = 1;
+		if (log_drain() == 0) {
+			log_flush();
+			sceKernelWaitEventFlag(log_evf, LOG_DRAIN_EVENT,
+				SCE_KERNEL_EVF_WAITMODE_OR | SCE_KERNEL_EVF_WAITMODE_CLEAR_ALL, NULL, NULL);
+		}
+	}
+
+	log_drain();
+	log_flush();
+	if (log_fd >= 0) {
+		sceIoClose(log_fd);
+		log_fd = -1;
+	}
+
+	sceKernelExitDeleteThread(0);
+	return 0;
 }
 
-static int file_exists(const char *path)
+static void log_start(void)
 {
-	SceIoStat stat;
-	return (sceIoGetstat(path, &stat) >= 0);
+	log_evf = sceKernelCreateEventFlag("FTPVita_log_evf", 0, 0, NULL);
+	log_thid = sceKernelCreateThread("FTPVita_log_thread",
+		log_thread, LOG_THREAD_PRIORITY, 0x2000, 0, 0, NULL);
+	log_thread_run = 1;
+	sceKernelStartThread(log_thid, 0, NULL);
 }
 
-static void cmd_NOOP_func(ftpvita_client_info_t *client)
+static void log_stop(void)
 {
-	client_send_ctrl_msg(client, "200 No operation ;)" FTPVITA_EOL);
+	log_thread_run = 0;
+	sceKernelSetEventFlag(log_evf, LOG_DRAIN_EVENT);
+	sceKernelWaitThreadEnd(log_thid, NULL, NULL);
+	sceKernelDeleteEventFlag(log_evf);
 }
 
-static void cmd_USER_func(ftpvita_client_info_t *client)
+/* Tracing:
+ * spans around commands, filesystem calls, data connection setup and
+ * transfer loops. Each span goes into a log2 latency histogram for its
+ * name and into a ring of recent spans for the Chrome trace export,
+ * both updated with atomics only */
+#define TRACE_RING_SLOTS 1024
+#define TRACE_RING_MASK (TRACE_RING_SLOTS - 1)
+#define TRACE_MAX_NAMES 64
+#define TRACE_NAME_SIZE 12
+/* Bucket i counts spans shorter than 2^i microseconds, the last one the rest */
+#define TRACE_BUCKETS 24
+
+enum {
+	TRACE_CMD,
+	TRACE_FS,
+	TRACE_NET,
+	TRACE_XFER,
+};
+
+static const char *const trace_cat_names[] = {"cmd", "fs", "net", "xfer"};
+
+typedef struct {
+	volatile int seq;
+	int session;
+	SceUInt64 start;
+	unsigned int dur;
+	unsigned char cat;
+	char name[TRACE_NAME_SIZE];
+} trace_span;
+
+typedef struct {
+	char name[TRACE_NAME_SIZE];
+	unsigned char cat;
+	volatile int count;
+	volatile int max;
+	volatile SceInt64 total;
+	volatile int buckets[TRACE_BUCKETS];
+} trace_stat;
+
+static trace_span trace_ring[TRACE_RING_SLOTS];
+static volatile int trace_head = 0;
+static trace_stat trace_stats[TRACE_MAX_NAMES];
+/* Stats are published by bumping the count after filling them in */
+static volatile int trace_stat_count = 0;
+static SceUID trace_mtx;
+static unsigned int trace_enabled = 1;
+
+static inline SceUInt64 trace_begin(void)
 {
-	client_send_ctrl_msg(client, "331 Username OK, need password b0ss." FTPVITA_EOL);
+	return trace_enabled ? sceKernelGetProcessTimeWide() : 0;
 }
 
-static void cmd_PASS_func(ftpvita_client_info_t *client)
+static trace_stat *trace_find_stat(int cat, const char *name)
 {
-	client_send_ctrl_msg(client, "230 User logged in!" FTPVITA_EOL);
+	trace_stat *stat;
+	int count = trace_stat_count;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (trace_stats[i].cat == cat && strcmp(trace_stats[i].name, name) == 0)
+			return &trace_stats[i];
+	}
+
+	/* New names are rare, they are added under the lock */
+	sceKernelLockMutex(trace_mtx, 1, NULL);
+	for (; i < trace_stat_count; i++) {
+		if (trace_stats[i].cat == cat && strcmp(trace_stats[i].name, name) == 0)
+			break;
+	}
+	if (i == trace_stat_count && i < TRACE_MAX_NAMES) {
+		stat = &trace_stats[i];
+		memset(stat, 0, sizeof(*stat));
+		snprintf(stat->name, sizeof(stat->name), "%s", name);
+		stat->cat = cat;
+		sceKernelAtomicAddAndGet32(&trace_stat_count, 1);
+	}
+	sceKernelUnlockMutex(trace_mtx, 1);
+
+	return i < TRACE_MAX_NAMES ? &trace_stats[i] : NULL;
 }
 
-static void cmd_QUIT_func(ftpvita_client_info_t *client)
+static void trace_end(int cat, const char *name, const ftpvita_client_info_t *client, SceUInt64 start)
 {
-	client_send_ctrl_msg(client, "221 Goodbye senpai :'(" FTPVITA_EOL);
+	trace_stat *stat;
+	trace_span *span;
+	unsigned int dur;
+	int bucket;
+	int max;
+	int pos;
+
+	if (start == 0)
+		return;
+	dur = sceKernelGetProcessTimeWide() - start;
+
+	if ((stat = trace_find_stat(cat, name)) != NULL) {
+		bucket = dur ? 32 - __builtin_clz(dur) : 0;
+		if (bucket >= TRACE_BUCKETS)
+			bucket = TRACE_BUCKETS - 1;
+		sceKernelAtomicAddAndGet32(&stat->buckets[bucket], 1);
+		sceKernelAtomicAddAndGet32(&stat->count, 1);
+		sceKernelAtomicAddAndGet64(&stat->total, dur);
+		while ((max = stat->max) < (int)dur &&
+		       sceKernelAtomicCompareAndSet32(&stat->max, max, dur) != max)
+			;
+	}
+
+	/* Readers skip a slot while its seq doesn't match its position */
+	pos = sceKernelAtomicGetAndAdd32(&trace_head, 1);
+	span = &trace_ring[pos & TRACE_RING_MASK];
+	sceKernelAtomicGetAndSet32(&span->seq, 0);
+	span->session = client ? client->num : -1;
+	span->start = start;
+	span->dur = dur;
+	span->cat = cat;
+	snprintf(span->name, sizeof(span->name), "%s", name);
+	sceKernelAtomicGetAndSet32(&span->seq, pos + 1);
 }
 
-static void cmd_SYST_func(ftpvita_client_info_t *client)
+/* Upper bound in microseconds of the bucket holding the given fraction */
+static unsigned int trace_percentile(const trace_stat *stat, int count, unsigned int permille)
 {
-	client_send_ctrl_msg(client, "215 UNIX Type: L8" FTPVITA_EOL);
+	unsigned int target = ((SceUInt64)count * permille + 999) / 1000;
+	unsigned int seen = 0;
+	int i;
+
+	for (i = 0; i < TRACE_BUCKETS - 1; i++) {
+		seen += stat->buckets[i];
+		if (seen >= target)
+			return 1U << i;
+	}
+
+	return stat->max;
 }
 
-static void cmd_PASV_func(ftpvita_client_info_t *client)
+static void trace_reset(void)
 {
-	int ret;
-	UNUSED(ret);
-
-	char cmd[512];
-	unsigned int namelen;
-	SceNetSockaddrIn picked;
+	int i;
 
-	/* Create data mode socket name */
-	char data_socket_name[64];
-	sprintf(data_socket_name, "FTPVita_client_%i_data_socket",
-		client->num);
+	sceKernelLockMutex(trace_mtx, 1, NULL);
+	for (i = 0; i < trace_stat_count; i++) {
+		trace_stats[i].count = 0;
+		trace_stats[i].max = 0;
+		trace_stats[i].total = 0;
+		memset((void *)trace_stats[i].buckets, 0, sizeof(trace_stats[i].buckets));
+	}
+	for (i = 0; i < TRACE_RING_SLOTS; i++)
+		trace_ring[i].seq = 0;
+	sceKernelUnlockMutex(trace_mtx, 1);
+}
 
-	/* Create the data socket */
-	client->data_sockfd = sceNetSocket(data_socket_name,
-		SCE_NET_AF_INET,
-		SCE_NET_SOCK_STREAM,
-		0);
+#define ACTIVITY_EVENT 1
 
-	DEBUG("PASV data socket fd: %d\n", client->data_sockfd);
+static inline void activity_signal(void)
+{
+	sceKernelSetEventFlag(activity_evf, ACTIVITY_EVENT);
+}
 
-	/* Fill the data socket address */
-	client->data_sockaddr.sin_family = SCE_NET_AF_INET;
-	client->data_sockaddr.sin_addr.s_addr = sceNetHtonl(SCE_NET_INADDR_ANY);
-	/* Let the PSVita choose a port */
-	client->data_sockaddr.sin_port = sceNetHtons(0);
-
-	/* Bind the data socket address to the data socket */
-	ret = sceNetBind(client->data_sockfd,
-		(SceNetSockaddr *)&client->data_sockaddr,
-		sizeof(client->data_sockaddr));
-	DEBUG("sceNetBind(): 0x%08X\n", ret);
+/* Called for every command and transferred buffer. Only wakes up the
+ * application when activity resumes after a quiet period */
+static inline void activity_touch(void)
+{
+	SceUInt64 now = sceKernelGetProcessTimeWide();
+	SceUInt64 last = last_activity;
 
-	/* Start listening */
-	ret = sceNetListen(client->data_sockfd, 128);
-	DEBUG("sceNetListen(): 0x%08X\n", ret);
+	last_activity = now;
+	if (now - last > ACTIVITY_SIGNAL_GAP)
+		activity_signal();
+}
 
-	/* Get the port that the PSVita has chosen */
-	namelen = sizeof(picked);
-	sceNetGetsockname(client->data_sockfd, (SceNetSockaddr *)&picked,
-		&namelen);
+/* Keeps track of multi-line replies while sending, a "xyz-" line opens
+ * one and a "xyz " line ends it */
+static int client_send_ctrl_msg(ftpvita_client_info_t *client, const char *str)
+{
+	const char *line = str;
+
+	while (line) {
+		if (line[0] >= '0' && line[0] <= '9' && line[1] >= '0' && line[1] <= '9' &&
+		    line[2] >= '0' && line[2] <= '9') {
+			if (line[3] == '-')
+				client->reply_open = 1;
+			else if (line[3] == ' ')
+				client->reply_open = 0;
+		}
+		if ((line = strchr(line, '\n')) != NULL)
+			line++;
+	}
 
-	DEBUG("PASV mode port: 0x%04X\n", picked.sin_port);
+	return sceNetSend(client->ctrl_sockfd, str, strlen(str), 0);
+}
 
-	/* Build the command */
-	sprintf(cmd, "227 Entering Passive Mode (%hhu,%hhu,%hhu,%hhu,%hhu,%hhu)" FTPVITA_EOL,
-		(vita_addr.s_addr >> 0) & 0xFF,
-		(vita_addr.s_addr >> 8) & 0xFF,
-		(vita_addr.s_addr >> 16) & 0xFF,
-		(vita_addr.s_addr >> 24) & 0xFF,
-		(picked.sin_port >> 0) & 0xFF,
-		(picked.sin_port >> 8) & 0xFF);
+/* MODE B block header: descriptor and a 16 bit byte count */
+#define BLOCK_HEADER_SIZE 3
+#define BLOCK_MAX_SIZE 0xFFFF
+#define BLOCK_DESC_EOR 0x80
+#define BLOCK_DESC_EOF 0x40
+#define BLOCK_DESC_ERRORS 0x20
+#define BLOCK_DESC_RESTART 0x10
+
+/* Telnet commands on the control connection. WILL, WONT, DO and DONT
+ * are followed by an option byte */
+#define TELNET_SE 0xF0
+#define TELNET_WILL 0xFB
+#define TELNET_IAC 0xFF
+
+/* Drops telnet commands from control connection data, clients send
+ * IAC IP IAC DM before ABOR. The DM may be sent out of band, leaving a
+ * lone IAC. Returns the new length */
+static int telnet_strip(char *buf, int len)
+{
+	unsigned char *p = (unsigned char *)buf;
+	int i, j = 0;
 
-	client_send_ctrl_msg(client, cmd);
+	for (i = 0; i < len; i++) {
+		if (p[i] != TELNET_IAC) {
+			p[j++] = p[i];
+			continue;
+		}
+		if (i + 1 >= len || p[i + 1] < TELNET_SE)
+			continue;
+		if (p[++i] == TELNET_IAC) {
+			/* Escaped 0xFF data byte */
+			p[j++] = TELNET_IAC;
+			continue;
+		}
+		if (p[i] >= TELNET_WILL && i + 1 < len)
+			i++;
+	}
 
-	/* Set the data connection type to passive! */
-	client->data_con_type = FTP_DATA_CONNECTION_PASSIVE;
+	return j;
 }
 
-static void cmd_PORT_func(ftpvita_client_info_t *client)
+static inline char ascii_lower(char c)
 {
-	unsigned int data_ip[4];
-	unsigned int porthi, portlo;
-	unsigned short data_port;
-	char ip_str[16];
-	SceNetInAddr data_addr;
-
-	/* Using ints because of newlibc's u8 sscanf bug */
-	sscanf(client->recv_cmd_args, "%d,%d,%d,%d,%d,%d",
-		&data_ip[0], &data_ip[1], &data_ip[2], &data_ip[3],
-		&porthi, &portlo);
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
 
-	data_port = portlo + porthi*256;
+static inline char ascii_upper(char c)
+{
+	return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
 
-	/* Convert to an X.X.X.X IP string */
-	sprintf(ip_str, "%d.%d.%d.%d",
-		data_ip[0], data_ip[1], data_ip[2], data_ip[3]);
+/* Commands are case-insensitive, cmd is given in upper case */
+static int ctrl_line_is(const char *line, const char *cmd)
+{
+	while (*cmd && ascii_upper(*line) == *cmd) {
+		line++;
+		cmd++;
+	}
 
-	/* Convert the IP to a SceNetInAddr */
-	sceNetInetPton(SCE_NET_AF_INET, ip_str, &data_addr);
+	return *cmd == '\0' && (*line == '\0' || *line == ' ' || *line == '\r' || *line == '\n');
+}
 
-	DEBUG("PORT connection to client's IP: %s Port: %d\n", ip_str, data_port);
+/* STAT reply while a transfer is queued or running */
+static void client_send_xfer_status(ftpvita_client_info_t *client)
+{
+	char msg[128];
+	SceUInt64 elapsed;
 
-	/* Create data mode socket name */
-	char data_socket_name[64];
-	sprintf(data_socket_name, "FTPVita_client_%i_data_socket",
-		client->num);
+	client_send_ctrl_msg(client, "213-Status of the transfer:" FTPVITA_EOL);
+	if (client->xfer_class == FTP_XFER_NONE) {
+		client_send_ctrl_msg(client, " Queued, waiting for the device" FTPVITA_EOL);
+	} else {
+		elapsed = sceKernelGetProcessTimeWide() - client->xfer_start;
+		snprintf(msg, sizeof(msg), " %lld bytes in %llu s, %u KB/s" FTPVITA_EOL,
+			client->xfer_bytes, elapsed / 1000000,
+			elapsed ? (unsigned int)(client->xfer_bytes * 1000000 / 1024 / elapsed) : 0);
+		client_send_ctrl_msg(client, msg);
+	}
+	client_send_ctrl_msg(client, "213 End of status" FTPVITA_EOL);
+}
 
-	/* Create data mode socket */
-	client->data_sockfd = sceNetSocket(data_socket_name,
-		SCE_NET_AF_INET,
-		SCE_NET_SOCK_STREAM,
-		0);
+/* Looks at the control connection once per transfer buffer without
+ * blocking. STAT is answered right away, unless it would land inside an
+ * open multi-line reply. ABOR and a closed control
+ * connection end the transfer, ABOR is left for the command loop to
+ * reply to after the transfer. Other commands wait until the transfer
+ * is over. Returns < 0 if the transfer must stop */
+static int client_ctrl_poll(ftpvita_client_info_t *client)
+{
+	char buf[sizeof(client->recv_buffer)];
+	char *eol;
+	int n, raw;
 
-	DEBUG("Client %i data socket fd: %d\n", client->num,
-		client->data_sockfd);
+	n = sceNetRecv(client->ctrl_sockfd, buf, sizeof(buf) - 1, SCE_NET_MSG_PEEK | SCE_NET_MSG_DONTWAIT);
+	if (n == 0) {
+		client->data_error = 1;
+		return -1;
+	}
+	/* Nothing pending, errors are left for the command loop */
+	if (n < 0 || (eol = memchr(buf, '\n', n)) == NULL)
+		return 0;
+
+	raw = eol - buf + 1;
+	n = telnet_strip(buf, raw);
+	buf[n] = '\0';
+
+	if (ctrl_line_is(buf, "ABOR")) {
+		INFO("\t%i> ABOR during transfer\n", client->num);
+		client->xfer_aborted = 1;
+		client->data_error = 1;
+		return -1;
+	}
 
-	/* Prepare socket address for the data connection */
-	client->data_sockaddr.sin_family = SCE_NET_AF_INET;
-	client->data_sockaddr.sin_addr = data_addr;
-	client->data_sockaddr.sin_port = sceNetHtons(data_port);
+	if (ctrl_line_is(buf, "STAT") && !client->reply_open) {
+		sceNetRecv(client->ctrl_sockfd, buf, raw, 0);
+		client_send_xfer_status(client);
+	}
 
-	/* Set the data connection type to active! */
-	client->data_con_type = FTP_DATA_CONNECTION_ACTIVE;
+	return 0;
+}
 
-	client_send_ctrl_msg(client, "200 PORT command successful!" FTPVITA_EOL);
+static inline int client_data_sockfd(ftpvita_client_info_t *client)
+{
+	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE)
+		return client->data_sockfd;
+	else
+		return client->pasv_sockfd;
 }
 
-static void client_open_data_connection(ftpvita_client_info_t *client)
+static int client_send_data_all(ftpvita_client_info_t *client, const void *buf, unsigned int len)
 {
 	int ret;
-	UNUSED(ret);
+	unsigned int sent = 0;
 
-	unsigned int addrlen;
+	while (sent < len) {
+		ret = sceNetSend(client_data_sockfd(client), (const char *)buf + sent, len - sent, 0);
+		if (ret <= 0) {
+			client->data_error = 1;
+			return ret < 0 ? ret : -1;
+		}
+		sent += ret;
+	}
 
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		/* Connect to the client using the data socket */
-		ret = sceNetConnect(client->data_sockfd,
-			(SceNetSockaddr *)&client->data_sockaddr,
-			sizeof(client->data_sockaddr));
+	return sent;
+}
 
-		DEBUG("sceNetConnect(): 0x%08X\n", ret);
-	} else {
-		/* Listen to the client using the data socket */
-		addrlen = sizeof(client->pasv_sockaddr);
-		client->pasv_sockfd = sceNetAccept(client->data_sockfd,
-			(SceNetSockaddr *)&client->pasv_sockaddr,
-			&addrlen);
-		DEBUG("PASV client fd: 0x%08X\n", client->pasv_sockfd);
+static int client_recv_data_all(ftpvita_client_info_t *client, void *buf, unsigned int len)
+{
+	int ret;
+	unsigned int recvd = 0;
+
+	while (recvd < len) {
+		ret = sceNetRecv(client_data_sockfd(client), (char *)buf + recvd, len - recvd, 0);
+		if (ret <= 0) {
+			client->data_error = 1;
+			return ret;
+		}
+		recvd += ret;
 	}
+
+	return recvd;
 }
 
-static void client_close_data_connection(ftpvita_client_info_t *client)
+static int client_send_block_header(ftpvita_client_info_t *client, unsigned char desc, unsigned int count)
 {
-	sceNetSocketClose(client->data_sockfd);
-	/* In passive mode we have to close the client pasv socket too */
-	if (client->data_con_type == FTP_DATA_CONNECTION_PASSIVE) {
-		sceNetSocketClose(client->pasv_sockfd);
-	}
-	client->data_con_type = FTP_DATA_CONNECTION_NONE;
+	unsigned char header[BLOCK_HEADER_SIZE];
+
+	header[0] = desc;
+	header[1] = (count >> 8) & 0xFF;
+	header[2] = count & 0xFF;
+
+	return client_send_data_all(client, header, sizeof(header));
 }
 
-static int gen_list_format(char *out, int n, int dir, const SceIoStat *stat, const char *filename)
+static inline int client_send_data_raw(ftpvita_client_info_t *client, const void *buf, unsigned int len)
 {
-	static const char num_to_month[][4] = {
-		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
-	};
+	unsigned int chunk;
+	unsigned int sent = 0;
 
-	char yt[6];
-	SceDateTime cdt;
-	sceRtcGetCurrentClockLocalTime(&cdt);
+	if (client_ctrl_poll(client) < 0)
+		return -1;
 
-	if  (cdt.year == stat->st_mtime.year) {
-		snprintf(yt, sizeof(yt), "%02d:%02d", stat->st_mtime.hour, stat->st_mtime.minute);
+	if (client->transfer_mode == FTP_TRANSFER_MODE_STREAM) {
+		if (sceNetSend(client_data_sockfd(client), buf, len, 0) < 0) {
+			client->data_error = 1;
+			return -1;
+		}
+		return len;
 	}
-	else {
-		snprintf(yt, sizeof(yt), "%04d", stat->st_mtime.year);
+
+	while (sent < len) {
+		chunk = len - sent;
+		if (chunk > BLOCK_MAX_SIZE)
+			chunk = BLOCK_MAX_SIZE;
+		if (client_send_block_header(client, 0, chunk) < 0 ||
+			client_send_data_all(client, (const char *)buf + sent, chunk) < 0)
+			return -1;
+		sent += chunk;
 	}
 
-	return snprintf(out, n,
-		"%c%s 1 vita vita %u %s %-2d %s %s" FTPVITA_EOL,
-		dir ? 'd' : '-',
-		dir ? "rwxr-xr-x" : "rw-r--r--",
-		(unsigned int) stat->st_size,
-		num_to_month[stat->st_mtime.month<=0?0:(stat->st_mtime.month-1)%12],
-		stat->st_mtime.day,
-		yt,
-		filename);
+	return sent;
 }
 
-static void send_LIST(ftpvita_client_info_t *client, const char *path)
+static inline void client_send_data_msg(ftpvita_client_info_t *client, const char *str)
 {
-	int i;
-	char buffer[512];
-	SceUID dir;
-	SceIoDirent dirent;
-	SceIoStat stat;
-	char *devname;
-	int send_devices = 0;
+	client_send_data_raw(client, str, strlen(str));
+}
 
-	/* "/" path is a special case, if we are here we have
-	 * to send the list of devices (aka mountpoints). */
-	if (strcmp(path, "/") == 0) {
-		send_devices = 1;
-	}
+/* Returns the received bytes, 0 at the end of the transfer, < 0 on error */
+static inline int client_recv_data_raw(ftpvita_client_info_t *client, void *buf, unsigned int len)
+{
+	int ret;
+	unsigned char header[BLOCK_HEADER_SIZE];
+	unsigned char skip[64];
 
-	if (!send_devices) {
-		dir = sceIoDopen(get_vita_path(path));
-		if (dir < 0) {
-			client_send_ctrl_msg(client, "550 Invalid directory." FTPVITA_EOL);
-			return;
-		}
-	}
+	if (client_ctrl_poll(client) < 0)
+		return -1;
 
-	client_send_ctrl_msg(client, "150 Opening ASCII mode data transfer for LIST." FTPVITA_EOL);
+	if (client->transfer_mode == FTP_TRANSFER_MODE_STREAM)
+		return sceNetRecv(client_data_sockfd(client), buf, len, 0);
 
-	client_open_data_connection(client);
+	while (client->block_remaining == 0) {
+		if (client->block_eof)
+			return 0;
 
-	if (send_devices) {
-		for (i = 0; i < MAX_DEVICES; i++) {
-			if (device_list[i].valid) {
-				devname = device_list[i].name;
-				if (sceIoGetstat(devname, &stat) >= 0) {
-					gen_list_format(buffer, sizeof(buffer),	1, &stat, devname);
-					client_send_data_msg(client, buffer);
-				}
-			}
-		}
-	} else {
-		memset(&dirent, 0, sizeof(dirent));
+		ret = client_recv_data_all(client, header, sizeof(header));
+		if (ret <= 0)
+			return ret < 0 ? ret : -1;
 
-		while (sceIoDread(dir, &dirent) > 0) {
-			gen_list_format(buffer, sizeof(buffer), SCE_STM_ISDIR(dirent.d_stat.st_mode),
-				&dirent.d_stat, dirent.d_name);
-			client_send_data_msg(client, buffer);
-			memset(&dirent, 0, sizeof(dirent));
-			memset(buffer, 0, sizeof(buffer));
-		}
+		client->block_remaining = (header[1] << 8) | header[2];
+		client->block_eof = (header[0] & BLOCK_DESC_EOF) != 0;
 
-		sceIoDclose(dir);
+		/* Restart markers carry no file data */
+		while ((header[0] & BLOCK_DESC_RESTART) && client->block_remaining) {
+			ret = client_recv_data_all(client, skip,
+				client->block_remaining < sizeof(skip) ? client->block_remaining : sizeof(skip));
+			if (ret <= 0)
+				return ret < 0 ? ret : -1;
+			client->block_remaining -= ret;
+		}
 	}
 
-	DEBUG("Done sending LIST\n");
+	if (len > client->block_remaining)
+		len = client->block_remaining;
 
-	client_close_data_connection(client);
-	client_send_ctrl_msg(client, "226 Transfer complete." FTPVITA_EOL);
+	ret = sceNetRecv(client_data_sockfd(client), buf, len, 0);
+	if (ret <= 0) {
+		client->data_error = 1;
+		return ret < 0 ? ret : -1;
+	}
+	client->block_remaining -= ret;
+
+	return ret;
 }
 
-static void cmd_LIST_func(ftpvita_client_info_t *client)
-{
-	char list_path[PATH_MAX];
-	int list_cur_path = 1;
+/* Transfer scheduler:
+ * Every transfer draws from the global token bucket and from the token
+ * bucket of its session. Bulk transfers are granted buffers proportional
+ * to their weight, so each round of the buckets hands out bytes in the
+ * same proportion (deficit round robin with weighted quanta).
+ * Interactive transfers (LIST, small RETR) never wait on the buckets and
+ * make bulk transfers yield while they run; the bytes they send are still
+ * accounted, so bulk transfers pay back the debt afterwards. */
 
-	int n = sscanf(client->recv_cmd_args, "%[^\r\n\t]", list_path);
+static void bucket_refill(ftpvita_token_bucket_t *bucket, unsigned int rate, SceUInt64 now)
+{
+	SceInt64 burst;
 
-	if (n > 0 && file_exists(get_vita_path(list_path)))
-		list_cur_path = 0;
+	bucket->rate = rate;
+	if (rate == 0) {
+		bucket->tokens = 0;
+		bucket->stamp = now;
+		return;
+	}
 
-	if (list_cur_path)
-		send_LIST(client, client->cur_path);
-	else
-		send_LIST(client, list_path);
-}
+	/* Allow bursts of a quarter of a second */
+	burst = rate / 4;
+	if (burst < MIN_XFER_BUF_SIZE)
+		burst = MIN_XFER_BUF_SIZE;
 
-static void cmd_PWD_func(ftpvita_client_info_t *client)
-{
-	char msg[PATH_MAX];
-	snprintf(msg, sizeof(msg), "257 \"%s\" is the current directory." FTPVITA_EOL, client->cur_path);
-	client_send_ctrl_msg(client, msg);
+	bucket->tokens += (SceInt64)((now - bucket->stamp) * rate / 1000000);
+	if (bucket->tokens > burst)
+		bucket->tokens = burst;
+	bucket->stamp = now;
 }
 
-static int path_is_at_root(const char *path)
+/* Returns the microseconds until the bucket is out of debt */
+static SceUInt64 bucket_delay(const ftpvita_token_bucket_t *bucket)
 {
-	return strrchr(path, '/') == (path + strlen(path) - 1);
+	if (bucket->rate == 0 || bucket->tokens >= 0)
+		return 0;
+	return (SceUInt64)(-bucket->tokens) * 1000000 / bucket->rate;
 }
 
-static void dir_up(char *path)
+static void sched_xfer_begin(ftpvita_client_info_t *client, TransferClass xfer_class)
 {
-	char *pch;
-	size_t len_in = strlen(path);
-	if (len_in == 1) {
-		strcpy(path, "/");
-		return;
-	}
-	if (path_is_at_root(path)) { /* Case root of the device (/foo0:/) */
-		strcpy(path, "/");
+	sceKernelLockMutex(sched_mtx, 1, NULL);
+
+	client->xfer_class = xfer_class;
+	client->xfer_bytes = 0;
+	client->xfer_start = sceKernelGetProcessTimeWide();
+	if (xfer_class == FTP_XFER_INTERACTIVE)
+		sched_interactive_count++;
+	sched_total_weight += client->xfer_weight;
+	sched_xfer_count++;
+	if (client->xfer_device >= 0) {
+		device_list[client->xfer_device].xfer_count++;
+		device_list[client->xfer_device].xfer_weight += client->xfer_weight;
 	} else {
-		pch = strrchr(path, '/');
-		size_t s = len_in - (pch - path);
-		memset(pch, '\0', s);
-		/* If the path is like: /foo: add slash */
-		if (strrchr(path, '/') == path)
-			strcat(path, "/");
+		sched_other_count++;
+		sched_other_weight += client->xfer_weight;
 	}
+
+	sceKernelUnlockMutex(sched_mtx, 1);
+
+	activity_signal();
 }
 
-static void cmd_CWD_func(ftpvita_client_info_t *client)
+static void sched_xfer_end(ftpvita_client_info_t *client)
 {
-	char cmd_path[PATH_MAX];
-	char tmp_path[PATH_MAX];
-	SceUID pd;
-	int n = sscanf(client->recv_cmd_args, "%[^\r\n\t]", cmd_path);
-
-	if (n < 1) {
-		client_send_ctrl_msg(client, "500 Syntax error, command unrecognized." FTPVITA_EOL);
-	} else {
-		if (strcmp(cmd_path, "/") == 0) {
-			strcpy(client->cur_path, cmd_path);
-		} else  if (strcmp(cmd_path, "..") == 0) {
-			dir_up(client->cur_path);
+	sceKernelLockMutex(sched_mtx, 1, NULL);
+
+	if (client->xfer_class == FTP_XFER_INTERACTIVE)
+		sched_interactive_count--;
+	if (client->xfer_class != FTP_XFER_NONE) {
+		sched_total_weight -= client->xfer_weight;
+		sched_xfer_count--;
+		if (client->xfer_device >= 0) {
+			device_list[client->xfer_device].xfer_count--;
+			device_list[client->xfer_device].xfer_weight -= client->xfer_weight;
 		} else {
-			if (cmd_path[0] == '/') { /* Full path */
-				strcpy(tmp_path, cmd_path);
-			} else { /* Change dir relative to current dir */
-				/* If we are at the root of the device, don't add
-				 * an slash to add new path */
-				if (path_is_at_root(client->cur_path))
-					snprintf(tmp_path, sizeof(tmp_path), "%s%s", client->cur_path, cmd_path);
-				else
-					snprintf(tmp_path, sizeof(tmp_path), "%s/%s", client->cur_path, cmd_path);
-			}
-
-			/* If the path is like: /foo: add an slash */
-			if (strrchr(tmp_path, '/') == tmp_path)
-				strcat(tmp_path, "/");
-
-			/* If the path is not "/", check if it exists */
-			if (strcmp(tmp_path, "/") != 0) {
-				/* Check if the path exists */
-				pd = sceIoDopen(get_vita_path(tmp_path));
-				if (pd < 0) {
-					client_send_ctrl_msg(client, "550 Invalid directory." FTPVITA_EOL);
-					return;
-				}
-				sceIoDclose(pd);
-			}
-			strcpy(client->cur_path, tmp_path);
+			sched_other_count--;
+			sched_other_weight -= client->xfer_weight;
 		}
-		client_send_ctrl_msg(client, "250 Requested file action okay, completed." FTPVITA_EOL);
 	}
+	client->xfer_class = FTP_XFER_NONE;
+
+	sceKernelUnlockMutex(sched_mtx, 1);
+
+	last_activity = sceKernelGetProcessTimeWide();
+	activity_signal();
 }
 
-static void cmd_TYPE_func(ftpvita_client_info_t *client)
+/* Share of the file buffer budget for the client's transfer. The budget
+ * is split evenly between the devices with running transfers, transfers
+ * without a device count as one more device, and each device's share is
+ * split by weight. size_hint is the number of bytes left to transfer,
+ * 0 if unknown */
+static unsigned int sched_buf_size(ftpvita_client_info_t *client, SceOff size_hint)
 {
-	char data_type;
-	char format_control[8];
-	int n_args = sscanf(client->recv_cmd_args, "%c %s", &data_type, format_control);
+	unsigned int size;
+	unsigned int groups = 0;
+	unsigned int group_weight;
+	int i;
 
-	if (n_args > 0) {
-		switch(data_type) {
-		case 'A':
-		case 'I':
-			client_send_ctrl_msg(client, "200 Okay" FTPVITA_EOL);
-			break;
-		case 'E':
-		case 'L':
-		default:
-			client_send_ctrl_msg(client, "504 Error: bad parameters?" FTPVITA_EOL);
-			break;
-		}
-	} else {
-		client_send_ctrl_msg(client, "504 Error: bad parameters?" FTPVITA_EOL);
+	sceKernelLockMutex(sched_mtx, 1, NULL);
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (device_list[i].xfer_count)
+			groups++;
 	}
+	if (sched_other_count)
+		groups++;
+	if (groups == 0)
+		groups = 1;
+	group_weight = client->xfer_device >= 0 ?
+		device_list[client->xfer_device].xfer_weight : sched_other_weight;
+	if (group_weight < client->xfer_weight)
+		group_weight = client->xfer_weight;
+	size = (unsigned int)((SceUInt64)file_buf_size / groups * client->xfer_weight / group_weight);
+	sceKernelUnlockMutex(sched_mtx, 1);
+
+	if (size_hint > 0 && size_hint < size)
+		size = (unsigned int)size_hint;
+	if (size < MIN_XFER_BUF_SIZE)
+		size = MIN_XFER_BUF_SIZE;
+
+	return ALIGN(size, 4 * 1024);
 }
 
-static void cmd_CDUP_func(ftpvita_client_info_t *client)
+static void *xfer_buf_alloc(unsigned int size)
 {
-	dir_up(client->cur_path);
-	client_send_ctrl_msg(client, "200 Command okay." FTPVITA_EOL);
+	void *buf = malloc(size);
+
+	if (buf) {
+		sceKernelLockMutex(sched_mtx, 1, NULL);
+		mem_xfer_bufs += size;
+		if (mem_xfer_bufs > mem_xfer_bufs_peak)
+			mem_xfer_bufs_peak = mem_xfer_bufs;
+		sceKernelUnlockMutex(sched_mtx, 1);
+	}
+
+	return buf;
 }
 
-static void send_file(ftpvita_client_info_t *client, const char *path)
+static void xfer_buf_free(void *buf, unsigned int size)
 {
-	unsigned char *buffer;
-	SceUID fd;
-	unsigned int bytes_read;
-	unsigned int op_buf_size;
+	free(buf);
 
-	active_op_count++;
+	sceKernelLockMutex(sched_mtx, 1, NULL);
+	mem_xfer_bufs -= size;
+	sceKernelUnlockMutex(sched_mtx, 1);
+}
 
-	op_buf_size = ALIGN(file_buf_size / active_op_count, 4 * 1024);
+/* Picks up a changed buffer budget at a buffer boundary. Keeps the
+ * current buffer if the new one can't be allocated */
+static unsigned char *xfer_buf_refresh(ftpvita_client_info_t *client, unsigned char *buffer,
+	unsigned int *size, SceOff size_hint, unsigned int *generation)
+{
+	unsigned int new_size;
+	unsigned char *new_buffer;
 
-	DEBUG("Opening: %s\n", path);
+	if (*generation == config_generation)
+		return buffer;
+	*generation = config_generation;
 
-	if ((fd = sceIoOpen(path, SCE_O_RDONLY, 0777)) >= 0) {
+	new_size = sched_buf_size(client, size_hint);
+	if (new_size == *size)
+		return buffer;
 
-		sceIoLseek32(fd, client->restore_point, SCE_SEEK_SET);
+	new_buffer = xfer_buf_alloc(new_size);
+	if (new_buffer == NULL)
+		return buffer;
 
-		buffer = malloc(op_buf_size);
-		if (buffer == NULL) {
-			client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
-			active_op_count--;
-			return;
-		}
+	xfer_buf_free(buffer, *size);
+	*size = new_size;
+	return new_buffer;
+}
 
-		client_open_data_connection(client);
-		client_send_ctrl_msg(client, "150 Opening Image mode data transfer." FTPVITA_EOL);
+/* Blocks until the client's transfer is allowed to move another buffer */
+static void sched_wait(ftpvita_client_info_t *client)
+{
+	SceUInt64 now, delay, client_delay;
+	unsigned int client_rate;
+	int yield;
 
-		while ((bytes_read = sceIoRead (fd, buffer, op_buf_size)) > 0) {
-			client_send_data_raw(client, buffer, bytes_read);
+	/* Interactive transfers skip the yield but not the rate limits */
+	while (1) {
+		yield = 0;
+
+		sceKernelLockMutex(sched_mtx, 1, NULL);
+
+		now = sceKernelGetProcessTimeWide();
+		client_rate = client->rate_limit ? client->rate_limit : session_rate_limit;
+		bucket_refill(&global_bucket, global_bucket.rate, now);
+		bucket_refill(&client->bucket, client_rate, now);
+
+		delay = bucket_delay(&global_bucket);
+		client_delay = bucket_delay(&client->bucket);
+		if (client_delay > delay)
+			delay = client_delay;
+		if (delay == 0 && sched_interactive_count > 0 &&
+			client->xfer_class != FTP_XFER_INTERACTIVE) {
+			delay = SCHED_YIELD_DELAY;
+			yield = 1;
 		}
 
-		sceIoClose(fd);
-		free(buffer);
-		client->restore_point = 0;
-		NOTIFICATION("Send completed: %s", strrchr(path, '/') + 1);
-		client_send_ctrl_msg(client, "226 Transfer completed." FTPVITA_EOL);
-		client_close_data_connection(client);
+		sceKernelUnlockMutex(sched_mtx, 1);
 
-	} else {
-		client_send_ctrl_msg(client, "550 File not found." FTPVITA_EOL);
-	}
+		if (delay == 0)
+			break;
+		sceKernelDelayThread(delay < SCHED_MAX_DELAY ? (SceUInt32)delay : SCHED_MAX_DELAY);
 
-	active_op_count--;
+		/* Yielding to interactive transfers only delays once per buffer */
+		if (yield)
+			break;
+	}
 }
 
-/* This function generates an FTP full-path with the input path (relative or absolute)
- * from RETR, STOR, DELE, RMD, MKD, RNFR and RNTO commands */
-static void gen_ftp_fullpath(ftpvita_client_info_t *client, char *path, size_t path_size)
+/* Charges the transferred bytes to the buckets */
+static void sched_account(ftpvita_client_info_t *client, unsigned int bytes)
 {
-	char cmd_path[PATH_MAX];
-	sscanf(client->recv_cmd_args, "%[^\r\n\t]", cmd_path);
+	sceKernelLockMutex(sched_mtx, 1, NULL);
+	if (global_bucket.rate)
+		global_bucket.tokens -= bytes;
+	if (client->bucket.rate)
+		client->bucket.tokens -= bytes;
+	load_stats.bytes[load_stats.state] += bytes;
+	sceKernelUnlockMutex(sched_mtx, 1);
 
-	if (cmd_path[0] == '/') {
-		/* Full path */
-		strncpy(path, cmd_path, path_size);
-	} else {
-		if (strlen(cmd_path) >= 5 && cmd_path[3] == ':' && cmd_path[4] == '/') {
-			/* Case "ux0:/foo */
-			snprintf(path, path_size, "/%s", cmd_path);
-		} else {
-			/* The file is relative to current dir, so
-			 * append the file to the current path */
-			snprintf(path, path_size, "%s/%s", client->cur_path, cmd_path);
-		}
-	}
-}
+	client->xfer_bytes += bytes;
 
-static void cmd_RETR_func(ftpvita_client_info_t *client)
-{
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	send_file(client, get_vita_path(dest_path));
+	activity_touch();
 }
 
-static void receive_file(ftpvita_client_info_t *client, const char *path)
+static int device_find(const char *vita_path)
 {
-	unsigned char *buffer;
-	SceUID fd;
-	int bytes_recv;
-	unsigned int op_buf_size;
+	unsigned int len;
+	int i;
 
-	active_op_count++;
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (!device_list[i].valid)
+			continue;
+		len = strlen(device_list[i].name);
+		if (strncmp(vita_path, device_list[i].name, len) == 0)
+			return i;
+	}
 
-	op_buf_size = ALIGN(file_buf_size / active_op_count, 4 * 1024);
+	return -1;
+}
 
-	DEBUG("Opening: %s\n", path);
+/* Takes an I/O slot on the device of vita_path before a transfer, queueing
+ * behind the running transfers if the device has none free. With notify
+ * set the client is FTP: it is told that the transfer is queued with a
+ * 150 reply of its own, and can send STAT and ABOR while waiting. Returns
+ * < 0 if the transfer was aborted or the server closes the sessions while
+ * waiting, see client_send_xfer_dequeued() */
+static int device_io_acquire(ftpvita_client_info_t *client, const char *vita_path, int notify)
+{
+	char msg[96];
+	SceUInt32 timeout;
+	int queued = 0;
+	int aborted = 0;
+	int dev;
 
-	int mode = SCE_O_CREAT | SCE_O_RDWR;
-	/* if we resume broken - append missing part
-	 * else - overwrite file */
-	if (client->restore_point) {
-		mode = mode | SCE_O_APPEND;
-	}
-	else {
-		mode = mode | SCE_O_TRUNC;
-	}
+	client->xfer_device = -1;
+	if (vita_path == NULL || (dev = device_find(vita_path)) < 0)
+		return 0;
 
-	if ((fd = sceIoOpen(path, mode, 0777)) >= 0) {
+	while (1) {
+		sceKernelLockMutex(sched_mtx, 1, NULL);
+		if (sessions_closing || device_list[dev].io_slots == 0 ||
+			device_list[dev].io_active < device_list[dev].io_slots)
+			break;
 
-		buffer = malloc(op_buf_size);
-		if (buffer == NULL) {
-			client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
-			active_op_count--;
-			return;
+		if (!queued) {
+			snprintf(msg, sizeof(msg), "150 Queued, %u transfers running on %s and %u waiting." FTPVITA_EOL,
+				device_list[dev].io_active, device_list[dev].name, device_list[dev].io_waiting);
+			device_list[dev].io_waiting++;
 		}
+		sceKernelClearEventFlag(device_evf, ~(1u << dev));
+		sceKernelUnlockMutex(sched_mtx, 1);
 
-		client_open_data_connection(client);
-		client_send_ctrl_msg(client, "150 Opening Image mode data transfer." FTPVITA_EOL);
-
-		while ((bytes_recv = client_recv_data_raw(client, buffer, op_buf_size)) > 0) {
-			sceIoWrite(fd, buffer, bytes_recv);
+		if (!queued) {
+			queued = 1;
+			if (notify)
+				client_send_ctrl_msg(client, msg);
 		}
-
-		sceIoClose(fd);
-		free(buffer);
-		client->restore_point = 0;
-		if (bytes_recv == 0) {
-			NOTIFICATION("Receive completed: %s", strrchr(path, '/') + 1);
-			client_send_ctrl_msg(client, "226 Transfer completed." FTPVITA_EOL);
-		} else {
-			sceIoRemove(path);
-			NOTIFICATION("Receive aborted: %s", strrchr(path, '/') + 1);
-			client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPVITA_EOL);
+		if (notify && client_ctrl_poll(client) < 0) {
+			aborted = 1;
+			sceKernelLockMutex(sched_mtx, 1, NULL);
+			break;
 		}
-		client_close_data_connection(client);
+		timeout = DEVICE_WAIT_POLL;
+		sceKernelWaitEventFlag(device_evf, 1u << dev, SCE_KERNEL_EVF_WAITMODE_OR, NULL, &timeout);
+	}
 
-	} else {
-		client_send_ctrl_msg(client, "550 File not found." FTPVITA_EOL);
+	if (queued)
+		device_list[dev].io_waiting--;
+	if (sessions_closing || aborted) {
+		sceKernelUnlockMutex(sched_mtx, 1);
+		return -1;
 	}
+	device_list[dev].io_active++;
+	client->xfer_device = dev;
+	sceKernelUnlockMutex(sched_mtx, 1);
 
-	active_op_count--;
+	return 0;
 }
 
-static void cmd_STOR_func(ftpvita_client_info_t *client)
+static void device_io_release(ftpvita_client_info_t *client)
 {
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	receive_file(client, get_vita_path(dest_path));
+	if (client->xfer_device < 0)
+		return;
+
+	sceKernelLockMutex(sched_mtx, 1, NULL);
+	device_list[client->xfer_device].io_active--;
+	sceKernelSetEventFlag(device_evf, 1u << client->xfer_device);
+	client->xfer_device = -1;
+	sceKernelUnlockMutex(sched_mtx, 1);
 }
 
-static void delete_file(ftpvita_client_info_t *client, const char *path)
+/* Final reply for a transfer device_io_acquire() gave up on */
+static void client_send_xfer_dequeued(ftpvita_client_info_t *client)
 {
-	DEBUG("Deleting: %s\n", path);
-
-	if (sceIoRemove(path) >= 0) {
-		client_send_ctrl_msg(client, "226 File deleted." FTPVITA_EOL);
-	} else {
-		client_send_ctrl_msg(client, "550 Could not delete the file." FTPVITA_EOL);
-	}
+	client_send_ctrl_msg(client, client->xfer_aborted ?
+		"426 Transfer aborted." FTPVITA_EOL : "421 Server is shutting down." FTPVITA_EOL);
 }
 
-static void cmd_DELE_func(ftpvita_client_info_t *client)
+/* Load-aware thread policy:
+ * With no game competing for the CPU (or with the system asleep) the
+ * transfer threads run at a raised priority on every core we are allowed
+ * to use. When the probe detects contention they fall back to the default
+ * priority on the reserved core, so the game is not affected. */
+
+static int load_policy_priority(void)
 {
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	delete_file(client, get_vita_path(dest_path));
+	return load_stats.state == FTPVITA_LOAD_IDLE ?
+		FTP_THREAD_PRIORITY_BOOST : FTP_THREAD_PRIORITY;
 }
 
-static void delete_dir(ftpvita_client_info_t *client, const char *path)
+static int load_policy_affinity(void)
 {
-	int ret;
-	DEBUG("Deleting: %s\n", path);
-	ret = sceIoRmdir(path);
-	if (ret >= 0) {
-		client_send_ctrl_msg(client, "226 Directory deleted." FTPVITA_EOL);
-	} else if (ret == 0x8001005A) { /* DIRECTORY_IS_NOT_EMPTY */
-		client_send_ctrl_msg(client, "550 Directory is not empty." FTPVITA_EOL);
-	} else {
-		client_send_ctrl_msg(client, "550 Could not delete the directory." FTPVITA_EOL);
-	}
+	return load_stats.state == FTPVITA_LOAD_IDLE ?
+		FTP_CPU_MASK_WIDE : FTP_CPU_MASK_RESERVED;
 }
 
-static void cmd_RMD_func(ftpvita_client_info_t *client)
+static void load_apply_thread(SceUID thid, int priority, int affinity)
 {
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	delete_dir(client, get_vita_path(dest_path));
+	if (sceKernelChangeThreadPriority(thid, priority) < 0)
+		load_stats.policy_errors++;
+	if (sceKernelChangeThreadCpuAffinityMask(thid, affinity) < 0)
+		load_stats.policy_errors++;
 }
 
-static void create_dir(ftpvita_client_info_t *client, const char *path)
+static void load_apply_policy(void)
 {
-	DEBUG("Creating: %s\n", path);
+	int priority = load_policy_priority();
+	int affinity = load_policy_affinity();
+	SceUID thid;
+	int i;
 
-	if (sceIoMkdir(path, 0777) >= 0) {
-		client_send_ctrl_msg(client, "226 Directory created." FTPVITA_EOL);
-	} else {
-		client_send_ctrl_msg(client, "550 Could not create the directory." FTPVITA_EOL);
+	DEBUG("Load policy: priority 0x%08X affinity 0x%08X\n", priority, affinity);
+
+	if (server_thid >= 0)
+		load_apply_thread(server_thid, priority, affinity);
+
+	/* A session ending meanwhile only makes the call fail */
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		if ((thid = session_slots[i].thid) >= 0)
+			load_apply_thread(thid, priority, affinity);
 	}
 }
 
-static void cmd_MKD_func(ftpvita_client_info_t *client)
+static void load_update(unsigned int latency)
 {
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	create_dir(client, get_vita_path(dest_path));
-}
+	SceUInt64 now;
+	ftpvita_load_state_t new_state;
+
+	sceKernelLockMutex(sched_mtx, 1, NULL);
+
+	now = sceKernelGetProcessTimeWide();
+	load_stats.time_us[load_stats.state] += now - load_stamp;
+	load_stamp = now;
+	load_stats.probe_latency = latency;
+
+	/* Hysteresis between the two thresholds avoids flapping */
+	new_state = load_stats.state;
+	if (latency > LOAD_CONTENDED_LATENCY)
+		new_state = FTPVITA_LOAD_CONTENDED;
+	else if (latency < LOAD_IDLE_LATENCY)
+		new_state = FTPVITA_LOAD_IDLE;
+
+	if (new_state != load_stats.state) {
+		load_stats.state = new_state;
+		load_stats.entered[new_state]++;
+	} else {
+		new_state = FTPVITA_LOAD_STATES;
+	}
 
-static void cmd_RNFR_func(ftpvita_client_info_t *client)
+	sceKernelUnlockMutex(sched_mtx, 1);
+
+	if (new_state != FTPVITA_LOAD_STATES)
+		load_apply_policy();
+}
+
+static int load_thread(SceSize args, void *argp)
 {
-	char path_src[PATH_MAX];
-	const char *vita_path_src;
-	/* Get the origin filename */
-	gen_ftp_fullpath(client, path_src, sizeof(path_src));
-	vita_path_src = get_vita_path(path_src);
+	int i;
+	SceUInt64 start, late, sum;
 
-	/* Check if the file exists */
-	if (!file_exists(vita_path_src)) {
-		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPVITA_EOL);
-		return;
+	DEBUG("Load probe thread started!\n");
+
+	while (load_thread_run) {
+		/* Nothing to schedule without clients */
+		if (number_clients == 0) {
+			sceKernelWaitSema(load_sema, 1, NULL);
+			continue;
+		}
+
+		sum = 0;
+		for (i = 0; i < LOAD_PROBE_SAMPLES; i++) {
+			start = sceKernelGetProcessTimeWide();
+			sceKernelDelayThread(LOAD_PROBE_DELAY);
+			late = sceKernelGetProcessTimeWide() - start;
+			sum += late > LOAD_PROBE_DELAY ? late - LOAD_PROBE_DELAY : 0;
+		}
+
+		load_update((unsigned int)(sum / LOAD_PROBE_SAMPLES));
 	}
-	/* The file to be renamed is the received path */
-	strcpy(client->rename_path, vita_path_src);
-	client_send_ctrl_msg(client, "350 I need the destination name b0ss." FTPVITA_EOL);
+
+	DEBUG("Load probe thread exiting!\n");
+
+	sceKernelExitDeleteThread(0);
+	return 0;
 }
 
-static void cmd_RNTO_func(ftpvita_client_info_t *client)
+/* Session path arena:
+ * cur_path and rename_path are stored back to back in path_arena,
+ * so a long path can borrow the space the other one is not using. */
+
+static void session_init_paths(ftpvita_client_info_t *client)
 {
-	char path_dst[PATH_MAX];
-	const char *vita_path_dst;
-	/* Get the destination filename */
-	gen_ftp_fullpath(client, path_dst,sizeof(path_dst));
-	vita_path_dst = get_vita_path(path_dst);
+	strcpy(client->path_arena, FTP_DEFAULT_PATH);
+	client->cur_path = client->path_arena;
+	client->rename_path = client->cur_path + strlen(client->cur_path) + 1;
+	client->rename_path[0] = '\0';
+}
 
-	DEBUG("Renaming: %s to %s\n", client->rename_path, vita_path_dst);
+/* Returns 0 on success, -1 if the paths don't fit in the arena */
+static int session_set_cur_path(ftpvita_client_info_t *client, const char *path)
+{
+	size_t len = strlen(path);
+	size_t rename_len = strlen(client->rename_path);
 
-	if (sceIoRename(client->rename_path, vita_path_dst) < 0) {
-		client_send_ctrl_msg(client, "550 Error renaming the file." FTPVITA_EOL);
-	}
+	if (len + rename_len + 2 > sizeof(client->path_arena))
+		return -1;
 
-	client_send_ctrl_msg(client, "226 Rename completed." FTPVITA_EOL);
+	memmove(client->path_arena + len + 1, client->rename_path, rename_len + 1);
+	memcpy(client->path_arena, path, len + 1);
+	client->cur_path = client->path_arena;
+	client->rename_path = client->path_arena + len + 1;
+
+	return 0;
 }
 
-static void cmd_SIZE_func(ftpvita_client_info_t *client)
+static int session_set_rename_path(ftpvita_client_info_t *client, const char *path)
 {
-	SceIoStat stat;
-	char path[PATH_MAX];
-	char cmd[64];
-	/* Get the filename to retrieve its size */
-	gen_ftp_fullpath(client, path, sizeof(path));
+	size_t len = strlen(path);
+	size_t cur_len = strlen(client->cur_path);
 
-	/* Check if the file exists */
-	if (sceIoGetstat(get_vita_path(path), &stat) < 0) {
-		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPVITA_EOL);
-		return;
-	}
-	/* Send the size of the file */
-	sprintf(cmd, "213 %lld" FTPVITA_EOL, stat.st_size);
-	client_send_ctrl_msg(client, cmd);
+	if (cur_len + len + 2 > sizeof(client->path_arena))
+		return -1;
+
+	/* The current path may have been shortened in place, compact it */
+	memmove(client->path_arena, client->cur_path, cur_len + 1);
+	client->cur_path = client->path_arena;
+	client->rename_path = client->path_arena + cur_len + 1;
+	memcpy(client->rename_path, path, len + 1);
+
+	return 0;
 }
 
-static void cmd_REST_func(ftpvita_client_info_t *client)
+static inline const char *get_vita_path(const char *path)
 {
-	char cmd[64];
-	sscanf(client->recv_buffer, "%*[^ ] %d", &client->restore_point);
-	sprintf(cmd, "350 Resuming at %d" FTPVITA_EOL, client->restore_point);
-	client_send_ctrl_msg(client, cmd);
+	if (strlen(path) > 1)
+		/* /cache0:/foo/bar -> cache0:/foo/bar */
+		return &path[1];
+	else
+		return NULL;
 }
 
-static void cmd_FEAT_func(ftpvita_client_info_t *client)
+static int file_exists(const char *path)
 {
-	/*So client would know that we support resume */
-	client_send_ctrl_msg(client, "211-extensions" FTPVITA_EOL);
-	client_send_ctrl_msg(client, " REST STREAM" FTPVITA_EOL);
-	client_send_ctrl_msg(client, " UTF8" FTPVITA_EOL);
-	client_send_ctrl_msg(client, "211 end" FTPVITA_EOL);
+	SceIoStat stat;
+	return (sceIoGetstat(path, &stat) >= 0);
 }
 
-static void cmd_OPTS_func(ftpvita_client_info_t *client)
+/* Collapses repeated slashes and drops the trailing one, so
+ * "ux0://foo/" and "ux0:/foo" compare equal */
+static void path_normalize(char *path)
 {
-	client_send_ctrl_msg(client, "501 bad OPTS" FTPVITA_EOL);
+	char *in, *out;
+
+	for (in = out = path; *in; in++) {
+		if (*in == '/' && out > path && out[-1] == '/')
+			continue;
+		*out++ = *in;
+	}
+	if (out > path + 1 && out[-1] == '/')
+		out--;
+	*out = '\0';
 }
 
-static void cmd_APPE_func(ftpvita_client_info_t *client)
+/* Returns 1 if dir is path itself or one of its parents */
+static int path_is_within(const char *path, const char *dir)
 {
-	/* set restore point to not 0
-	restore point numeric value only matters if we RETR file from vita.
-	If we STOR or APPE, it is only used to indicate that we want to resume
-	a broken transfer */
-	client->restore_point = -1;
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	receive_file(client, get_vita_path(dest_path));
+	size_t len = strlen(dir);
+	return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
 }
 
-#define add_entry(name) {#name, cmd_##name##_func}
-static const cmd_dispatch_entry cmd_dispatch_table[] = {
-	add_entry(NOOP),
-	add_entry(USER),
-	add_entry(PASS),
-	add_entry(QUIT),
-	add_entry(SYST),
-	add_entry(PASV),
-	add_entry(PORT),
-	add_entry(LIST),
-	add_entry(PWD),
-	add_entry(CWD),
-	add_entry(TYPE),
-	add_entry(CDUP),
-	add_entry(RETR),
-	add_entry(STOR),
-	add_entry(DELE),
-	add_entry(RMD),
-	add_entry(MKD),
-	add_entry(RNFR),
-	add_entry(RNTO),
-	add_entry(SIZE),
-	add_entry(REST),
-	add_entry(FEAT),
-	add_entry(OPTS),
-	add_entry(APPE),
-	{NULL, NULL}
-};
+/* SITE DU cache:
+ * subtree totals of recently walked directories, keyed by normalized
+ * Vita path. Any change below a cached directory drops it. */
 
-static cmd_dispatch_func get_dispatch_func(const char *cmd)
+static void du_cache_invalidate(const char *path)
 {
 	int i;
-	for(i = 0; cmd_dispatch_table[i].cmd && cmd_dispatch_table[i].func; i++) {
-		if (strcmp(cmd, cmd_dispatch_table[i].cmd) == 0) {
-			return cmd_dispatch_table[i].func;
+
+	sceKernelLockMutex(du_cache_mtx, 1, NULL);
+	du_cache_generation++;
+	for (i = 0; i < DU_CACHE_ENTRIES; i++) {
+		if (du_cache[i].path && (path_is_within(path, du_cache[i].path) ||
+		    path_is_within(du_cache[i].path, path))) {
+			free(du_cache[i].path);
+			du_cache[i].path = NULL;
 		}
 	}
-	// Check for custom commands
-	for(i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
-		if (custom_command_dispatchers[i].valid) {
-			if (strcmp(cmd, custom_command_dispatchers[i].cmd) == 0) {
-				return custom_command_dispatchers[i].func;
+	sceKernelUnlockMutex(du_cache_mtx, 1);
+}
+
+static int du_cache_lookup(const char *path, du_totals *totals)
+{
+	int i;
+	int found = 0;
+
+	sceKernelLockMutex(du_cache_mtx, 1, NULL);
+	for (i = 0; i < DU_CACHE_ENTRIES; i++) {
+		if (du_cache[i].path && strcmp(du_cache[i].path, path) == 0) {
+			*totals = du_cache[i].totals;
+			du_cache[i].stamp = sceKernelGetProcessTimeWide();
+			found = 1;
+			break;
+		}
+	}
+	if (found)
+		du_cache_hits++;
+	else
+		du_cache_misses++;
+	sceKernelUnlockMutex(du_cache_mtx, 1);
+
+	return found;
+}
+
+/* Results of a walk that raced with a change are not stored */
+static void du_cache_store(const char *path, const du_totals *totals, unsigned int generation)
+{
+	int i;
+	int slot = 0;
+
+	sceKernelLockMutex(du_cache_mtx, 1, NULL);
+	if (generation == du_cache_generation) {
+		for (i = 0; i < DU_CACHE_ENTRIES; i++) {
+			if (!du_cache[i].path || strcmp(du_cache[i].path, path) == 0) {
+				slot = i;
+				break;
 			}
+			if (du_cache[i].stamp < du_cache[slot].stamp)
+				slot = i;
+		}
+		free(du_cache[slot].path);
+		if ((du_cache[slot].path = strdup(path)) != NULL) {
+			du_cache[slot].totals = *totals;
+			du_cache[slot].stamp = sceKernelGetProcessTimeWide();
 		}
 	}
-	return NULL;
+	sceKernelUnlockMutex(du_cache_mtx, 1);
 }
 
-static void client_list_add(ftpvita_client_info_t *client)
+static void du_cache_clear(void)
 {
-	/* Add the client at the front of the client list */
-	sceKernelLockMutex(client_list_mtx, 1, NULL);
+	int i;
+	for (i = 0; i < DU_CACHE_ENTRIES; i++) {
+		free(du_cache[i].path);
+		du_cache[i].path = NULL;
+	}
+}
 
-	if (client_list == NULL) { /* List is empty */
-		client_list = client;
-		client->prev = NULL;
-		client->next = NULL;
-	} else {
-		client->next = client_list;
-		client_list->prev = client;
-		client->prev = NULL;
-		client_list = client;
+/* exFAT names are case-insensitive, so are the lookups and globs */
+static int name_equal_nocase(const char *a, const char *b)
+{
+	while (*a && ascii_lower(*a) == ascii_lower(*b)) {
+		a++;
+		b++;
 	}
-	client->restore_point = 0;
-	number_clients++;
+	return ascii_lower(*a) == ascii_lower(*b);
+}
 
-	sceKernelUnlockMutex(client_list_mtx, 1);
+/* Matches '*' and '?' wildcards */
+static int glob_match(const char *pattern, const char *name)
+{
+	const char *star = NULL;
+	const char *resume = NULL;
+
+	while (*name) {
+		if (*pattern == '*') {
+			star = pattern++;
+			resume = name;
+		} else if (*pattern == '?' || ascii_lower(*pattern) == ascii_lower(*name)) {
+			pattern++;
+			name++;
+		} else if (star) {
+			pattern = star + 1;
+			name = ++resume;
+		} else {
+			return 0;
+		}
+	}
+
+	while (*pattern == '*')
+		pattern++;
+
+	return *pattern == '\0';
 }
 
-static void client_list_delete(ftpvita_client_info_t *client)
+/* Filename index */
+
+static inline const char *fidx_name(const fidx_index *idx, unsigned int node)
 {
-	/* Remove the client from the client list */
-	sceKernelLockMutex(client_list_mtx, 1, NULL);
+	return idx->names + idx->nodes[node].name;
+}
 
-	if (client->prev) {
-		client->prev->next = client->next;
-	}
-	if (client->next) {
-		client->next->prev = client->prev;
+static unsigned int fidx_key(unsigned int parent, const char *name)
+{
+	unsigned int h = 2166136261u ^ parent;
+
+	while (*name) {
+		h ^= (unsigned char)ascii_lower(*name++);
+		h *= 16777619u;
 	}
-	if (client == client_list) {
-		client_list = client->next;
+
+	return h;
+}
+
+static void fidx_hash_insert(fidx_index *idx, unsigned int node)
+{
+	unsigned int mask = idx->hash_cap - 1;
+	unsigned int slot = fidx_key(idx->nodes[node].parent, fidx_name(idx, node)) & mask;
+
+	while (idx->hash[slot] < FIDX_TOMBSTONE)
+		slot = (slot + 1) & mask;
+	if (idx->hash[slot] == FIDX_NONE)
+		idx->hash_used++;
+	idx->hash[slot] = node;
+}
+
+static void fidx_hash_remove(fidx_index *idx, unsigned int node)
+{
+	unsigned int mask = idx->hash_cap - 1;
+	unsigned int slot = fidx_key(idx->nodes[node].parent, fidx_name(idx, node)) & mask;
+
+	while (idx->hash[slot] != FIDX_NONE) {
+		if (idx->hash[slot] == node) {
+			idx->hash[slot] = FIDX_TOMBSTONE;
+			return;
+		}
+		slot = (slot + 1) & mask;
 	}
+}
+
+/* Sized for a load factor of at most 1/2, dropping the tombstones */
+static int fidx_hash_rebuild(fidx_index *idx, unsigned int min_nodes)
+{
+	unsigned int cap = 2048;
+	unsigned int *hash;
+	unsigned int i;
 
-	number_clients--;
+	while (cap < min_nodes * 4)
+		cap *= 2;
 
-	sceKernelUnlockMutex(client_list_mtx, 1);
+	if ((hash = malloc(cap * sizeof(unsigned int))) == NULL)
+		return -1;
+
+	free(idx->hash);
+	idx->hash = hash;
+	idx->hash_cap = cap;
+	idx->hash_used = 0;
+	memset(hash, 0xFF, cap * sizeof(unsigned int));
+
+	for (i = 1; i < idx->count; i++) {
+		if (!(idx->nodes[i].flags & FIDX_DELETED))
+			fidx_hash_insert(idx, i);
+	}
+
+	return 0;
 }
 
-static void client_list_thread_end()
+static unsigned int fidx_find_child(const fidx_index *idx, unsigned int parent, const char *name)
 {
-	ftpvita_client_info_t *it, *next;
-	SceUID client_thid;
-	const int data_abort_flags = SCE_NET_SOCKET_ABORT_FLAG_RCV_PRESERVATION |
-				SCE_NET_SOCKET_ABORT_FLAG_SND_PRESERVATION;
+	unsigned int mask = idx->hash_cap - 1;
+	unsigned int slot = fidx_key(parent, name) & mask;
+	unsigned int node;
+
+	while ((node = idx->hash[slot]) != FIDX_NONE) {
+		if (node != FIDX_TOMBSTONE && idx->nodes[node].parent == parent &&
+		    !(idx->nodes[node].flags & FIDX_DELETED) &&
+		    name_equal_nocase(fidx_name(idx, node), name))
+			return node;
+		slot = (slot + 1) & mask;
+	}
 
-	sceKernelLockMutex(client_list_mtx, 1, NULL);
+	return FIDX_NONE;
+}
 
-	it = client_list;
+static unsigned int fidx_add_name(fidx_index *idx, const char *name)
+{
+	unsigned int len = strlen(name) + 1;
+	unsigned int cap = idx->names_cap;
+	unsigned int offset;
+	char *names;
+
+	if (idx->names_len + len > cap) {
+		while (cap < idx->names_len + len)
+			cap *= 2;
+		if ((names = realloc(idx->names, cap)) == NULL)
+			return FIDX_NONE;
+		idx->names = names;
+		idx->names_cap = cap;
+	}
 
-	/* Iterate over the client list and close their sockets */
-	while (it) {
-		next = it->next;
-		client_thid = it->thid;
+	offset = idx->names_len;
+	memcpy(idx->names + offset, name, len);
+	idx->names_len += len;
 
-		/* Abort the client's control socket, only abort
-		 * receiving data so we can still send control messages */
-		sceNetSocketAbort(it->ctrl_sockfd,
-			SCE_NET_SOCKET_ABORT_FLAG_RCV_PRESERVATION);
+	return offset;
+}
 
-		/* If there's an open data connection, abort it */
-		if (it->data_con_type != FTP_DATA_CONNECTION_NONE) {
-			sceNetSocketAbort(it->data_sockfd, data_abort_flags);
-			if (it->data_con_type == FTP_DATA_CONNECTION_PASSIVE) {
-				sceNetSocketAbort(it->pasv_sockfd, data_abort_flags);
-			}
+static unsigned int fidx_add(fidx_index *idx, unsigned int parent, const char *name, int flags)
+{
+	unsigned int cap;
+	unsigned int node;
+	unsigned int name_off;
+	fidx_node *nodes;
+
+	if (idx->count >= fidx_max_nodes) {
+		idx->full = 1;
+		return FIDX_NONE;
+	}
+
+	if (idx->count == idx->cap) {
+		cap = idx->cap * 2;
+		if (cap > fidx_max_nodes)
+			cap = fidx_max_nodes;
+		if ((nodes = realloc(idx->nodes, cap * sizeof(fidx_node))) == NULL) {
+			idx->full = 1;
+			return FIDX_NONE;
 		}
+		idx->nodes = nodes;
+		idx->cap = cap;
+	}
 
-		/* Wait until the client threads ends */
-		sceKernelWaitThreadEnd(client_thid, NULL, NULL);
+	if ((idx->hash_used + 1) * 2 > idx->hash_cap && fidx_hash_rebuild(idx, idx->count + 1) < 0) {
+		idx->full = 1;
+		return FIDX_NONE;
+	}
 
-		it = next;
+	if ((name_off = fidx_add_name(idx, name)) == FIDX_NONE) {
+		idx->full = 1;
+		return FIDX_NONE;
 	}
 
-	sceKernelUnlockMutex(client_list_mtx, 1);
+	node = idx->count++;
+	idx->nodes[node].parent = parent;
+	idx->nodes[node].name = name_off;
+	idx->nodes[node].flags = flags;
+	idx->nodes[node].round = idx->round;
+	fidx_hash_insert(idx, node);
+	idx->dirty = 1;
+
+	return node;
 }
 
-static int client_thread(SceSize args, void *argp)
+static void fidx_free(fidx_index *idx)
 {
-	char cmd[16];
-	cmd_dispatch_func dispatch_func;
-	ftpvita_client_info_t *client = *(ftpvita_client_info_t **)argp;
+	free(idx->nodes);
+	free(idx->names);
+	free(idx->hash);
+	free(idx);
+}
 
-	DEBUG("Client thread %i started!\n", client->num);
+static fidx_index *fidx_new(const char *device)
+{
+	fidx_index *idx = calloc(1, sizeof(fidx_index));
 
-	client_send_ctrl_msg(client, "220 FTPVita Server ready." FTPVITA_EOL);
+	if (idx == NULL)
+		return NULL;
 
-	while (1) {
-		memset(client->recv_buffer, 0, sizeof(client->recv_buffer));
+	snprintf(idx->device, sizeof(idx->device), "%s", device);
+	idx->cap = 1024;
+	idx->names_cap = 16 * 1024;
+	idx->nodes = malloc(idx->cap * sizeof(fidx_node));
+	idx->names = malloc(idx->names_cap);
+	if (idx->nodes == NULL || idx->names == NULL) {
+		fidx_free(idx);
+		return NULL;
+	}
 
-		client->n_recv = sceNetRecv(client->ctrl_sockfd, client->recv_buffer, sizeof(client->recv_buffer), 0);
-		if (client->n_recv > 0) {
-			DEBUG("Received %i bytes from client number %i:\n",
-				client->n_recv, client->num);
+	/* The root has an empty name and is not hashed */
+	idx->count = 1;
+	idx->nodes[0].parent = FIDX_NONE;
+	idx->nodes[0].name = 0;
+	idx->nodes[0].flags = FIDX_DIR;
+	idx->nodes[0].round = 0;
+	idx->names[0] = '\0';
+	idx->names_len = 1;
+
+	if (fidx_hash_rebuild(idx, 0) < 0) {
+		fidx_free(idx);
+		return NULL;
+	}
 
-			INFO("\t%i> %s", client->num, client->recv_buffer);
+	idx->scanning = 1;
 
-			/* The command is the first chars until the first space */
-			sscanf(client->recv_buffer, "%s", cmd);
+	return idx;
+}
 
-			client->recv_cmd_args = strchr(client->recv_buffer, ' ');
-			if (client->recv_cmd_args)
-				client->recv_cmd_args++; /* Skip the space */
-			else
-				client->recv_cmd_args = client->recv_buffer;
+/* Writes "ux0:/a/b" for node, returns -1 if the node or a parent is deleted */
+static int fidx_node_path(const fidx_index *idx, unsigned int node, char *buf, unsigned int size)
+{
+	unsigned int chain[FIDX_MAX_DEPTH];
+	unsigned int len;
+	int depth = 0;
+
+	while (node != 0) {
+		if ((idx->nodes[node].flags & FIDX_DELETED) || depth == FIDX_MAX_DEPTH)
+			return -1;
+		chain[depth++] = node;
+		node = idx->nodes[node].parent;
+	}
 
-			/* Wait 1 ms before sending any data */
-			sceKernelDelayThread(1*1000);
+	len = snprintf(buf, size, "%s", idx->device);
+	while (depth-- > 0 && len < size)
+		len += snprintf(buf + len, size - len, "/%s", fidx_name(idx, chain[depth]));
 
-			if ((dispatch_func = get_dispatch_func(cmd))) {
-				dispatch_func(client);
-			} else {
-				client_send_ctrl_msg(client, "502 Sorry, command not implemented. :(" FTPVITA_EOL);
-			}
+	return len < size ? (int)len : -1;
+}
 
-		} else if (client->n_recv == 0) {
-			/* Value 0 means connection closed by the remote peer */
-			INFO("Connection closed by the client %i.\n", client->num);
-			/* Delete itself from the client list */
-			client_list_delete(client);
-			break;
-		} else if (client->n_recv == SCE_NET_ERROR_EINTR) {
-			/* Socket aborted (ftpvita_fini() called) */
-			INFO("Client %i socket aborted.\n", client->num);
-			break;
-		} else {
-			/* Other errors */
-			INFO("Client %i socket error: 0x%08X\n", client->num, client->n_recv);
-			client_list_delete(client);
-			break;
-		}
+static fidx_index *fidx_find(const char *path)
+{
+	const char *colon = strchr(path, ':');
+	size_t len;
+	int i;
+
+	if (colon == NULL)
+		return NULL;
+	len = colon - path + 1;
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (fidx_list[i] && strncmp(fidx_list[i]->device, path, len) == 0 &&
+		    fidx_list[i]->device[len] == '\0')
+			return fidx_list[i];
+	}
+
+	return NULL;
+}
+
+/* Resolves the directory holding a normalized Vita path and points name
+ * at the last component. Returns FIDX_NONE if it is not indexed. */
+static unsigned int fidx_resolve_parent(const fidx_index *idx, char *path, const char **name)
+{
+	unsigned int node = 0;
+	char *comp, *next;
+
+	if ((comp = strchr(path, '/')) == NULL)
+		return FIDX_NONE;
+	comp++;
+
+	while ((next = strchr(comp, '/')) != NULL) {
+		*next = '\0';
+		node = fidx_find_child(idx, node, comp);
+		*next = '/';
+		if (node == FIDX_NONE)
+			return FIDX_NONE;
+		comp = next + 1;
+	}
+
+	*name = comp;
+	return node;
+}
+
+/* Brings the entry for path in line with the filesystem */
+static void fidx_sync(char *path)
+{
+	fidx_index *idx;
+	unsigned int parent, node;
+	const char *name;
+	SceIoStat stat;
+	int exists = sceIoGetstat(path, &stat) >= 0;
+
+	sceKernelLockMutex(fidx_mtx, 1, NULL);
+	if ((idx = fidx_find(path)) != NULL && (parent = fidx_resolve_parent(idx, path, &name)) != FIDX_NONE) {
+		node = fidx_find_child(idx, parent, name);
+		if (exists && node == FIDX_NONE) {
+			fidx_add(idx, parent, name, SCE_STM_ISDIR(stat.st_mode) ? FIDX_DIR : 0);
+		} else if (!exists && node != FIDX_NONE) {
+			idx->nodes[node].flags |= FIDX_DELETED;
+			idx->dirty = 1;
+		}
+	}
+	sceKernelUnlockMutex(fidx_mtx, 1);
+}
+
+/* Moves the node, so a renamed directory keeps its indexed contents */
+static void fidx_rename(char *src, char *dst)
+{
+	fidx_index *idx;
+	unsigned int src_parent, dst_parent, node, old;
+	unsigned int name_off;
+	const char *src_name, *dst_name;
+
+	sceKernelLockMutex(fidx_mtx, 1, NULL);
+	if ((idx = fidx_find(src)) != NULL && idx == fidx_find(dst) &&
+	    (src_parent = fidx_resolve_parent(idx, src, &src_name)) != FIDX_NONE &&
+	    (node = fidx_find_child(idx, src_parent, src_name)) != FIDX_NONE &&
+	    (dst_parent = fidx_resolve_parent(idx, dst, &dst_name)) != FIDX_NONE &&
+	    (name_off = fidx_add_name(idx, dst_name)) != FIDX_NONE) {
+		/* A replaced destination is gone */
+		if ((old = fidx_find_child(idx, dst_parent, dst_name)) != FIDX_NONE && old != node)
+			idx->nodes[old].flags |= FIDX_DELETED;
+
+		fidx_hash_remove(idx, node);
+		idx->nodes[node].parent = dst_parent;
+		idx->nodes[node].name = name_off;
+		fidx_hash_insert(idx, node);
+		idx->dirty = 1;
+	}
+	sceKernelUnlockMutex(fidx_mtx, 1);
+}
+
+/* Drops deleted nodes and unused names. Renumbers the nodes, so only
+ * the index thread calls it, with fidx_mtx held. */
+static int fidx_compact(fidx_index *idx)
+{
+	const unsigned int unknown = FIDX_TOMBSTONE;
+	const unsigned int live = FIDX_TOMBSTONE - 1;
+	unsigned int *map;
+	char *names;
+	unsigned int i, j, k, n, state;
+	unsigned int count = 0;
+	unsigned int names_len = 0;
+	unsigned int len;
+
+	map = malloc(idx->count * sizeof(unsigned int));
+	names = malloc(idx->names_cap);
+	if (map == NULL || names == NULL) {
+		free(map);
+		free(names);
+		return -1;
+	}
+
+	/* A node is live if neither it nor a parent is deleted. Moved
+	 * directories can come after their children, so each chain is
+	 * followed up to the first node already decided. */
+	for (i = 0; i < idx->count; i++)
+		map[i] = unknown;
+	map[0] = live;
+
+	for (i = 1; i < idx->count; i++) {
+		for (j = i, n = 0; map[j] == unknown && !(idx->nodes[j].flags & FIDX_DELETED) &&
+		     n < FIDX_MAX_DEPTH; j = idx->nodes[j].parent, n++)
+			;
+		state = map[j] == unknown ? FIDX_NONE : map[j];
+		for (j = i, k = 0; k <= n && map[j] == unknown; j = idx->nodes[j].parent, k++)
+			map[j] = state;
+	}
+
+	for (i = 0; i < idx->count; i++) {
+		if (map[i] == live)
+			map[i] = count++;
+	}
+
+	/* New numbers never exceed the old ones, so the nodes move down in place */
+	for (i = 0; i < idx->count; i++) {
+		if (map[i] == FIDX_NONE)
+			continue;
+		len = strlen(fidx_name(idx, i)) + 1;
+		memcpy(names + names_len, fidx_name(idx, i), len);
+		idx->nodes[map[i]] = idx->nodes[i];
+		idx->nodes[map[i]].parent = i == 0 ? FIDX_NONE : map[idx->nodes[i].parent];
+		idx->nodes[map[i]].name = names_len;
+		names_len += len;
+	}
+
+	free(idx->names);
+	free(map);
+	idx->names = names;
+	idx->names_len = names_len;
+	idx->count = count;
+	idx->cursor = count;
+
+	return fidx_hash_rebuild(idx, count);
+}
+
+static void fidx_file_path(const char *device, char *path, unsigned int size)
+{
+	char name[MAX_DEVNAME];
+	char *colon;
+
+	snprintf(name, sizeof(name), "%s", device);
+	if ((colon = strchr(name, ':')) != NULL)
+		*colon = '\0';
+	snprintf(path, size, "%s/index_%s.bin", fidx_dir, name);
+}
+
+static void fidx_save(fidx_index *idx)
+{
+	char path[sizeof(fidx_dir) + 32];
+	char tmp_path[sizeof(path) + 4];
+	fidx_file_header header;
+	SceUID fd;
+	int ok;
+
+	if (!fidx_dir[0])
+		return;
+
+	fidx_file_path(idx->device, path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	sceKernelLockMutex(fidx_mtx, 1, NULL);
+	if ((fd = sceIoOpen(tmp_path, SCE_O_CREAT | SCE_O_WRONLY | SCE_O_TRUNC, 0777)) >= 0) {
+		header.magic = FIDX_MAGIC;
+		header.version = FIDX_VERSION;
+		header.count = idx->count;
+		header.names_len = idx->names_len;
+		header.round = idx->round;
+
+		ok = sceIoWrite(fd, &header, sizeof(header)) == sizeof(header) &&
+			sceIoWrite(fd, idx->nodes, idx->count * sizeof(fidx_node)) == (int)(idx->count * sizeof(fidx_node)) &&
+			sceIoWrite(fd, idx->names, idx->names_len) == (int)idx->names_len;
+		sceIoClose(fd);
+
+		if (ok) {
+			idx->dirty = 0;
+			sceIoRemove(path);
+			sceIoRename(tmp_path, path);
+		} else {
+			sceIoRemove(tmp_path);
+		}
+	}
+	sceKernelUnlockMutex(fidx_mtx, 1);
+}
+
+/* Checks an index read from a file: node 0 is the root, every other
+ * node has a name in the pool and a parent chain that ends at the root.
+ * Returns < 0 on the first bad node */
+static int fidx_validate(const fidx_index *idx)
+{
+	unsigned int *seen;
+	unsigned int i, j;
+	int ret = 0;
+
+	if (idx->nodes[0].parent != FIDX_NONE || idx->nodes[0].name >= idx->names_len)
+		return -1;
+	for (i = 1; i < idx->count; i++) {
+		if (idx->nodes[i].parent >= idx->count || idx->nodes[i].parent == i ||
+		    idx->nodes[i].name >= idx->names_len)
+			return -1;
+	}
+
+	/* seen[] is 0 for nodes not visited yet, i + 1 for the nodes on the
+	 * chain of node i, FIDX_NONE once a node is known to reach the root */
+	if ((seen = calloc(idx->count, sizeof(unsigned int))) == NULL)
+		return -1;
+	seen[0] = FIDX_NONE;
+
+	for (i = 1; i < idx->count; i++) {
+		for (j = i; seen[j] == 0; j = idx->nodes[j].parent)
+			seen[j] = i + 1;
+		if (seen[j] == i + 1) {
+			/* Loop in the parent chain */
+			ret = -1;
+			break;
+		}
+		for (j = i; seen[j] == i + 1; j = idx->nodes[j].parent)
+			seen[j] = FIDX_NONE;
+	}
+
+	free(seen);
+	return ret;
+}
+
+/* A loaded index answers queries right away and is refreshed by a new pass */
+static fidx_index *fidx_load(const char *device)
+{
+	char path[sizeof(fidx_dir) + 32];
+	fidx_file_header header;
+	fidx_index *idx;
+	SceUID fd;
+	int ok;
+
+	if (!fidx_dir[0])
+		return NULL;
+
+	fidx_file_path(device, path, sizeof(path));
+	if ((fd = sceIoOpen(path, SCE_O_RDONLY, 0)) < 0)
+		return NULL;
+
+	if (sceIoRead(fd, &header, sizeof(header)) != sizeof(header) ||
+	    header.magic != FIDX_MAGIC || header.version != FIDX_VERSION ||
+	    header.count == 0 || header.count > fidx_max_nodes || header.names_len == 0 ||
+	    (idx = calloc(1, sizeof(fidx_index))) == NULL) {
+		sceIoClose(fd);
+		return NULL;
+	}
+
+	snprintf(idx->device, sizeof(idx->device), "%s", device);
+	idx->count = idx->cap = header.count;
+	idx->names_len = idx->names_cap = header.names_len;
+	idx->nodes = malloc(idx->cap * sizeof(fidx_node));
+	idx->names = malloc(idx->names_cap);
+
+	ok = idx->nodes && idx->names &&
+		sceIoRead(fd, idx->nodes, idx->count * sizeof(fidx_node)) == (int)(idx->count * sizeof(fidx_node)) &&
+		sceIoRead(fd, idx->names, idx->names_len) == (int)idx->names_len &&
+		idx->names[idx->names_len - 1] == '\0';
+	sceIoClose(fd);
+
+	if (!ok || fidx_validate(idx) < 0 || fidx_hash_rebuild(idx, idx->count) < 0) {
+		INFO("Filename index of %s is damaged, rebuilding it\n", device);
+		fidx_free(idx);
+		return NULL;
+	}
+
+	idx->round = header.round + 1;
+	idx->scanning = 1;
+	idx->ready = 1;
+
+	return idx;
+}
+
+static void fidx_scan_dir(fidx_index *idx, unsigned int node, const char *path)
+{
+	SceIoDirent dirent;
+	unsigned int child;
+	int flags;
+	SceUID dir;
+
+	if ((dir = sceIoDopen(path)) < 0)
+		return;
+
+	memset(&dirent, 0, sizeof(dirent));
+	while (sceIoDread(dir, &dirent) > 0) {
+		flags = SCE_STM_ISDIR(dirent.d_stat.st_mode) ? FIDX_DIR : 0;
+
+		sceKernelLockMutex(fidx_mtx, 1, NULL);
+		if ((child = fidx_find_child(idx, node, dirent.d_name)) == FIDX_NONE) {
+			fidx_add(idx, node, dirent.d_name, flags);
+		} else {
+			idx->nodes[child].flags = (idx->nodes[child].flags & ~FIDX_DIR) | flags;
+			idx->nodes[child].round = idx->round;
+		}
+		sceKernelUnlockMutex(fidx_mtx, 1);
+
+		memset(&dirent, 0, sizeof(dirent));
+	}
+
+	sceIoDclose(dir);
+}
+
+/* Scans the next few directories of the device's index, creating or
+ * loading the index first. Returns 1 while there is crawling left. */
+static int fidx_crawl_step(int dev)
+{
+	char devname[MAX_DEVNAME];
+	char path[FTPVITA_PATH_MAX];
+	fidx_index *idx;
+	unsigned int node;
+	int i, n;
+
+	if (!device_list[dev].valid || fidx_max_nodes == 0)
+		return 0;
+	snprintf(devname, sizeof(devname), "%s", device_list[dev].name);
+
+	sceKernelLockMutex(fidx_mtx, 1, NULL);
+	idx = fidx_find(devname);
+	sceKernelUnlockMutex(fidx_mtx, 1);
+
+	if (idx == NULL) {
+		if ((idx = fidx_load(devname)) == NULL && (idx = fidx_new(devname)) == NULL)
+			return 0;
+
+		sceKernelLockMutex(fidx_mtx, 1, NULL);
+		for (i = 0; i < MAX_DEVICES && fidx_list[i]; i++)
+			;
+		if (i < MAX_DEVICES)
+			fidx_list[i] = idx;
+		sceKernelUnlockMutex(fidx_mtx, 1);
+
+		if (i == MAX_DEVICES) {
+			fidx_free(idx);
+			return 0;
+		}
+	}
+
+	if (!idx->scanning)
+		return 0;
+
+	for (n = 0; n < FIDX_CRAWL_BATCH; ) {
+		sceKernelLockMutex(fidx_mtx, 1, NULL);
+
+		if (idx->cursor >= idx->count) {
+			/* End of the pass, whatever was not seen again is gone */
+			for (node = 1; node < idx->count; node++) {
+				if (idx->nodes[node].round != idx->round)
+					idx->nodes[node].flags |= FIDX_DELETED;
+			}
+			fidx_compact(idx);
+			idx->scanning = 0;
+			idx->ready = 1;
+			idx->dirty = 1;
+			sceKernelUnlockMutex(fidx_mtx, 1);
+
+			INFO("Filename index of %s: %u entries\n", idx->device, idx->count - 1);
+			fidx_save(idx);
+			return 1;
+		}
+
+		node = idx->cursor++;
+		if (!(idx->nodes[node].flags & FIDX_DIR) || fidx_node_path(idx, node, path, sizeof(path)) < 0) {
+			sceKernelUnlockMutex(fidx_mtx, 1);
+			continue;
+		}
+		if (node == 0)
+			idx->nodes[0].round = idx->round;
+		sceKernelUnlockMutex(fidx_mtx, 1);
+
+		fidx_scan_dir(idx, node, path);
+		n++;
+	}
+
+	return 1;
+}
+
+static void fidx_save_all(void)
+{
+	int i;
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (fidx_list[i] && fidx_list[i]->dirty)
+			fidx_save(fidx_list[i]);
+	}
+}
+
+static int fidx_thread(SceSize args, void *argp)
+{
+	SceUInt64 last_save = sceKernelGetProcessTimeWide();
+	SceUInt64 now;
+	SceUInt32 timeout;
+	int crawling;
+	int i;
+
+	while (fidx_thread_run) {
+		crawling = 0;
+		for (i = 0; i < MAX_DEVICES && fidx_thread_run; i++)
+			crawling |= fidx_crawl_step(i);
+
+		now = sceKernelGetProcessTimeWide();
+		if (now - last_save >= FIDX_SAVE_INTERVAL) {
+			fidx_save_all();
+			last_save = now;
+		}
+
+		if (crawling) {
+			sceKernelDelayThread(sched_xfer_count > 0 ? FIDX_CRAWL_BUSY_DELAY : FIDX_CRAWL_DELAY);
+		} else {
+			timeout = FIDX_SAVE_INTERVAL;
+			sceKernelWaitSema(fidx_sema, 1, &timeout);
+		}
+	}
+
+	fidx_save_all();
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+static SceUInt64 fnv1a64(SceUInt64 hash, const unsigned char *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= buf[i];
+		hash *= FNV64_PRIME;
+	}
+
+	return hash;
+}
+
+/* Read-ahead:
+ * the files of a session's last listing are remembered in listing order.
+ * When a RETR matches one of them, the prefetch thread opens the next one
+ * and reads its head while the current file is sent, so the next RETR can
+ * start sending without waiting on the filesystem. Heads are limited to
+ * prefetch_size bytes each and prefetch_max bytes in total */
+
+enum {
+	PREFETCH_IDLE,
+	PREFETCH_QUEUED,
+	PREFETCH_LOADING,
+	PREFETCH_READY,
+	/* Dropped while loading, the prefetch thread cleans up */
+	PREFETCH_CANCELLED,
+};
+
+typedef struct {
+	/* Files of the last listing, NUL separated normalized Vita paths */
+	char *names;
+	unsigned int names_len;
+	unsigned int cursor;
+	/* Head of the predicted next file */
+	int state;
+	char *path;
+	SceUID fd;
+	unsigned char *buf;
+	unsigned int len;
+	SceOff file_size;
+} prefetch_state;
+
+/* A listing being sent, handed to the session when complete */
+typedef struct {
+	char *names;
+	unsigned int len;
+} prefetch_list;
+
+typedef struct {
+	unsigned char *buf;
+	unsigned int len;
+	SceOff file_size;
+} prefetch_head;
+
+static prefetch_state prefetch[MAX_SESSIONS];
+static SceUID prefetch_mtx;
+static SceUID prefetch_sema;
+static SceUID prefetch_thid;
+static int prefetch_thread_run = 0;
+static unsigned int prefetch_size = DEFAULT_PREFETCH_SIZE;
+static unsigned int prefetch_max = DEFAULT_PREFETCH_MAX;
+static volatile int prefetch_bytes = 0;
+static unsigned int prefetch_hits = 0;
+static unsigned int prefetch_late = 0;
+static unsigned int prefetch_wasted = 0;
+static unsigned int prefetch_capped = 0;
+
+static inline int session_slot(const ftpvita_client_info_t *client)
+{
+	return client->num & ((1 << SESSION_SLOT_BITS) - 1);
+}
+
+/* Called with prefetch_mtx held */
+static void prefetch_drop(prefetch_state *pf)
+{
+	if (pf->state == PREFETCH_LOADING) {
+		pf->state = PREFETCH_CANCELLED;
+		return;
+	}
+	if (pf->state == PREFETCH_CANCELLED)
+		return;
+
+	if (pf->state == PREFETCH_READY) {
+		sceIoClose(pf->fd);
+		if (pf->buf) {
+			xfer_buf_free(pf->buf, pf->len);
+			sceKernelAtomicSubAndGet32(&prefetch_bytes, pf->len);
+		}
+	}
+	free(pf->path);
+	pf->path = NULL;
+	pf->buf = NULL;
+	pf->state = PREFETCH_IDLE;
+}
+
+static void prefetch_list_add(prefetch_list *list, const char *dir, const char *name)
+{
+	char path[FTPVITA_PATH_MAX];
+	unsigned int len;
+
+	if (!prefetch_size || list->len >= PREFETCH_LIST_SIZE)
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", get_vita_path(dir), name);
+	path_normalize(path);
+	len = strlen(path) + 1;
+
+	if (list->names == NULL && (list->names = malloc(PREFETCH_LIST_SIZE)) == NULL)
+		return;
+	if (list->len + len > PREFETCH_LIST_SIZE) {
+		list->len = PREFETCH_LIST_SIZE;
+		return;
+	}
+
+	memcpy(list->names + list->len, path, len);
+	list->len += len;
+}
+
+/* Replaces the session's remembered listing */
+static void prefetch_list_set(ftpvita_client_info_t *client, prefetch_list *list)
+{
+	prefetch_state *pf = &prefetch[session_slot(client)];
+	char *old;
+
+	/* A truncated listing still predicts its first part */
+	while (list->len > 0 && list->names[list->len - 1] != '\0')
+		list->len--;
+
+	sceKernelLockMutex(prefetch_mtx, 1, NULL);
+	old = pf->names;
+	pf->names = list->names;
+	pf->names_len = list->len;
+	pf->cursor = 0;
+	sceKernelUnlockMutex(prefetch_mtx, 1);
+
+	free(old);
+}
+
+/* Takes the prefetched head of path if there is one, returns its open
+ * file positioned after the head, or < 0 */
+static SceUID prefetch_take(ftpvita_client_info_t *client, const char *path, prefetch_head *head)
+{
+	prefetch_state *pf = &prefetch[session_slot(client)];
+	SceUID fd = -1;
+
+	sceKernelLockMutex(prefetch_mtx, 1, NULL);
+	if (pf->path && strcmp(pf->path, path) == 0 && pf->state == PREFETCH_READY &&
+	    client->restore_point == 0) {
+		fd = pf->fd;
+		head->buf = pf->buf;
+		head->len = pf->len;
+		head->file_size = pf->file_size;
+		free(pf->path);
+		pf->path = NULL;
+		pf->buf = NULL;
+		pf->state = PREFETCH_IDLE;
+		prefetch_hits++;
+	} else if (pf->state != PREFETCH_IDLE && pf->state != PREFETCH_CANCELLED) {
+		if (pf->path && strcmp(pf->path, path) == 0)
+			prefetch_late++;
+		else
+			prefetch_wasted++;
+		prefetch_drop(pf);
+	}
+	sceKernelUnlockMutex(prefetch_mtx, 1);
+
+	return fd;
+}
+
+static void prefetch_head_free(prefetch_head *head)
+{
+	if (head->buf) {
+		xfer_buf_free(head->buf, head->len);
+		sceKernelAtomicSubAndGet32(&prefetch_bytes, head->len);
+		head->buf = NULL;
+	}
+}
+
+/* Queues the file listed after path, if path was listed */
+static void prefetch_next(ftpvita_client_info_t *client, const char *path)
+{
+	prefetch_state *pf = &prefetch[session_slot(client)];
+	unsigned int off;
+	unsigned int i;
+	int queued = 0;
+
+	if (!prefetch_size)
+		return;
+
+	sceKernelLockMutex(prefetch_mtx, 1, NULL);
+
+	/* Listings are usually fetched in order, start at the last match */
+	for (i = 0, off = pf->cursor; pf->names && i < pf->names_len && pf->state == PREFETCH_IDLE; ) {
+		if (off >= pf->names_len) {
+			off = 0;
+			continue;
+		}
+		if (strcmp(pf->names + off, path) == 0) {
+			off += strlen(pf->names + off) + 1;
+			if (off < pf->names_len && (pf->path = strdup(pf->names + off)) != NULL) {
+				pf->cursor = off;
+				pf->state = PREFETCH_QUEUED;
+				queued = 1;
+			}
+			break;
+		}
+		i += strlen(pf->names + off) + 1;
+		off += strlen(pf->names + off) + 1;
+	}
+
+	sceKernelUnlockMutex(prefetch_mtx, 1);
+
+	if (queued)
+		sceKernelSignalSema(prefetch_sema, 1);
+}
+
+/* Called by the handlers that modify the filesystem */
+static void prefetch_invalidate(const char *path)
+{
+	int i;
+
+	sceKernelLockMutex(prefetch_mtx, 1, NULL);
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		if (prefetch[i].path && path_is_within(prefetch[i].path, path))
+			prefetch_drop(&prefetch[i]);
+	}
+	sceKernelUnlockMutex(prefetch_mtx, 1);
+}
+
+/* Called when a session ends */
+static void prefetch_release(int slot)
+{
+	prefetch_state *pf = &prefetch[slot];
+
+	sceKernelLockMutex(prefetch_mtx, 1, NULL);
+	prefetch_drop(pf);
+	free(pf->names);
+	pf->names = NULL;
+	pf->names_len = 0;
+	sceKernelUnlockMutex(prefetch_mtx, 1);
+}
+
+static void prefetch_load(prefetch_state *pf)
+{
+	SceIoStat stat;
+	unsigned char *buf = NULL;
+	unsigned int len = 0;
+	SceUID fd;
+	int ret;
+
+	if ((fd = sceIoOpen(pf->path, SCE_O_RDONLY, 0)) >= 0 && sceIoGetstatByFd(fd, &stat) >= 0) {
+		len = stat.st_size < prefetch_size ? stat.st_size : prefetch_size;
+
+		/* Over the cap the file is only opened */
+		if (len > 0 && sceKernelAtomicAddAndGet32(&prefetch_bytes, len) > (int)prefetch_max) {
+			sceKernelAtomicSubAndGet32(&prefetch_bytes, len);
+			prefetch_capped++;
+			len = 0;
+		}
+
+		if (len > 0 && (buf = xfer_buf_alloc(len)) != NULL) {
+			if ((ret = sceIoRead(fd, buf, len)) != (int)len) {
+				sceIoLseek(fd, 0, SCE_SEEK_SET);
+				xfer_buf_free(buf, len);
+				buf = NULL;
+			}
+		}
+		if (buf == NULL && len > 0) {
+			sceKernelAtomicSubAndGet32(&prefetch_bytes, len);
+			len = 0;
+		}
+	} else if (fd >= 0) {
+		sceIoClose(fd);
+		fd = -1;
+	}
+
+	sceKernelLockMutex(prefetch_mtx, 1, NULL);
+	if (pf->state == PREFETCH_LOADING && fd >= 0) {
+		pf->fd = fd;
+		pf->buf = buf;
+		pf->len = len;
+		pf->file_size = stat.st_size;
+		pf->state = PREFETCH_READY;
+	} else {
+		if (fd >= 0)
+			sceIoClose(fd);
+		if (buf) {
+			xfer_buf_free(buf, len);
+			sceKernelAtomicSubAndGet32(&prefetch_bytes, len);
+		}
+		free(pf->path);
+		pf->path = NULL;
+		pf->state = PREFETCH_IDLE;
+	}
+	sceKernelUnlockMutex(prefetch_mtx, 1);
+}
+
+static int prefetch_thread(SceSize args, void *argp)
+{
+	prefetch_state *pf;
+	int i;
+
+	DEBUG("Prefetch thread started!\n");
+
+	while (prefetch_thread_run) {
+		sceKernelWaitSema(prefetch_sema, 1, NULL);
+
+		for (i = 0; i < MAX_SESSIONS && prefetch_thread_run; i++) {
+			pf = NULL;
+			sceKernelLockMutex(prefetch_mtx, 1, NULL);
+			if (prefetch[i].state == PREFETCH_QUEUED) {
+				prefetch[i].state = PREFETCH_LOADING;
+				pf = &prefetch[i];
+			}
+			sceKernelUnlockMutex(prefetch_mtx, 1);
+
+			if (pf)
+				prefetch_load(pf);
+		}
+	}
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+/* Partial uploads journal:
+ * aborted uploads are kept in place and remembered with the offset that
+ * was synced to disk and a hash of the bytes before it. Running uploads
+ * are checkpointed too, so an upload cut off by the application being
+ * killed can be resumed from its last checkpoint. */
+
+typedef struct {
+	char path[FTPVITA_PATH_MAX];
+	SceOff offset;
+	SceUInt64 tail_sum;
+	unsigned int seq;
+	int valid;
+} journal_entry;
+
+typedef struct {
+	unsigned int magic;
+	unsigned int count;
+	unsigned int seq;
+} journal_file_header;
+
+typedef struct {
+	SceOff offset;
+	SceUInt64 tail_sum;
+	unsigned int seq;
+	unsigned int path_len;
+} journal_record;
+
+static journal_entry journal[JOURNAL_MAX_ENTRIES];
+static unsigned int journal_seq = 0;
+
+/* Hash of the JOURNAL_TAIL_SIZE bytes before offset, buf is scratch space */
+static int journal_tail_sum(SceUID fd, SceOff offset, unsigned char *buf, unsigned int size, SceUInt64 *sum)
+{
+	SceOff pos = offset > JOURNAL_TAIL_SIZE ? offset - JOURNAL_TAIL_SIZE : 0;
+	unsigned int chunk;
+
+	*sum = FNV64_INIT;
+	while (pos < offset) {
+		chunk = offset - pos < size ? offset - pos : size;
+		if (sceIoPread(fd, buf, chunk, pos) != (int)chunk)
+			return -1;
+		*sum = fnv1a64(*sum, buf, chunk);
+		pos += chunk;
+	}
+
+	return 0;
+}
+
+static int journal_find(const char *path)
+{
+	int i;
+
+	for (i = 0; i < JOURNAL_MAX_ENTRIES; i++) {
+		if (journal[i].valid && strcmp(journal[i].path, path) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Called with journal_mtx held */
+static void journal_save(void)
+{
+	char tmp_path[sizeof(journal_path) + 4];
+	journal_file_header header;
+	journal_record record;
+	SceUID fd;
+	int ok = 1;
+	int i;
+
+	if (!journal_path[0])
+		return;
+
+	header.magic = JOURNAL_MAGIC;
+	header.count = 0;
+	header.seq = journal_seq;
+	for (i = 0; i < JOURNAL_MAX_ENTRIES; i++) {
+		if (journal[i].valid)
+			header.count++;
+	}
+
+	if (header.count == 0) {
+		sceIoRemove(journal_path);
+		return;
+	}
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal_path);
+	if ((fd = sceIoOpen(tmp_path, SCE_O_CREAT | SCE_O_WRONLY | SCE_O_TRUNC, 0777)) < 0)
+		return;
+
+	ok = sceIoWrite(fd, &header, sizeof(header)) == sizeof(header);
+	for (i = 0; ok && i < JOURNAL_MAX_ENTRIES; i++) {
+		if (!journal[i].valid)
+			continue;
+		record.offset = journal[i].offset;
+		record.tail_sum = journal[i].tail_sum;
+		record.seq = journal[i].seq;
+		record.path_len = strlen(journal[i].path);
+		ok = sceIoWrite(fd, &record, sizeof(record)) == sizeof(record) &&
+			sceIoWrite(fd, journal[i].path, record.path_len) == (int)record.path_len;
+	}
+	sceIoClose(fd);
+
+	if (ok) {
+		sceIoRemove(journal_path);
+		sceIoRename(tmp_path, journal_path);
+	} else {
+		sceIoRemove(tmp_path);
+	}
+}
+
+static void journal_load(void)
+{
+	journal_file_header header;
+	journal_record record;
+	journal_entry *entry;
+	SceUID fd;
+	unsigned int i = 0;
+
+	memset(journal, 0, sizeof(journal));
+	journal_seq = 0;
+
+	if (!journal_path[0] || (fd = sceIoOpen(journal_path, SCE_O_RDONLY, 0)) < 0)
+		return;
+
+	if (sceIoRead(fd, &header, sizeof(header)) == sizeof(header) && header.magic == JOURNAL_MAGIC) {
+		journal_seq = header.seq;
+		for (i = 0; i < header.count && i < JOURNAL_MAX_ENTRIES; i++) {
+			entry = &journal[i];
+			if (sceIoRead(fd, &record, sizeof(record)) != sizeof(record) ||
+			    record.path_len >= sizeof(entry->path) ||
+			    sceIoRead(fd, entry->path, record.path_len) != (int)record.path_len)
+				break;
+			entry->path[record.path_len] = '\0';
+			entry->offset = record.offset;
+			entry->tail_sum = record.tail_sum;
+			entry->seq = record.seq;
+			entry->valid = 1;
+		}
+	}
+
+	sceIoClose(fd);
+	DEBUG("Upload journal: %u entries\n", i);
+}
+
+/* Syncs fd and journals the upload to path as complete up to offset */
+static void journal_checkpoint(const char *path, SceUID fd, SceOff offset, unsigned char *buf, unsigned int size)
+{
+	SceUInt64 tail_sum;
+	int slot, i;
+
+	sceIoSyncByFd(fd, 0);
+	if (journal_tail_sum(fd, offset, buf, size, &tail_sum) < 0)
+		return;
+
+	sceKernelLockMutex(journal_mtx, 1, NULL);
+
+	/* The least recently updated entry makes room */
+	if ((slot = journal_find(path)) < 0) {
+		slot = 0;
+		for (i = 0; i < JOURNAL_MAX_ENTRIES; i++) {
+			if (!journal[i].valid) {
+				slot = i;
+				break;
+			}
+			if (journal[i].seq < journal[slot].seq)
+				slot = i;
+		}
+		snprintf(journal[slot].path, sizeof(journal[slot].path), "%s", path);
+		journal[slot].valid = 1;
+	}
+
+	journal[slot].offset = offset;
+	journal[slot].tail_sum = tail_sum;
+	journal[slot].seq = ++journal_seq;
+	journal_save();
+
+	sceKernelUnlockMutex(journal_mtx, 1);
+}
+
+static void journal_forget(const char *path)
+{
+	int slot;
+
+	sceKernelLockMutex(journal_mtx, 1, NULL);
+	if ((slot = journal_find(path)) >= 0) {
+		journal[slot].valid = 0;
+		journal_save();
+	}
+	sceKernelUnlockMutex(journal_mtx, 1);
+}
+
+/* Journaled offset of a partial upload, or -1. With fd the bytes before
+ * the offset are checked too, a file changed since is forgotten */
+static SceOff journal_offset(const char *path, SceUID fd, unsigned char *buf, unsigned int size)
+{
+	SceIoStat stat;
+	SceUInt64 expected = 0;
+	SceUInt64 tail_sum;
+	SceOff offset = -1;
+	int slot;
+
+	sceKernelLockMutex(journal_mtx, 1, NULL);
+	if ((slot = journal_find(path)) >= 0) {
+		offset = journal[slot].offset;
+		expected = journal[slot].tail_sum;
+	}
+	sceKernelUnlockMutex(journal_mtx, 1);
+
+	if (offset < 0)
+		return -1;
+
+	if (sceIoGetstat(path, &stat) < 0 || stat.st_size < offset ||
+	    (fd >= 0 && (journal_tail_sum(fd, offset, buf, size, &tail_sum) < 0 ||
+	                 tail_sum != expected))) {
+		INFO("Partial upload %s changed, forgetting it\n", path);
+		journal_forget(path);
+		return -1;
+	}
+
+	return offset;
+}
+
+static void journal_rename(const char *src, const char *dst)
+{
+	char path[FTPVITA_PATH_MAX];
+	size_t len = strlen(src);
+	int changed = 0;
+	int i;
+
+	sceKernelLockMutex(journal_mtx, 1, NULL);
+	for (i = 0; i < JOURNAL_MAX_ENTRIES; i++) {
+		if (journal[i].valid && path_is_within(journal[i].path, src)) {
+			snprintf(path, sizeof(path), "%s%s", dst, journal[i].path + len);
+			snprintf(journal[i].path, sizeof(journal[i].path), "%s", path);
+			changed = 1;
+		}
+	}
+	if (changed)
+		journal_save();
+	sceKernelUnlockMutex(journal_mtx, 1);
+}
+
+/* Called by the handlers that modify the filesystem */
+static void path_changed(const char *vita_path)
+{
+	char path[FTPVITA_PATH_MAX];
+	SceIoStat stat;
+
+	snprintf(path, sizeof(path), "%s", vita_path);
+	path_normalize(path);
+	du_cache_invalidate(path);
+	fidx_sync(path);
+	prefetch_invalidate(path);
+
+	/* Deleted partial uploads */
+	if (sceIoGetstat(path, &stat) < 0)
+		journal_forget(path);
+}
+
+static void path_renamed(const char *vita_src, const char *vita_dst)
+{
+	char src[FTPVITA_PATH_MAX];
+	char dst[FTPVITA_PATH_MAX];
+
+	snprintf(src, sizeof(src), "%s", vita_src);
+	snprintf(dst, sizeof(dst), "%s", vita_dst);
+	path_normalize(src);
+	path_normalize(dst);
+	fidx_rename(src, dst);
+	prefetch_invalidate(src);
+	journal_rename(src, dst);
+}
+
+static void cmd_NOOP_func(ftpvita_client_info_t *client)
+{
+	client_send_ctrl_msg(client, "200 No operation ;)" FTPVITA_EOL);
+}
+
+static void cmd_USER_func(ftpvita_client_info_t *client)
+{
+	client_send_ctrl_msg(client, "331 Username OK, need password b0ss." FTPVITA_EOL);
+}
+
+static void cmd_PASS_func(ftpvita_client_info_t *client)
+{
+	client_send_ctrl_msg(client, "230 User logged in!" FTPVITA_EOL);
+}
+
+static void cmd_QUIT_func(ftpvita_client_info_t *client)
+{
+	client_send_ctrl_msg(client, "221 Goodbye senpai :'(" FTPVITA_EOL);
+}
+
+static void cmd_SYST_func(ftpvita_client_info_t *client)
+{
+	client_send_ctrl_msg(client, "215 UNIX Type: L8" FTPVITA_EOL);
+}
+
+static int pasv_port_in_range(unsigned int port)
+{
+	return port >= pasv_port_min && port <= pasv_port_max;
+}
+
+static int pasv_listener_open(unsigned short port)
+{
+	int sockfd;
+	int on = 1;
+	char socket_name[64];
+	SceNetSockaddrIn addr;
+
+	sprintf(socket_name, "FTPVita_pasv_%u_socket", port);
+	sockfd = sceNetSocket(socket_name, SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, 0);
+	if (sockfd < 0)
+		return sockfd;
+
+	sceNetSetsockopt(sockfd, SCE_NET_SOL_SOCKET, SCE_NET_SO_REUSEADDR, &on, sizeof(on));
+	/* Accepted sockets inherit the buffer sizes */
+	if (data_sndbuf)
+		sceNetSetsockopt(sockfd, SCE_NET_SOL_SOCKET, SCE_NET_SO_SNDBUF, &data_sndbuf, sizeof(data_sndbuf));
+	if (data_rcvbuf)
+		sceNetSetsockopt(sockfd, SCE_NET_SOL_SOCKET, SCE_NET_SO_RCVBUF, &data_rcvbuf, sizeof(data_rcvbuf));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = SCE_NET_AF_INET;
+	addr.sin_addr.s_addr = sceNetHtonl(SCE_NET_INADDR_ANY);
+	addr.sin_port = sceNetHtons(port);
+
+	if (sceNetBind(sockfd, (SceNetSockaddr *)&addr, sizeof(addr)) < 0 ||
+		sceNetListen(sockfd, PASV_BACKLOG) < 0) {
+		sceNetSocketClose(sockfd);
+		return -1;
+	}
+
+	DEBUG("PASV listener on port %u, fd: %d\n", port, sockfd);
+
+	return sockfd;
+}
+
+/* Leases a passive listener to the client, reusing a bound one when
+ * possible. Returns the slot or -1 if the port range is exhausted */
+static int pasv_lease(ftpvita_client_info_t *client)
+{
+	int i, j;
+	int slot = -1;
+	unsigned int port;
+
+	sceKernelLockMutex(pasv_pool_mtx, 1, NULL);
+
+	/* A client issuing PASV again keeps its listener */
+	if (client->pasv_slot >= 0) {
+		slot = client->pasv_slot;
+		goto out;
+	}
+
+	for (i = 0; i < MAX_PASV_LISTENERS; i++) {
+		if (pasv_pool[i].sockfd >= 0 && !pasv_pool[i].owner &&
+			pasv_port_in_range(pasv_pool[i].port)) {
+			slot = i;
+			goto out;
+		}
+	}
+
+	/* Bind a new listener on a port of the range no slot is using */
+	for (port = pasv_port_min; port <= pasv_port_max && slot < 0; port++) {
+		int empty = -1;
+
+		for (i = 0; i < MAX_PASV_LISTENERS; i++) {
+			if (pasv_pool[i].sockfd >= 0 && pasv_pool[i].port == port)
+				break;
+			if (pasv_pool[i].sockfd < 0 && empty < 0)
+				empty = i;
+		}
+		if (i < MAX_PASV_LISTENERS)
+			continue;
+		if (empty < 0)
+			break;
+
+		j = pasv_listener_open(port);
+		if (j >= 0) {
+			pasv_pool[empty].sockfd = j;
+			pasv_pool[empty].port = port;
+			slot = empty;
+		}
+	}
+
+out:
+	if (slot >= 0) {
+		pasv_pool[slot].owner = client;
+		client->pasv_slot = slot;
+	}
+
+	sceKernelUnlockMutex(pasv_pool_mtx, 1);
+
+	return slot;
+}
+
+static void pasv_release(ftpvita_client_info_t *client)
+{
+	int slot = client->pasv_slot;
+
+	if (slot < 0)
+		return;
+
+	sceKernelLockMutex(pasv_pool_mtx, 1, NULL);
+
+	pasv_pool[slot].owner = NULL;
+	/* Listeners left outside of a changed range are not reused */
+	if (!pasv_port_in_range(pasv_pool[slot].port)) {
+		sceNetSocketClose(pasv_pool[slot].sockfd);
+		pasv_pool[slot].sockfd = -1;
+	}
+	client->pasv_slot = -1;
+
+	sceKernelUnlockMutex(pasv_pool_mtx, 1);
+}
+
+/* Closes the free listeners that no longer match the settings,
+ * leased listeners are closed when released */
+static void pasv_pool_trim(void)
+{
+	int i;
+
+	if (!ftp_initialized)
+		return;
+
+	sceKernelLockMutex(pasv_pool_mtx, 1, NULL);
+
+	for (i = 0; i < MAX_PASV_LISTENERS; i++) {
+		if (pasv_pool[i].sockfd >= 0 && !pasv_pool[i].owner) {
+			sceNetSocketClose(pasv_pool[i].sockfd);
+			pasv_pool[i].sockfd = -1;
+		}
+	}
+
+	sceKernelUnlockMutex(pasv_pool_mtx, 1);
+}
+
+/* Closes the client's data sockets and returns its PASV listener */
+static void client_release_data(ftpvita_client_info_t *client)
+{
+	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
+		sceNetSocketClose(client->data_sockfd);
+	} else if (client->data_con_type == FTP_DATA_CONNECTION_PASSIVE) {
+		if (client->pasv_sockfd >= 0)
+			sceNetSocketClose(client->pasv_sockfd);
+		client->pasv_sockfd = -1;
+	}
+	pasv_release(client);
+	client->data_con_type = FTP_DATA_CONNECTION_NONE;
+	client->data_open = 0;
+}
+
+/* Returns the port of the leased listener, or 0 on failure */
+static unsigned short client_enter_passive(ftpvita_client_info_t *client)
+{
+	int slot;
+
+	/* Drop a pending PORT socket or an open MODE B connection,
+	 * an unused listener lease is kept */
+	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE || client->data_open)
+		client_release_data(client);
+
+	slot = pasv_lease(client);
+	if (slot < 0)
+		return 0;
+
+	client->data_sockfd = pasv_pool[slot].sockfd;
+	client->pasv_sockfd = -1;
+
+	/* Set the data connection type to passive! */
+	client->data_con_type = FTP_DATA_CONNECTION_PASSIVE;
+
+	return pasv_pool[slot].port;
+}
+
+static void cmd_PASV_func(ftpvita_client_info_t *client)
+{
+	char cmd[512];
+	unsigned short port = client_enter_passive(client);
+
+	if (port == 0) {
+		client_send_ctrl_msg(client, "425 No passive port available." FTPVITA_EOL);
+		return;
+	}
+
+	DEBUG("PASV mode port: %u\n", port);
+
+	/* Build the command */
+	sprintf(cmd, "227 Entering Passive Mode (%hhu,%hhu,%hhu,%hhu,%hhu,%hhu)" FTPVITA_EOL,
+		(vita_addr.s_addr >> 0) & 0xFF,
+		(vita_addr.s_addr >> 8) & 0xFF,
+		(vita_addr.s_addr >> 16) & 0xFF,
+		(vita_addr.s_addr >> 24) & 0xFF,
+		(port >> 8) & 0xFF,
+		(port >> 0) & 0xFF);
+
+	client_send_ctrl_msg(client, cmd);
+}
+
+static void cmd_EPSV_func(ftpvita_client_info_t *client)
+{
+	char cmd[64];
+	char arg[8];
+	unsigned short port;
+
+	if (sscanf(client->recv_cmd_args, "%7s", arg) == 1 && client->recv_cmd_args != client->recv_buffer) {
+		if (strcmp(arg, "ALL") == 0 || strcmp(arg, "all") == 0) {
+			client_send_ctrl_msg(client, "200 EPSV ALL ok." FTPVITA_EOL);
+			return;
+		} else if (strcmp(arg, "1") != 0) {
+			client_send_ctrl_msg(client, "522 Network protocol not supported, use (1)" FTPVITA_EOL);
+			return;
+		}
+	}
+
+	port = client_enter_passive(client);
+	if (port == 0) {
+		client_send_ctrl_msg(client, "425 No passive port available." FTPVITA_EOL);
+		return;
+	}
+
+	sprintf(cmd, "229 Entering Extended Passive Mode (|||%u|)" FTPVITA_EOL, port);
+	client_send_ctrl_msg(client, cmd);
+}
+
+static void cmd_PORT_func(ftpvita_client_info_t *client)
+{
+	unsigned int data_ip[4];
+	unsigned int porthi, portlo;
+	unsigned short data_port;
+	char ip_str[16];
+	SceNetInAddr data_addr;
+
+	/* Using ints because of newlibc's u8 sscanf bug */
+	sscanf(client->recv_cmd_args, "%d,%d,%d,%d,%d,%d",
+		&data_ip[0], &data_ip[1], &data_ip[2], &data_ip[3],
+		&porthi, &portlo);
+
+	data_port = portlo + porthi*256;
+
+	/* Convert to an X.X.X.X IP string */
+	sprintf(ip_str, "%d.%d.%d.%d",
+		data_ip[0], data_ip[1], data_ip[2], data_ip[3]);
+
+	/* Convert the IP to a SceNetInAddr */
+	sceNetInetPton(SCE_NET_AF_INET, ip_str, &data_addr);
+
+	DEBUG("PORT connection to client's IP: %s Port: %d\n", ip_str, data_port);
+
+	/* Release the previous data socket or PASV listener */
+	client_release_data(client);
+
+	/* Create data mode socket name */
+	char data_socket_name[64];
+	sprintf(data_socket_name, "FTPVita_client_%i_data_socket",
+		client->num);
+
+	/* Create data mode socket */
+	client->data_sockfd = sceNetSocket(data_socket_name,
+		SCE_NET_AF_INET,
+		SCE_NET_SOCK_STREAM,
+		0);
+
+	DEBUG("Client %i data socket fd: %d\n", client->num,
+		client->data_sockfd);
+
+	/* Prepare socket address for the data connection */
+	client->data_sockaddr.sin_family = SCE_NET_AF_INET;
+	client->data_sockaddr.sin_addr = data_addr;
+	client->data_sockaddr.sin_port = sceNetHtons(data_port);
+
+	/* Set the data connection type to active! */
+	client->data_con_type = FTP_DATA_CONNECTION_ACTIVE;
+
+	client_send_ctrl_msg(client, "200 PORT command successful!" FTPVITA_EOL);
+}
+
+static void client_open_data_connection(ftpvita_client_info_t *client)
+{
+	int ret;
+	UNUSED(ret);
+
+	unsigned int addrlen;
+	SceUInt64 trace_start;
+
+	client->block_remaining = 0;
+	client->block_eof = 0;
+
+	client->xfer_aborted = 0;
+
+	/* MODE B reuses the connection of the previous transfer */
+	if (client->data_open)
+		return;
+
+	client->data_error = 0;
+	client->data_open = 1;
+	trace_start = trace_begin();
+
+	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
+		/* Connect to the client using the data socket */
+		ret = sceNetConnect(client->data_sockfd,
+			(SceNetSockaddr *)&client->data_sockaddr,
+			sizeof(client->data_sockaddr));
+
+		DEBUG("sceNetConnect(): 0x%08X\n", ret);
+		if (ret < 0)
+			client->data_error = 1;
+	} else {
+		/* Listen to the client using the data socket */
+		while (1) {
+			addrlen = sizeof(client->pasv_sockaddr);
+			client->pasv_sockfd = sceNetAccept(client->data_sockfd,
+				(SceNetSockaddr *)&client->pasv_sockaddr,
+				&addrlen);
+			DEBUG("PASV client fd: 0x%08X\n", client->pasv_sockfd);
+
+			/* Listeners are shared over time, drop stale connections
+			 * that don't come from this client */
+			if (client->pasv_sockfd < 0 ||
+				client->pasv_sockaddr.sin_addr.s_addr == client->addr.sin_addr.s_addr)
+				break;
+			sceNetSocketClose(client->pasv_sockfd);
+		}
+
+		if (client->pasv_sockfd < 0)
+			client->data_error = 1;
+
+		/* The listener is free for other clients once connected */
+		pasv_release(client);
+	}
+
+	trace_end(TRACE_NET, client->data_con_type == FTP_DATA_CONNECTION_ACTIVE ? "connect" : "accept",
+		client, trace_start);
+}
+
+/* Ends the transfer on the data connection. In MODE B the connection
+ * stays open, unless it failed or the receiver didn't get to EOF */
+static void client_close_data_connection(ftpvita_client_info_t *client)
+{
+	if (client->transfer_mode == FTP_TRANSFER_MODE_BLOCK && client->data_open &&
+		!client->data_error && client->block_remaining == 0) {
+		return;
+	}
+
+	client_release_data(client);
+}
+
+static void client_send_data_eof(ftpvita_client_info_t *client)
+{
+	if (client->transfer_mode == FTP_TRANSFER_MODE_BLOCK && !client->data_error)
+		client_send_block_header(client, BLOCK_DESC_EOF, 0);
+}
+
+static void client_send_transfer_complete(ftpvita_client_info_t *client)
+{
+	if (client->data_error)
+		client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPVITA_EOL);
+	else if (client->data_open)
+		client_send_ctrl_msg(client, "250 Transfer completed, data connection kept open." FTPVITA_EOL);
+	else
+		client_send_ctrl_msg(client, "226 Transfer completed." FTPVITA_EOL);
+}
+
+static int gen_list_format(char *out, int n, int dir, const SceIoStat *stat, const char *filename)
+{
+	static const char num_to_month[][4] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+	};
+
+	char yt[6];
+	SceDateTime cdt;
+	sceRtcGetCurrentClockLocalTime(&cdt);
+
+	if  (cdt.year == stat->st_mtime.year) {
+		snprintf(yt, sizeof(yt), "%02d:%02d", stat->st_mtime.hour, stat->st_mtime.minute);
+	}
+	else {
+		snprintf(yt, sizeof(yt), "%04d", stat->st_mtime.year);
+	}
+
+	return snprintf(out, n,
+		"%c%s 1 vita vita %u %s %-2d %s %s" FTPVITA_EOL,
+		dir ? 'd' : '-',
+		dir ? "rwxr-xr-x" : "rw-r--r--",
+		(unsigned int) stat->st_size,
+		num_to_month[stat->st_mtime.month<=0?0:(stat->st_mtime.month-1)%12],
+		stat->st_mtime.day,
+		yt,
+		filename);
+}
+
+/* Listing output is collected in LIST_BATCH_SIZE chunks instead of
+ * one send per entry */
+typedef struct {
+	ftpvita_client_info_t *client;
+	char *buf;
+	unsigned int len;
+} list_batch;
+
+static int list_batch_init(list_batch *batch, ftpvita_client_info_t *client)
+{
+	batch->client = client;
+	batch->len = 0;
+	batch->buf = malloc(LIST_BATCH_SIZE);
+	return batch->buf ? 0 : -1;
+}
+
+static void list_batch_flush(list_batch *batch)
+{
+	if (batch->len > 0) {
+		client_send_data_raw(batch->client, batch->buf, batch->len);
+		sched_account(batch->client, batch->len);
+		batch->len = 0;
+	}
+}
+
+static void list_batch_add(list_batch *batch, const char *str, unsigned int len)
+{
+	if (batch->len + len > LIST_BATCH_SIZE)
+		list_batch_flush(batch);
+
+	if (len > LIST_BATCH_SIZE) {
+		client_send_data_raw(batch->client, str, len);
+		return;
+	}
+
+	memcpy(batch->buf + batch->len, str, len);
+	batch->len += len;
+}
+
+static void list_batch_add_line(list_batch *batch, const char *str)
+{
+	list_batch_add(batch, str, strlen(str));
+	list_batch_add(batch, FTPVITA_EOL, sizeof(FTPVITA_EOL) - 1);
+}
+
+static void list_batch_free(list_batch *batch)
+{
+	list_batch_flush(batch);
+	free(batch->buf);
+}
+
+static int gen_mlsd_format(char *out, int n, int dir, const SceIoStat *stat, const char *prefix, const char *filename)
+{
+	/* Stat times are already UTC, as MLSD wants them */
+	return snprintf(out, n,
+		"type=%s;size=%lld;modify=%04d%02d%02d%02d%02d%02d; %s%s" FTPVITA_EOL,
+		dir ? "dir" : "file",
+		stat->st_size,
+		stat->st_mtime.year, stat->st_mtime.month, stat->st_mtime.day,
+		stat->st_mtime.hour, stat->st_mtime.minute, stat->st_mtime.second,
+		prefix, filename);
+}
+
+/* Directories waiting to be listed by a recursive listing, kept as
+ * <path>\0<depth><entry length> records in a buffer of list_stack_size
+ * bytes. Directories that don't fit are skipped. */
+typedef struct {
+	char *buf;
+	unsigned int len;
+} dir_stack;
+
+static int dir_stack_push(dir_stack *stack, const char *path, unsigned char depth)
+{
+	unsigned short entry_len = strlen(path) + 1 + 1 + sizeof(entry_len);
+
+	if (stack->len + entry_len > list_stack_size)
+		return -1;
+
+	strcpy(stack->buf + stack->len, path);
+	stack->buf[stack->len + entry_len - sizeof(entry_len) - 1] = depth;
+	memcpy(stack->buf + stack->len + entry_len - sizeof(entry_len), &entry_len, sizeof(entry_len));
+	stack->len += entry_len;
+
+	return 0;
+}
+
+static int dir_stack_pop(dir_stack *stack, char *path, unsigned char *depth)
+{
+	unsigned short entry_len;
+
+	if (stack->len == 0)
+		return 0;
+
+	memcpy(&entry_len, stack->buf + stack->len - sizeof(entry_len), sizeof(entry_len));
+	stack->len -= entry_len;
+	strcpy(path, stack->buf + stack->len);
+	*depth = stack->buf[stack->len + entry_len - sizeof(entry_len) - 1];
+
+	return 1;
+}
+
+static void list_add_entry(list_batch *batch, int flags, int dir, const SceIoStat *stat,
+	const char *prefix, const char *name)
+{
+	char line[512];
+	int len;
+
+	if (flags & LIST_MLSD)
+		len = gen_mlsd_format(line, sizeof(line), dir, stat, prefix, name);
+	else
+		len = gen_list_format(line, sizeof(line), dir, stat, name);
+
+	if (len >= (int)sizeof(line))
+		len = sizeof(line) - 1;
+	list_batch_add(batch, line, len);
+}
+
+/* LIST and MLSD. With LIST_RECURSIVE the whole tree goes over the same
+ * data connection: LIST prints an "ls -R" style "<dir>:" header before
+ * each directory, MLSD names the entries relative to the listed one. */
+static void send_LIST(ftpvita_client_info_t *client, const char *list_path, int flags)
+{
+	char root[FTPVITA_PATH_MAX];
+	char path[FTPVITA_PATH_MAX];
+	char sub[FTPVITA_PATH_MAX];
+	char rel[FTPVITA_PATH_MAX];
+	char msg[96];
+	const char *prefix;
+	list_batch batch;
+	dir_stack stack;
+	prefetch_list plist = {NULL, 0};
+	SceIoDirent dirent;
+	SceIoStat stat;
+	SceUID dir;
+	SceUInt64 trace_start;
+	unsigned char depth;
+	unsigned int root_len;
+	int skipped = 0;
+	int i;
+
+	snprintf(root, sizeof(root), "%s", list_path);
+	path_normalize(root);
+	root_len = strlen(root);
+
+	/* "/" path is a special case, if we are here we have
+	 * to send the list of devices (aka mountpoints). */
+	if (strcmp(root, "/") != 0) {
+		trace_start = trace_begin();
+		dir = sceIoDopen(get_vita_path(root));
+		trace_end(TRACE_FS, "dopen", client, trace_start);
+		if (dir < 0) {
+			client_send_ctrl_msg(client, "550 Invalid directory." FTPVITA_EOL);
+			return;
+		}
+		sceIoDclose(dir);
+	}
+
+	stack.len = 0;
+	stack.buf = (flags & LIST_RECURSIVE) ? malloc(list_stack_size) : NULL;
+	if (((flags & LIST_RECURSIVE) && stack.buf == NULL) || list_batch_init(&batch, client) < 0) {
+		free(stack.buf);
+		client_send_ctrl_msg(client, "451 Could not allocate memory." FTPVITA_EOL);
+		return;
+	}
+
+	if (flags & LIST_MLSD)
+		client_send_ctrl_msg(client, "150 Opening ASCII mode data transfer for MLSD." FTPVITA_EOL);
+	else
+		client_send_ctrl_msg(client, "150 Opening ASCII mode data transfer for LIST." FTPVITA_EOL);
+
+	sched_xfer_begin(client, FTP_XFER_INTERACTIVE);
+	client_open_data_connection(client);
+
+	strcpy(path, root);
+	depth = 0;
+
+	do {
+		/* MLSD names are relative to the root, LIST gets a header */
+		prefix = "";
+		if (flags & LIST_RECURSIVE) {
+			if (flags & LIST_MLSD) {
+				prefix = path + root_len;
+				if (*prefix == '/')
+					prefix++;
+				if (*prefix) {
+					snprintf(rel, sizeof(rel), "%s/", prefix);
+					prefix = rel;
+				}
+			} else {
+				if (depth > 0)
+					list_batch_add(&batch, FTPVITA_EOL, sizeof(FTPVITA_EOL) - 1);
+				list_batch_add(&batch, path, strlen(path));
+				list_batch_add_line(&batch, ":");
+			}
+		}
+
+		if (strcmp(path, "/") == 0) {
+			for (i = 0; i < MAX_DEVICES; i++) {
+				if (device_list[i].valid && sceIoGetstat(device_list[i].name, &stat) >= 0) {
+					list_add_entry(&batch, flags, 1, &stat, prefix, device_list[i].name);
+					if (flags & LIST_RECURSIVE) {
+						snprintf(sub, sizeof(sub), "/%s", device_list[i].name);
+						if (depth >= list_max_depth || dir_stack_push(&stack, sub, depth + 1) < 0)
+							skipped++;
+					}
+				}
+			}
+			continue;
+		}
+
+		if ((dir = sceIoDopen(get_vita_path(path))) < 0) {
+			skipped++;
+			continue;
+		}
+
+		memset(&dirent, 0, sizeof(dirent));
+		while (!client->data_error && sceIoDread(dir, &dirent) > 0) {
+			list_add_entry(&batch, flags, SCE_STM_ISDIR(dirent.d_stat.st_mode),
+				&dirent.d_stat, prefix, dirent.d_name);
+			if (!SCE_STM_ISDIR(dirent.d_stat.st_mode))
+				prefetch_list_add(&plist, path, dirent.d_name);
+
+			if ((flags & LIST_RECURSIVE) && SCE_STM_ISDIR(dirent.d_stat.st_mode)) {
+				if (depth >= list_max_depth ||
+				    snprintf(sub, sizeof(sub), "%s/%s", path, dirent.d_name) >= (int)sizeof(sub) ||
+				    dir_stack_push(&stack, sub, depth + 1) < 0)
+					skipped++;
+			}
+			memset(&dirent, 0, sizeof(dirent));
+		}
+
+		sceIoDclose(dir);
+	} while ((flags & LIST_RECURSIVE) && !client->data_error && dir_stack_pop(&stack, path, &depth));
+
+	list_batch_free(&batch);
+	free(stack.buf);
+	prefetch_list_set(client, &plist);
+
+	DEBUG("Done sending LIST\n");
+
+	sched_xfer_end(client);
+	client_send_data_eof(client);
+	client_close_data_connection(client);
+	if (skipped && !client->data_error) {
+		snprintf(msg, sizeof(msg), "226-%d directories were not listed (depth or stack limit)" FTPVITA_EOL, skipped);
+		client_send_ctrl_msg(client, msg);
+	}
+	client_send_transfer_complete(client);
+}
+
+/* Skips ls style options like "-la", returns LIST_RECURSIVE for -R */
+static int parse_list_options(const char **args)
+{
+	const char *p = *args;
+	int flags = 0;
+
+	while (*p == '-') {
+		while (*p && *p != ' ' && *p != '\r' && *p != '\n') {
+			if (*p == 'R')
+				flags |= LIST_RECURSIVE;
+			p++;
+		}
+		while (*p == ' ')
+			p++;
+	}
+
+	*args = p;
+	return flags;
+}
+
+static void gen_ftp_fullpath_from(ftpvita_client_info_t *client, const char *cmd_path, char *path, size_t path_size);
+
+static void cmd_LIST_func(ftpvita_client_info_t *client)
+{
+	char arg[FTPVITA_PATH_MAX];
+	char list_path[FTPVITA_PATH_MAX];
+	const char *args = client->recv_cmd_args;
+	int flags = parse_list_options(&args);
+
+	if (sscanf(args, "%[^\r\n\t]", arg) > 0) {
+		gen_ftp_fullpath_from(client, arg, list_path, sizeof(list_path));
+		send_LIST(client, list_path, flags);
+	} else {
+		send_LIST(client, client->cur_path, flags);
+	}
+}
+
+static void cmd_MLSD_func(ftpvita_client_info_t *client)
+{
+	char arg[FTPVITA_PATH_MAX];
+	char list_path[FTPVITA_PATH_MAX];
+	const char *args = client->recv_cmd_args;
+	int flags = parse_list_options(&args) | LIST_MLSD;
+
+	if (sscanf(args, "%[^\r\n\t]", arg) > 0) {
+		gen_ftp_fullpath_from(client, arg, list_path, sizeof(list_path));
+		send_LIST(client, list_path, flags);
+	} else {
+		send_LIST(client, client->cur_path, flags);
+	}
+}
+
+/* MLST [path]: the MLSD facts of a single file or directory, sent over
+ * the control connection */
+static void cmd_MLST_func(ftpvita_client_info_t *client)
+{
+	char arg[FTPVITA_PATH_MAX];
+	char path[FTPVITA_PATH_MAX];
+	char msg[FTPVITA_PATH_MAX + 96];
+	SceIoStat stat;
+	int dir;
+
+	if (sscanf(client->recv_cmd_args, "%[^\r\n\t]", arg) > 0)
+		gen_ftp_fullpath_from(client, arg, path, sizeof(path));
+	else
+		snprintf(path, sizeof(path), "%s", client->cur_path);
+
+	/* "/" is the list of devices and has nothing to stat */
+	memset(&stat, 0, sizeof(stat));
+	if (strcmp(path, "/") == 0) {
+		dir = 1;
+	} else if (get_vita_path(path) != NULL && sceIoGetstat(get_vita_path(path), &stat) >= 0) {
+		dir = SCE_STM_ISDIR(stat.st_mode);
+	} else {
+		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPVITA_EOL);
+		return;
+	}
+
+	snprintf(msg, sizeof(msg), "250-Listing %s" FTPVITA_EOL, path);
+	client_send_ctrl_msg(client, msg);
+	msg[0] = ' ';
+	gen_mlsd_format(msg + 1, sizeof(msg) - 1, dir, &stat, "", path);
+	client_send_ctrl_msg(client, msg);
+	client_send_ctrl_msg(client, "250 End" FTPVITA_EOL);
+}
+
+/* Name-only listing, optionally filtered by a glob pattern */
+static void send_NLST(ftpvita_client_info_t *client, const char *path, const char *pattern)
+{
+	list_batch batch;
+	prefetch_list plist = {NULL, 0};
+	SceIoDirent dirent;
+	SceUID dir = -1;
+	int i;
+
+	if (strcmp(path, "/") != 0) {
+		dir = sceIoDopen(get_vita_path(path));
+		if (dir < 0) {
+			client_send_ctrl_msg(client, "550 Invalid directory." FTPVITA_EOL);
+			return;
+		}
+	}
+
+	if (list_batch_init(&batch, client) < 0) {
+		if (dir >= 0)
+			sceIoDclose(dir);
+		client_send_ctrl_msg(client, "451 Could not allocate memory." FTPVITA_EOL);
+		return;
+	}
+
+	client_send_ctrl_msg(client, "150 Opening ASCII mode data transfer for NLST." FTPVITA_EOL);
+
+	sched_xfer_begin(client, FTP_XFER_INTERACTIVE);
+	client_open_data_connection(client);
+
+	if (dir < 0) {
+		for (i = 0; i < MAX_DEVICES; i++) {
+			if (device_list[i].valid && (!pattern || glob_match(pattern, device_list[i].name)))
+				list_batch_add_line(&batch, device_list[i].name);
+		}
+	} else {
+		while (sceIoDread(dir, &dirent) > 0) {
+			if (!pattern || glob_match(pattern, dirent.d_name)) {
+				list_batch_add_line(&batch, dirent.d_name);
+				if (!SCE_STM_ISDIR(dirent.d_stat.st_mode))
+					prefetch_list_add(&plist, path, dirent.d_name);
+			}
+		}
+
+		sceIoDclose(dir);
+	}
+
+	list_batch_free(&batch);
+	prefetch_list_set(client, &plist);
+
+	DEBUG("Done sending NLST\n");
+
+	sched_xfer_end(client);
+	client_send_data_eof(client);
+	client_close_data_connection(client);
+	client_send_transfer_complete(client);
+}
+
+static void cmd_NLST_func(ftpvita_client_info_t *client)
+{
+	char arg[FTPVITA_PATH_MAX];
+	char path[FTPVITA_PATH_MAX];
+	char pattern[256];
+	const char *args = client->recv_cmd_args;
+	char *name;
+	SceUID dir;
+
+	/* Options like "-a" that some clients send are ignored */
+	parse_list_options(&args);
+
+	if (sscanf(args, "%[^\r\n\t]", arg) < 1) {
+		send_NLST(client, client->cur_path, NULL);
+		return;
+	}
+
+	gen_ftp_fullpath_from(client, arg, path, sizeof(path));
+	path_normalize(path);
+
+	/* A directory is listed as is, otherwise the last component is a
+	 * pattern (or a plain name) matched in its parent */
+	name = strrchr(path, '/');
+	if (!strpbrk(name, "*?")) {
+		if (strcmp(path, "/") == 0) {
+			send_NLST(client, path, NULL);
+			return;
+		}
+		if ((dir = sceIoDopen(get_vita_path(path))) >= 0) {
+			sceIoDclose(dir);
+			send_NLST(client, path, NULL);
+			return;
+		}
+	}
+
+	snprintf(pattern, sizeof(pattern), "%s", name + 1);
+	if (name == path)
+		name[1] = '\0';
+	else
+		name[0] = '\0';
+
+	send_NLST(client, path, pattern);
+}
+
+static void cmd_PWD_func(ftpvita_client_info_t *client)
+{
+	char msg[FTPVITA_PATH_MAX + 64];
+	snprintf(msg, sizeof(msg), "257 \"%s\" is the current directory." FTPVITA_EOL, client->cur_path);
+	client_send_ctrl_msg(client, msg);
+}
+
+static int path_is_at_root(const char *path)
+{
+	return strrchr(path, '/') == (path + strlen(path) - 1);
+}
+
+static void dir_up(char *path)
+{
+	char *pch;
+	size_t len_in = strlen(path);
+	if (len_in == 1) {
+		strcpy(path, "/");
+		return;
+	}
+	if (path_is_at_root(path)) { /* Case root of the device (/foo0:/) */
+		strcpy(path, "/");
+	} else {
+		pch = strrchr(path, '/');
+		size_t s = len_in - (pch - path);
+		memset(pch, '\0', s);
+		/* If the path is like: /foo: add slash */
+		if (strrchr(path, '/') == path)
+			strcat(path, "/");
+	}
+}
+
+static void cmd_CWD_func(ftpvita_client_info_t *client)
+{
+	char cmd_path[FTPVITA_PATH_MAX];
+	char tmp_path[FTPVITA_PATH_MAX];
+	SceUID pd;
+	SceUInt64 trace_start;
+	int n = sscanf(client->recv_cmd_args, "%[^\r\n\t]", cmd_path);
+
+	if (n < 1) {
+		client_send_ctrl_msg(client, "500 Syntax error, command unrecognized." FTPVITA_EOL);
+	} else {
+		if (strcmp(cmd_path, "/") == 0) {
+			session_set_cur_path(client, cmd_path);
+		} else  if (strcmp(cmd_path, "..") == 0) {
+			dir_up(client->cur_path);
+		} else {
+			if (cmd_path[0] == '/') { /* Full path */
+				strcpy(tmp_path, cmd_path);
+			} else { /* Change dir relative to current dir */
+				/* If we are at the root of the device, don't add
+				 * an slash to add new path */
+				if (path_is_at_root(client->cur_path))
+					snprintf(tmp_path, sizeof(tmp_path), "%s%s", client->cur_path, cmd_path);
+				else
+					snprintf(tmp_path, sizeof(tmp_path), "%s/%s", client->cur_path, cmd_path);
+			}
+
+			/* If the path is like: /foo: add an slash */
+			if (strrchr(tmp_path, '/') == tmp_path && strlen(tmp_path) + 1 < sizeof(tmp_path))
+				strcat(tmp_path, "/");
+
+			/* If the path is not "/", check if it exists */
+			if (strcmp(tmp_path, "/") != 0) {
+				/* Check if the path exists */
+				trace_start = trace_begin();
+				pd = sceIoDopen(get_vita_path(tmp_path));
+				trace_end(TRACE_FS, "dopen", client, trace_start);
+				if (pd < 0) {
+					client_send_ctrl_msg(client, "550 Invalid directory." FTPVITA_EOL);
+					return;
+				}
+				sceIoDclose(pd);
+			}
+			if (session_set_cur_path(client, tmp_path) < 0) {
+				client_send_ctrl_msg(client, "550 Path too long." FTPVITA_EOL);
+				return;
+			}
+		}
+		client_send_ctrl_msg(client, "250 Requested file action okay, completed." FTPVITA_EOL);
+	}
+}
+
+static void cmd_TYPE_func(ftpvita_client_info_t *client)
+{
+	char data_type;
+	char format_control[8];
+	int n_args = sscanf(client->recv_cmd_args, "%c %s", &data_type, format_control);
+
+	if (n_args > 0) {
+		switch(data_type) {
+		case 'A':
+		case 'I':
+			client_send_ctrl_msg(client, "200 Okay" FTPVITA_EOL);
+			break;
+		case 'E':
+		case 'L':
+		default:
+			client_send_ctrl_msg(client, "504 Error: bad parameters?" FTPVITA_EOL);
+			break;
+		}
+	} else {
+		client_send_ctrl_msg(client, "504 Error: bad parameters?" FTPVITA_EOL);
+	}
+}
+
+static void cmd_MODE_func(ftpvita_client_info_t *client)
+{
+	char mode;
+
+	if (sscanf(client->recv_cmd_args, "%c", &mode) < 1) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters." FTPVITA_EOL);
+		return;
+	}
+
+	switch (mode) {
+	case 'S':
+	case 's':
+		/* Stream mode signals EOF by closing the connection */
+		if (client->data_open)
+			client_release_data(client);
+		client->transfer_mode = FTP_TRANSFER_MODE_STREAM;
+		client_send_ctrl_msg(client, "200 Mode set to S." FTPVITA_EOL);
+		break;
+	case 'B':
+	case 'b':
+		client->transfer_mode = FTP_TRANSFER_MODE_BLOCK;
+		client_send_ctrl_msg(client, "200 Mode set to B." FTPVITA_EOL);
+		break;
+	default:
+		client_send_ctrl_msg(client, "504 Mode not supported." FTPVITA_EOL);
+		break;
+	}
+}
+
+static void cmd_CDUP_func(ftpvita_client_info_t *client)
+{
+	dir_up(client->cur_path);
+	client_send_ctrl_msg(client, "200 Command okay." FTPVITA_EOL);
+}
+
+/* Reports the end of a file transfer to the application */
+static void xfer_event(ftpvita_client_info_t *client, ftpvita_xfer_event_t event, const char *path)
+{
+	static const char *event_fmt[FTPVITA_XFER_EVENTS] = {
+		"Send completed: %s", "Receive completed: %s", "Receive aborted: %s"
+	};
+	const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+	if (xfer_cb)
+		xfer_cb(event, name, client->xfer_bytes, sceKernelGetProcessTimeWide() - client->xfer_start);
+	else
+		NOTIFICATION(event_fmt[event], name);
+}
+
+typedef int (*xfer_send_func)(ftpvita_client_info_t *client, const void *buf, unsigned int len);
+
+/* File read loop shared by RETR and the HTTP frontend: sends length
+ * bytes from the current position of fd, or up to the end of the file
+ * if length is < 0. The transfer has been started with
+ * sched_xfer_begin() and the buffer may be replaced on a setting change.
+ * Returns 0 once everything was sent. */
+static int send_file_data(ftpvita_client_info_t *client, SceUID fd, SceOff length,
+	unsigned char **buffer, unsigned int *op_buf_size, xfer_send_func send)
+{
+	unsigned int generation = config_generation;
+	unsigned int chunk;
+	int bytes_read;
+	int ret = 0;
+	SceUInt64 trace_start = trace_begin();
+
+	while (length != 0) {
+		sched_wait(client);
+		*buffer = xfer_buf_refresh(client, *buffer, op_buf_size, length < 0 ? 0 : length, &generation);
+
+		chunk = *op_buf_size;
+		if (length > 0 && length < chunk)
+			chunk = length;
+
+		if ((bytes_read = sceIoRead(fd, *buffer, chunk)) <= 0) {
+			ret = length < 0 ? 0 : -1;
+			break;
+		}
+		if (send(client, *buffer, bytes_read) < 0) {
+			ret = -1;
+			break;
+		}
+		sched_account(client, bytes_read);
+
+		if (length > 0)
+			length -= bytes_read;
+	}
+
+	trace_end(TRACE_XFER, "send", client, trace_start);
+	return ret;
+}
+
+static void send_file(ftpvita_client_info_t *client, const char *path)
+{
+	char key[FTPVITA_PATH_MAX];
+	unsigned char *buffer;
+	SceUID fd;
+	SceIoStat stat;
+	SceOff remaining = 0;
+	unsigned int op_buf_size;
+	TransferClass xfer_class = FTP_XFER_BULK;
+	SceUInt64 trace_start;
+	prefetch_head head = {NULL, 0, 0};
+
+	DEBUG("Opening: %s\n", path);
+
+	snprintf(key, sizeof(key), "%s", path);
+	path_normalize(key);
+
+	/* A prefetched file is already open and its head read */
+	if ((fd = prefetch_take(client, key, &head)) < 0) {
+		trace_start = trace_begin();
+		fd = sceIoOpen(path, SCE_O_RDONLY, 0777);
+		trace_end(TRACE_FS, "open", client, trace_start);
+	}
+
+	if (fd >= 0) {
+
+		/* Small files are served ahead of bulk streams */
+		if (head.buf || sceIoGetstat(path, &stat) >= 0) {
+			remaining = (head.buf ? head.file_size : stat.st_size) - client->restore_point;
+			if (remaining <= interactive_xfer_size)
+				xfer_class = FTP_XFER_INTERACTIVE;
+		}
+
+		if (!head.buf)
+			sceIoLseek(fd, client->restore_point, SCE_SEEK_SET);
+
+		/* The next file of the listing is read while this one is sent */
+		prefetch_next(client, key);
+
+		if (device_io_acquire(client, path, 1) < 0) {
+			client_send_xfer_dequeued(client);
+			prefetch_head_free(&head);
+			sceIoClose(fd);
+			return;
+		}
+
+		sched_xfer_begin(client, xfer_class);
+		op_buf_size = sched_buf_size(client, remaining);
+
+		buffer = xfer_buf_alloc(op_buf_size);
+		if (buffer == NULL) {
+			client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
+			prefetch_head_free(&head);
+			sched_xfer_end(client);
+			device_io_release(client);
+			sceIoClose(fd);
+			return;
+		}
+
+		client_open_data_connection(client);
+		client_send_ctrl_msg(client, "150 Opening Image mode data transfer." FTPVITA_EOL);
+
+		if (head.buf) {
+			sched_wait(client);
+			if (client_send_data_raw(client, head.buf, head.len) >= 0)
+				sched_account(client, head.len);
+			prefetch_head_free(&head);
+		}
+
+		if (!client->data_error)
+			send_file_data(client, fd, -1, &buffer, &op_buf_size, client_send_data_raw);
+
+		sceIoClose(fd);
+		xfer_buf_free(buffer, op_buf_size);
+		sched_xfer_end(client);
+		device_io_release(client);
+		client->restore_point = 0;
+		xfer_event(client, client->data_error ? FTPVITA_XFER_ABORTED : FTPVITA_XFER_SENT, path);
+		client_send_data_eof(client);
+		client_close_data_connection(client);
+		client_send_transfer_complete(client);
+
+	} else {
+		client_send_ctrl_msg(client, "550 File not found." FTPVITA_EOL);
+	}
+}
+
+/* This function generates an FTP full-path with the input path (relative or absolute)
+ * from RETR, STOR, DELE, RMD, MKD, RNFR and RNTO commands */
+static void gen_ftp_fullpath_from(ftpvita_client_info_t *client, const char *cmd_path, char *path, size_t path_size)
+{
+	if (cmd_path[0] == '/') {
+		/* Full path */
+		strncpy(path, cmd_path, path_size);
+	} else {
+		if (strlen(cmd_path) >= 5 && cmd_path[3] == ':' && cmd_path[4] == '/') {
+			/* Case "ux0:/foo */
+			snprintf(path, path_size, "/%s", cmd_path);
+		} else {
+			/* The file is relative to current dir, so
+			 * append the file to the current path */
+			snprintf(path, path_size, "%s/%s", client->cur_path, cmd_path);
+		}
+	}
+}
+
+static void gen_ftp_fullpath(ftpvita_client_info_t *client, char *path, size_t path_size)
+{
+	char cmd_path[FTPVITA_PATH_MAX];
+	sscanf(client->recv_cmd_args, "%[^\r\n\t]", cmd_path);
+	gen_ftp_fullpath_from(client, cmd_path, path, path_size);
+}
+
+static void cmd_RETR_func(ftpvita_client_info_t *client)
+{
+	char dest_path[FTPVITA_PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	send_file(client, get_vita_path(dest_path));
+}
+
+/* Restarted uploads (REST + STOR, APPE) write over the existing file from
+ * the restart offset, APPE continues a journaled partial upload from its
+ * last synced offset */
+static void receive_file(ftpvita_client_info_t *client, const char *path)
+{
+	char key[FTPVITA_PATH_MAX];
+	char msg[96];
+	unsigned char *buffer;
+	SceUID fd;
+	SceIoStat stat;
+	SceOff start = 0;
+	SceOff position;
+	SceOff checkpoint;
+	SceOff journaled;
+	SceUInt64 trace_start;
+	int bytes_recv;
+	unsigned int op_buf_size;
+	unsigned int generation = config_generation;
+
+	DEBUG("Opening: %s\n", path);
+
+	snprintf(key, sizeof(key), "%s", path);
+	path_normalize(key);
+
+	int mode = SCE_O_CREAT | SCE_O_RDWR;
+	/* if we resume broken - keep what is there
+	 * else - overwrite file */
+	if (client->restore_point == 0)
+		mode = mode | SCE_O_TRUNC;
+
+	trace_start = trace_begin();
+	fd = sceIoOpen(path, mode, 0777);
+	trace_end(TRACE_FS, "open", client, trace_start);
+
+	if (fd >= 0) {
+
+		if (device_io_acquire(client, path, 1) < 0) {
+			client_send_xfer_dequeued(client);
+			sceIoClose(fd);
+			client->restore_point = 0;
+			return;
+		}
+
+		/* Upload sizes are unknown, treat them as bulk */
+		sched_xfer_begin(client, FTP_XFER_BULK);
+		op_buf_size = sched_buf_size(client, 0);
+
+		buffer = xfer_buf_alloc(op_buf_size);
+		if (buffer == NULL) {
+			client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
+			sched_xfer_end(client);
+			device_io_release(client);
+			sceIoClose(fd);
+			client->restore_point = 0;
+			return;
+		}
+
+		if (client->restore_point != 0) {
+			journaled = journal_offset(key, fd, buffer, op_buf_size);
+			if (sceIoGetstatByFd(fd, &stat) < 0)
+				stat.st_size = 0;
+
+			if (client->restore_point < 0)
+				start = journaled >= 0 ? journaled : stat.st_size;
+			else
+				start = client->restore_point;
+
+			if (start > stat.st_size) {
+				client_send_ctrl_msg(client, "554 Restart offset is past the end of the file." FTPVITA_EOL);
+				xfer_buf_free(buffer, op_buf_size);
+				sched_xfer_end(client);
+				device_io_release(client);
+				sceIoClose(fd);
+				client->restore_point = 0;
+				return;
+			}
+
+			sceIoLseek(fd, start, SCE_SEEK_SET);
+		}
+
+		/* Restarts are journaled right away, the application may be
+		 * killed at any point. New uploads wait for their first
+		 * checkpoint, small files never reach one */
+		if (start > 0)
+			journal_checkpoint(key, fd, start, buffer, op_buf_size);
+		position = checkpoint = start;
+
+		client_open_data_connection(client);
+		client_send_ctrl_msg(client, "150 Opening Image mode data transfer." FTPVITA_EOL);
+
+		trace_start = trace_begin();
+		while (1) {
+			sched_wait(client);
+			buffer = xfer_buf_refresh(client, buffer, &op_buf_size, 0, &generation);
+			if ((bytes_recv = client_recv_data_raw(client, buffer, op_buf_size)) <= 0)
+				break;
+			if (sceIoWrite(fd, buffer, bytes_recv) != bytes_recv) {
+				bytes_recv = -1;
+				break;
+			}
+			position += bytes_recv;
+			sched_account(client, bytes_recv);
+
+			if (position - checkpoint >= JOURNAL_CHECKPOINT_SIZE) {
+				journal_checkpoint(key, fd, position, buffer, op_buf_size);
+				checkpoint = position;
+			}
+		}
+		trace_end(TRACE_XFER, "recv", client, trace_start);
+
+		if (bytes_recv == 0) {
+			/* A restarted upload may end before the old data did */
+			if (client->restore_point != 0 && sceIoGetstatByFd(fd, &stat) >= 0 && stat.st_size > position) {
+				stat.st_size = position;
+				sceIoChstatByFd(fd, &stat, SCE_CST_SIZE);
+			}
+			journal_forget(key);
+		} else {
+			journal_checkpoint(key, fd, position, buffer, op_buf_size);
+		}
+
+		sceIoClose(fd);
+		xfer_buf_free(buffer, op_buf_size);
+		sched_xfer_end(client);
+		device_io_release(client);
+		client->restore_point = 0;
+		client_close_data_connection(client);
+		path_changed(path);
+		if (bytes_recv == 0) {
+			xfer_event(client, FTPVITA_XFER_RECEIVED, path);
+			client_send_transfer_complete(client);
+		} else {
+			xfer_event(client, FTPVITA_XFER_ABORTED, path);
+			snprintf(msg, sizeof(msg), "426 Connection closed; transfer aborted, %lld bytes kept." FTPVITA_EOL, position);
+			client_send_ctrl_msg(client, msg);
+		}
+
+	} else {
+		client->restore_point = 0;
+		client_send_ctrl_msg(client, "550 File not found." FTPVITA_EOL);
+	}
+}
+
+static void cmd_STOR_func(ftpvita_client_info_t *client)
+{
+	char dest_path[FTPVITA_PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	receive_file(client, get_vita_path(dest_path));
+}
+
+static void delete_file(ftpvita_client_info_t *client, const char *path)
+{
+	DEBUG("Deleting: %s\n", path);
+
+	if (sceIoRemove(path) >= 0) {
+		path_changed(path);
+		client_send_ctrl_msg(client, "226 File deleted." FTPVITA_EOL);
+	} else {
+		client_send_ctrl_msg(client, "550 Could not delete the file." FTPVITA_EOL);
+	}
+}
+
+static void cmd_DELE_func(ftpvita_client_info_t *client)
+{
+	char dest_path[FTPVITA_PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	delete_file(client, get_vita_path(dest_path));
+}
+
+static void delete_dir(ftpvita_client_info_t *client, const char *path)
+{
+	int ret;
+	DEBUG("Deleting: %s\n", path);
+	ret = sceIoRmdir(path);
+	if (ret >= 0) {
+		path_changed(path);
+		client_send_ctrl_msg(client, "226 Directory deleted." FTPVITA_EOL);
+	} else if (ret == 0x8001005A) { /* DIRECTORY_IS_NOT_EMPTY */
+		client_send_ctrl_msg(client, "550 Directory is not empty." FTPVITA_EOL);
+	} else {
+		client_send_ctrl_msg(client, "550 Could not delete the directory." FTPVITA_EOL);
+	}
+}
+
+static void cmd_RMD_func(ftpvita_client_info_t *client)
+{
+	char dest_path[FTPVITA_PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	delete_dir(client, get_vita_path(dest_path));
+}
+
+static void create_dir(ftpvita_client_info_t *client, const char *path)
+{
+	DEBUG("Creating: %s\n", path);
+
+	if (sceIoMkdir(path, 0777) >= 0) {
+		path_changed(path);
+		client_send_ctrl_msg(client, "226 Directory created." FTPVITA_EOL);
+	} else {
+		client_send_ctrl_msg(client, "550 Could not create the directory." FTPVITA_EOL);
+	}
+}
+
+static void cmd_MKD_func(ftpvita_client_info_t *client)
+{
+	char dest_path[FTPVITA_PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	create_dir(client, get_vita_path(dest_path));
+}
+
+static void cmd_RNFR_func(ftpvita_client_info_t *client)
+{
+	char path_src[FTPVITA_PATH_MAX];
+	const char *vita_path_src;
+	/* Get the origin filename */
+	gen_ftp_fullpath(client, path_src, sizeof(path_src));
+	vita_path_src = get_vita_path(path_src);
+
+	/* Check if the file exists */
+	if (!file_exists(vita_path_src)) {
+		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPVITA_EOL);
+		return;
+	}
+	/* The file to be renamed is the received path */
+	if (session_set_rename_path(client, vita_path_src) < 0) {
+		client_send_ctrl_msg(client, "550 Path too long." FTPVITA_EOL);
+		return;
+	}
+	client_send_ctrl_msg(client, "350 I need the destination name b0ss." FTPVITA_EOL);
+}
+
+static void cmd_RNTO_func(ftpvita_client_info_t *client)
+{
+	char path_dst[FTPVITA_PATH_MAX];
+	const char *vita_path_dst;
+	/* Get the destination filename */
+	gen_ftp_fullpath(client, path_dst,sizeof(path_dst));
+	vita_path_dst = get_vita_path(path_dst);
+
+	DEBUG("Renaming: %s to %s\n", client->rename_path, vita_path_dst);
+
+	if (sceIoRename(client->rename_path, vita_path_dst) < 0) {
+		client_send_ctrl_msg(client, "550 Error renaming the file." FTPVITA_EOL);
+		return;
+	}
+
+	path_renamed(client->rename_path, vita_path_dst);
+	path_changed(client->rename_path);
+	path_changed(vita_path_dst);
+
+	client_send_ctrl_msg(client, "226 Rename completed." FTPVITA_EOL);
+}
+
+/* Stats a file for SIZE and SITE MSTAT. Partial uploads report the
+ * part that is safe to resume from */
+static int stat_resumable(const char *vita_path, SceIoStat *stat)
+{
+	char key[FTPVITA_PATH_MAX];
+	SceOff offset;
+
+	if (vita_path == NULL || sceIoGetstat(vita_path, stat) < 0)
+		return -1;
+
+	snprintf(key, sizeof(key), "%s", vita_path);
+	path_normalize(key);
+	if ((offset = journal_offset(key, -1, NULL, 0)) >= 0)
+		stat->st_size = offset;
+
+	return 0;
+}
+
+/* YYYYMMDDHHMMSS as used by MDTM, MFMT and MLSD. Stat times are
+ * already UTC */
+static void gen_mtime_format(char *out, int n, const SceDateTime *time)
+{
+	snprintf(out, n, "%04d%02d%02d%02d%02d%02d",
+		time->year, time->month, time->day,
+		time->hour, time->minute, time->second);
+}
+
+static int parse_mtime(const char *str, SceDateTime *time)
+{
+	unsigned short year, month, day, hour, minute, second;
+	int n = 0;
+
+	if (sscanf(str, "%4hu%2hu%2hu%2hu%2hu%2hu%n",
+		&year, &month, &day, &hour, &minute, &second, &n) != 6 || n != 14)
+		return -1;
+
+	/* Fractions of a second are accepted but not kept, anything else
+	 * has to end the timestamp */
+	if (str[n] == '.') {
+		n++;
+		if (str[n] < '0' || str[n] > '9')
+			return -1;
+		while (str[n] >= '0' && str[n] <= '9')
+			n++;
+	}
+	if (str[n] != '\0' && str[n] != ' ')
+		return -1;
+
+	if (month < 1 || month > 12 || day < 1 || day > 31 ||
+		hour > 23 || minute > 59 || second > 60)
+		return -1;
+
+	memset(time, 0, sizeof(*time));
+	time->year = year;
+	time->month = month;
+	time->day = day;
+	time->hour = hour;
+	time->minute = minute;
+	time->second = second > 59 ? 59 : second;
+
+	return 0;
+}
+
+static void cmd_SIZE_func(ftpvita_client_info_t *client)
+{
+	SceIoStat stat;
+	char path[FTPVITA_PATH_MAX];
+	char cmd[64];
+	/* Get the filename to retrieve its size */
+	gen_ftp_fullpath(client, path, sizeof(path));
+
+	/* Check if the file exists */
+	if (stat_resumable(get_vita_path(path), &stat) < 0) {
+		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPVITA_EOL);
+		return;
+	}
+
+	/* Send the size of the file */
+	sprintf(cmd, "213 %lld" FTPVITA_EOL, stat.st_size);
+	client_send_ctrl_msg(client, cmd);
+}
+
+static void cmd_MDTM_func(ftpvita_client_info_t *client)
+{
+	SceIoStat stat;
+	char path[FTPVITA_PATH_MAX];
+	char mtime[16];
+	char cmd[64];
+
+	gen_ftp_fullpath(client, path, sizeof(path));
+
+	if (get_vita_path(path) == NULL || sceIoGetstat(get_vita_path(path), &stat) < 0) {
+		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPVITA_EOL);
+		return;
+	}
+
+	gen_mtime_format(mtime, sizeof(mtime), &stat.st_mtime);
+	snprintf(cmd, sizeof(cmd), "213 %s" FTPVITA_EOL, mtime);
+	client_send_ctrl_msg(client, cmd);
+}
+
+/* MFMT <YYYYMMDDHHMMSS> <path> */
+static void cmd_MFMT_func(ftpvita_client_info_t *client)
+{
+	SceIoStat stat;
+	char arg[FTPVITA_PATH_MAX];
+	char path[FTPVITA_PATH_MAX];
+	char mtime[16];
+	char msg[FTPVITA_PATH_MAX + 64];
+	int n = 0;
+
+	if (sscanf(client->recv_cmd_args, "%*s %n", &n) < 0 || n == 0 ||
+		sscanf(client->recv_cmd_args + n, "%[^\r\n\t]", arg) < 1 ||
+		parse_mtime(client->recv_cmd_args, &stat.st_mtime) < 0) {
+		client_send_ctrl_msg(client, "501 Usage: MFMT <YYYYMMDDHHMMSS> <path>" FTPVITA_EOL);
+		return;
+	}
+
+	gen_ftp_fullpath_from(client, arg, path, sizeof(path));
+	if (get_vita_path(path) == NULL || !file_exists(get_vita_path(path))) {
+		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPVITA_EOL);
+		return;
+	}
+
+	if (sceIoChstat(get_vita_path(path), &stat, SCE_CST_MT) < 0) {
+		client_send_ctrl_msg(client, "550 Could not set the modification time." FTPVITA_EOL);
+		return;
+	}
+
+	gen_mtime_format(mtime, sizeof(mtime), &stat.st_mtime);
+	snprintf(msg, sizeof(msg), "213 Modify=%s; %s" FTPVITA_EOL, mtime, arg);
+	client_send_ctrl_msg(client, msg);
+}
+
+static void cmd_REST_func(ftpvita_client_info_t *client)
+{
+	char cmd[64];
+	long long offset;
+
+	if (sscanf(client->recv_buffer, "%*[^ ] %lld", &offset) != 1 || offset < 0) {
+		client_send_ctrl_msg(client, "501 Invalid restart offset." FTPVITA_EOL);
+		return;
+	}
+
+	client->restore_point = offset;
+	sprintf(cmd, "350 Resuming at %lld" FTPVITA_EOL, offset);
+	client_send_ctrl_msg(client, cmd);
+}
+
+/* Transfers watch the control connection for ABOR, see client_ctrl_poll().
+ * The ABOR line is read here once the aborted transfer has replied 426 */
+static void cmd_ABOR_func(ftpvita_client_info_t *client)
+{
+	if (client->xfer_aborted) {
+		client->xfer_aborted = 0;
+		client_send_ctrl_msg(client, "226 Abort successful." FTPVITA_EOL);
+	} else {
+		client_send_ctrl_msg(client, "225 No transfer to abort." FTPVITA_EOL);
+	}
+}
+
+/* STAT during a transfer is answered by client_ctrl_poll() */
+static void cmd_STAT_func(ftpvita_client_info_t *client)
+{
+	static const char *con_names[] = {"none", "active", "passive"};
+	char remote_ip[16];
+	char msg[FTPVITA_PATH_MAX + 64];
+
+	if (client->recv_cmd_args != client->recv_buffer && client->recv_cmd_args[0] != '\r' &&
+		client->recv_cmd_args[0] != '\n' && client->recv_cmd_args[0] != '\0') {
+		client_send_ctrl_msg(client, "504 STAT with a path is not supported, use SITE MSTAT." FTPVITA_EOL);
+		return;
+	}
+
+	sceNetInetNtop(SCE_NET_AF_INET, &client->addr.sin_addr.s_addr, remote_ip, sizeof(remote_ip));
+
+	client_send_ctrl_msg(client, "211-FTPVita status:" FTPVITA_EOL);
+	snprintf(msg, sizeof(msg), " Session %i, connected from %s" FTPVITA_EOL, client->num, remote_ip);
+	client_send_ctrl_msg(client, msg);
+	snprintf(msg, sizeof(msg), " TYPE I, MODE %c, data connection: %s%s" FTPVITA_EOL,
+		client->transfer_mode == FTP_TRANSFER_MODE_BLOCK ? 'B' : 'S',
+		con_names[client->data_con_type], client->data_open ? " (open)" : "");
+	client_send_ctrl_msg(client, msg);
+	snprintf(msg, sizeof(msg), " Current directory: %s" FTPVITA_EOL, client->cur_path);
+	client_send_ctrl_msg(client, msg);
+	snprintf(msg, sizeof(msg), " Last transfer: %lld bytes" FTPVITA_EOL, client->xfer_bytes);
+	client_send_ctrl_msg(client, msg);
+	client_send_ctrl_msg(client, "211 End of status" FTPVITA_EOL);
+}
+
+static void cmd_FEAT_func(ftpvita_client_info_t *client)
+{
+	/*So client would know that we support resume */
+	client_send_ctrl_msg(client, "211-extensions" FTPVITA_EOL);
+	client_send_ctrl_msg(client, " EPSV" FTPVITA_EOL);
+	client_send_ctrl_msg(client, " MDTM" FTPVITA_EOL);
+	client_send_ctrl_msg(client, " MFMT" FTPVITA_EOL);
+	client_send_ctrl_msg(client, " MLST type*;size*;modify*;" FTPVITA_EOL);
+	client_send_ctrl_msg(client, " MODE B" FTPVITA_EOL);
+	client_send_ctrl_msg(client, " REST STREAM" FTPVITA_EOL);
+	client_send_ctrl_msg(client, " UTF8" FTPVITA_EOL);
+	client_send_ctrl_msg(client, "211 end" FTPVITA_EOL);
+}
+
+static void cmd_OPTS_func(ftpvita_client_info_t *client)
+{
+	client_send_ctrl_msg(client, "501 bad OPTS" FTPVITA_EOL);
+}
+
+static void cmd_APPE_func(ftpvita_client_info_t *client)
+{
+	/* A negative restore point appends at the end of the file,
+	or at the journaled offset of a partial upload */
+	client->restore_point = -1;
+	char dest_path[FTPVITA_PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	receive_file(client, get_vita_path(dest_path));
+}
+
+static void du_totals_add(du_totals *dst, const du_totals *src)
+{
+	dst->bytes += src->bytes;
+	dst->files += src->files;
+	dst->dirs += src->dirs;
+}
+
+static void du_send_progress(ftpvita_client_info_t *client, const du_totals *totals, const char *path)
+{
+	char msg[FTPVITA_PATH_MAX + 96];
+
+	snprintf(msg, sizeof(msg), "213-%lld bytes, %u files, %u directories so far (%s)" FTPVITA_EOL,
+		totals->bytes, totals->files, totals->dirs, path);
+	client_send_ctrl_msg(client, msg);
+}
+
+/* Reads a whole directory into frame: files are added to its totals,
+ * subdirectory names are pushed on the name stack. The directory is
+ * closed before the walk descends, so only one is open at a time.
+ * Returns < 0 if it could not be opened */
+static int du_read_dir(const char *path, du_frame *frame, du_names *names, int *skipped)
+{
+	SceIoDirent dirent;
+	SceUID dir;
+	unsigned int len;
+	char *grown;
+
+	if ((dir = sceIoDopen(path)) < 0)
+		return -1;
+
+	frame->names_start = frame->next = names->len;
+	memset(&dirent, 0, sizeof(dirent));
+	while (sceIoDread(dir, &dirent) > 0) {
+		if (!SCE_STM_ISDIR(dirent.d_stat.st_mode)) {
+			frame->totals.files++;
+			frame->totals.bytes += dirent.d_stat.st_size;
+		} else {
+			frame->totals.dirs++;
+			len = strlen(dirent.d_name) + 1;
+			if (names->len + len > names->size) {
+				if ((grown = realloc(names->buf, names->size * 2 + len)) == NULL) {
+					(*skipped)++;
+					frame->partial = 1;
+					memset(&dirent, 0, sizeof(dirent));
+					continue;
+				}
+				names->buf = grown;
+				names->size = names->size * 2 + len;
+			}
+			memcpy(names->buf + names->len, dirent.d_name, len);
+			names->len += len;
+		}
+		memset(&dirent, 0, sizeof(dirent));
+	}
+	sceIoDclose(dir);
+
+	frame->names_end = names->len;
+	return 0;
+}
+
+/* Adds the totals of the tree at root to result. The walk keeps a heap
+ * stack of directories instead of recursing on the small client stack,
+ * and sends a partial result every DU_PROGRESS_INTERVAL. Totals of
+ * trees with unreadable directories are not cached. Returns the number
+ * of directories that could not be read, or -1 if root itself could not
+ * be opened. */
+static int du_walk(ftpvita_client_info_t *client, const char *root, du_totals *result, SceUInt64 *progress_stamp)
+{
+	du_frame *stack;
+	du_frame *frame;
+	du_names names;
+	char *path;
+	const char *name;
+	du_totals sub, running;
+	SceUInt64 now;
+	unsigned int generation;
+	unsigned int len;
+	int depth = 0;
+	int skipped = 0;
+	int i;
+
+	path = malloc(FTPVITA_PATH_MAX);
+	if (path == NULL)
+		return -1;
+	snprintf(path, FTPVITA_PATH_MAX, "%s", root);
+	path_normalize(path);
+
+	if (du_cache_lookup(path, &sub)) {
+		du_totals_add(result, &sub);
+		free(path);
+		return 0;
+	}
+
+	generation = du_cache_generation;
+	names.len = 0;
+	names.size = 4 * 1024;
+	names.buf = malloc(names.size);
+	stack = malloc(DU_MAX_DEPTH * sizeof(du_frame));
+	if (stack != NULL)
+		memset(&stack[0], 0, sizeof(du_frame));
+	if (names.buf == NULL || stack == NULL || du_read_dir(path, &stack[0], &names, &skipped) < 0) {
+		free(names.buf);
+		free(stack);
+		free(path);
+		return -1;
+	}
+	stack[0].path_len = strlen(path);
+
+	while (depth >= 0) {
+		frame = &stack[depth];
+
+		if (frame->next < frame->names_end) {
+			name = names.buf + frame->next;
+			frame->next += strlen(name) + 1;
+			len = frame->path_len + snprintf(path + frame->path_len,
+				FTPVITA_PATH_MAX - frame->path_len, "/%s", name);
+
+			if (len >= FTPVITA_PATH_MAX || depth + 1 >= DU_MAX_DEPTH) {
+				skipped++;
+				frame->partial = 1;
+			} else if (du_cache_lookup(path, &sub)) {
+				du_totals_add(&frame->totals, &sub);
+			} else {
+				memset(&stack[depth + 1], 0, sizeof(du_frame));
+				stack[depth + 1].path_len = len;
+				if (du_read_dir(path, &stack[depth + 1], &names, &skipped) < 0) {
+					skipped++;
+					frame->partial = 1;
+				} else {
+					depth++;
+				}
+			}
+			/* The path keeps the name only if the walk descended */
+			if (depth == frame - stack)
+				path[frame->path_len] = '\0';
+		} else {
+			path[frame->path_len] = '\0';
+			names.len = frame->names_start;
+
+			if (!frame->partial &&
+			    (depth == 0 || frame->totals.files + frame->totals.dirs >= DU_CACHE_MIN_ENTRIES))
+				du_cache_store(path, &frame->totals, generation);
+
+			if (depth > 0) {
+				du_totals_add(&stack[depth - 1].totals, &frame->totals);
+				stack[depth - 1].partial |= frame->partial;
+			} else {
+				du_totals_add(result, &frame->totals);
+			}
+			depth--;
+			continue;
+		}
+
+		now = sceKernelGetProcessTimeWide();
+		if (now - *progress_stamp >= DU_PROGRESS_INTERVAL) {
+			running = *result;
+			for (i = 0; i <= depth; i++)
+				du_totals_add(&running, &stack[i].totals);
+			du_send_progress(client, &running, path);
+			*progress_stamp = now;
+		}
+	}
+
+	free(names.buf);
+	free(stack);
+	free(path);
+
+	return skipped;
+}
+
+static void cmd_SITE_DU_func(ftpvita_client_info_t *client)
+{
+	char path[FTPVITA_PATH_MAX];
+	char msg[FTPVITA_PATH_MAX + 128];
+	du_totals totals;
+	SceUInt64 progress_stamp = sceKernelGetProcessTimeWide();
+	int skipped = 0;
+	int ret;
+	int i;
+
+	if (client->recv_cmd_args[0] == '\0' || client->recv_cmd_args[0] == '\r')
+		snprintf(path, sizeof(path), "%s", client->cur_path);
+	else
+		gen_ftp_fullpath(client, path, sizeof(path));
+	path_normalize(path);
+
+	memset(&totals, 0, sizeof(totals));
+
+	if (strcmp(path, "/") == 0) {
+		/* The root is the sum of all the devices */
+		for (i = 0; i < MAX_DEVICES; i++) {
+			if (device_list[i].valid) {
+				ret = du_walk(client, device_list[i].name, &totals, &progress_stamp);
+				skipped += ret < 0 ? 1 : ret;
+			}
+		}
+	} else if ((skipped = du_walk(client, get_vita_path(path), &totals, &progress_stamp)) < 0) {
+		client_send_ctrl_msg(client, "550 Invalid directory." FTPVITA_EOL);
+		return;
+	}
+
+	if (skipped) {
+		snprintf(msg, sizeof(msg), "213-%d directories could not be read" FTPVITA_EOL, skipped);
+		client_send_ctrl_msg(client, msg);
+	}
+	snprintf(msg, sizeof(msg), "213 %lld bytes, %u files, %u directories in %s" FTPVITA_EOL,
+		totals.bytes, totals.files, totals.dirs, path);
+	client_send_ctrl_msg(client, msg);
+}
+
+/* Names are matched against the pattern, or full paths if it has a '/' */
+static void cmd_SITE_FIND_func(ftpvita_client_info_t *client)
+{
+	char pattern[256];
+	char path[FTPVITA_PATH_MAX];
+	char msg[128];
+	char *out;
+	unsigned int out_len;
+	unsigned int matches = 0;
+	unsigned int shown = 0;
+	unsigned int node;
+	int full_path;
+	int building = 0;
+	int len;
+	int i;
+	fidx_index *idx;
+
+	if (sscanf(client->recv_cmd_args, "%255[^\r\n]", pattern) < 1) {
+		client_send_ctrl_msg(client, "501 Usage: SITE FIND <pattern>" FTPVITA_EOL);
+		return;
+	}
+
+	if (fidx_max_nodes == 0) {
+		client_send_ctrl_msg(client, "502 Filename index is disabled." FTPVITA_EOL);
+		return;
+	}
+
+	if ((out = malloc(FIND_OUT_SIZE)) == NULL) {
+		client_send_ctrl_msg(client, "451 Could not allocate memory." FTPVITA_EOL);
+		return;
+	}
+
+	full_path = strchr(pattern, '/') != NULL;
+	out_len = snprintf(out, FIND_OUT_SIZE, "200-Matches for %s:" FTPVITA_EOL, pattern);
+	path[0] = '/';
+
+	sceKernelLockMutex(fidx_mtx, 1, NULL);
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if ((idx = fidx_list[i]) == NULL)
+			continue;
+		if (!idx->ready)
+			building = 1;
+
+		for (node = 1; node < idx->count; node++) {
+			if ((idx->nodes[node].flags & FIDX_DELETED) ||
+			    (!full_path && !glob_match(pattern, fidx_name(idx, node))))
+				continue;
+			if ((len = fidx_node_path(idx, node, path + 1, sizeof(path) - 1)) < 0)
+				continue;
+			if (full_path && !glob_match(pattern, path))
+				continue;
+
+			matches++;
+			if (out_len + len + 8 < FIND_OUT_SIZE) {
+				out_len += snprintf(out + out_len, FIND_OUT_SIZE - out_len, " %s%s" FTPVITA_EOL,
+					path, (idx->nodes[node].flags & FIDX_DIR) ? "/" : "");
+				shown++;
+			}
+		}
+	}
+	sceKernelUnlockMutex(fidx_mtx, 1);
+
+	client_send_ctrl_msg(client, out);
+	free(out);
+
+	snprintf(msg, sizeof(msg), "200 %u matches%s%s" FTPVITA_EOL, matches,
+		shown < matches ? ", list truncated" : "",
+		building ? ", index is still being built" : "");
+	client_send_ctrl_msg(client, msg);
+}
+
+/* Block checksums and delta uploads:
+ * SITE BLOCKSUMS sends one 12 byte record per block of the file, the
+ * rsync rolling checksum (32 bit) followed by FNV-1a (64 bit), both big
+ * endian. SITE DELTA reads a stream of operations and builds the new
+ * file from ranges of the old one and literal data:
+ *     0x01 <offset:64> <length:32>   copy from the old file
+ *     0x02 <length:32> <data>        literal data
+ *     0x00                           end (or the end of the stream) */
+
+static inline void put_be32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline void put_be64(unsigned char *p, SceUInt64 v)
+{
+	put_be32(p, (unsigned int)(v >> 32));
+	put_be32(p + 4, (unsigned int)v);
+}
+
+static inline unsigned int get_be32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static inline SceUInt64 get_be64(const unsigned char *p)
+{
+	return ((SceUInt64)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static unsigned int rolling_sum(const unsigned char *buf, unsigned int len)
+{
+	unsigned int a = 0;
+	unsigned int b = 0;
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		a += buf[i];
+		b += (len - i) * buf[i];
+	}
+
+	return (a & 0xFFFF) | (b << 16);
+}
+
+/* SITE MSTAT <path>|<path>|... replies with the size and modification
+ * time of every path, in MLST fact format */
+static void cmd_SITE_MSTAT_func(ftpvita_client_info_t *client)
+{
+	SceIoStat stat;
+	char arg[FTPVITA_PATH_MAX];
+	char path[FTPVITA_PATH_MAX];
+	char mtime[16];
+	char msg[FTPVITA_PATH_MAX + 96];
+	const char *p = client->recv_cmd_args;
+	unsigned int found = 0, missing = 0;
+	int n;
+
+	client_send_ctrl_msg(client, "213-Status follows:" FTPVITA_EOL);
+
+	while (*p && *p != '\r' && *p != '\n') {
+		n = 0;
+		if (sscanf(p, "%[^|\r\n\t]%n", arg, &n) < 1) {
+			/* Empty entry */
+			p++;
+			continue;
+		}
+		p += n;
+		if (*p == '|')
+			p++;
+
+		gen_ftp_fullpath_from(client, arg, path, sizeof(path));
+		if (stat_resumable(get_vita_path(path), &stat) < 0) {
+			snprintf(msg, sizeof(msg), " type=none; %s" FTPVITA_EOL, arg);
+			missing++;
+		} else {
+			gen_mtime_format(mtime, sizeof(mtime), &stat.st_mtime);
+			snprintf(msg, sizeof(msg), " type=%s;size=%lld;modify=%s; %s" FTPVITA_EOL,
+				SCE_STM_ISDIR(stat.st_mode) ? "dir" : "file", stat.st_size, mtime, arg);
+			found++;
+		}
+		client_send_ctrl_msg(client, msg);
+	}
+
+	snprintf(msg, sizeof(msg), "213 End, %u found, %u missing" FTPVITA_EOL, found, missing);
+	client_send_ctrl_msg(client, msg);
+}
+
+static void cmd_SITE_BLOCKSUMS_func(ftpvita_client_info_t *client)
+{
+	char arg[FTPVITA_PATH_MAX];
+	char path[FTPVITA_PATH_MAX];
+	char msg[128];
+	unsigned char *buffer;
+	unsigned char *sums;
+	unsigned int block_size;
+	unsigned int buf_size;
+	unsigned int sums_len;
+	unsigned int off, len;
+	int bytes_read = 0;
+	int n = 0;
+	SceOff size;
+	SceUID fd;
+
+	if (sscanf(client->recv_cmd_args, "%u %n", &block_size, &n) < 1 || n == 0 ||
+	    sscanf(client->recv_cmd_args + n, "%[^\r\n\t]", arg) < 1) {
+		client_send_ctrl_msg(client, "501 Usage: SITE BLOCKSUMS <block size> <file>" FTPVITA_EOL);
+		return;
+	}
+
+	if (block_size < MIN_BLOCKSUM_SIZE || block_size > MAX_BLOCKSUM_SIZE) {
+		client_send_ctrl_msg(client, "501 Block size out of range." FTPVITA_EOL);
+		return;
+	}
+
+	gen_ftp_fullpath_from(client, arg, path, sizeof(path));
+	if ((fd = sceIoOpen(get_vita_path(path), SCE_O_RDONLY, 0)) < 0) {
+		client_send_ctrl_msg(client, "550 File not found." FTPVITA_EOL);
+		return;
+	}
+	size = sceIoLseek(fd, 0, SCE_SEEK_END);
+	sceIoLseek(fd, 0, SCE_SEEK_SET);
+
+	if (device_io_acquire(client, get_vita_path(path), 1) < 0) {
+		client_send_xfer_dequeued(client);
+		sceIoClose(fd);
+		return;
+	}
+
+	/* Whole blocks per read */
+	sched_xfer_begin(client, FTP_XFER_BULK);
+	buf_size = sched_buf_size(client, size);
+	buf_size = buf_size < block_size ? block_size : buf_size - buf_size % block_size;
+
+	buffer = xfer_buf_alloc(buf_size);
+	sums = malloc(buf_size / block_size * BLOCKSUM_RECORD_SIZE);
+	if (buffer == NULL || sums == NULL) {
+		if (buffer)
+			xfer_buf_free(buffer, buf_size);
+		free(sums);
+		sched_xfer_end(client);
+		device_io_release(client);
+		sceIoClose(fd);
+		client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
+		return;
+	}
+
+	snprintf(msg, sizeof(msg), "150 Sending %lld checksums of %u byte blocks." FTPVITA_EOL,
+		(size + block_size - 1) / block_size, block_size);
+	client_send_ctrl_msg(client, msg);
+	client_open_data_connection(client);
+
+	while (!client->data_error) {
+		sched_wait(client);
+		if ((bytes_read = sceIoRead(fd, buffer, buf_size)) <= 0)
+			break;
+
+		sums_len = 0;
+		for (off = 0; off < (unsigned int)bytes_read; off += block_size) {
+			len = bytes_read - off < block_size ? bytes_read - off : block_size;
+			put_be32(sums + sums_len, rolling_sum(buffer + off, len));
+			put_be64(sums + sums_len + 4, fnv1a64(FNV64_INIT, buffer + off, len));
+			sums_len += BLOCKSUM_RECORD_SIZE;
+		}
+
+		if (client_send_data_raw(client, sums, sums_len) < 0)
+			break;
+		sched_account(client, sums_len);
+	}
+
+	sceIoClose(fd);
+	free(sums);
+	xfer_buf_free(buffer, buf_size);
+	sched_xfer_end(client);
+	device_io_release(client);
+
+	if (bytes_read == 0 && !client->data_error) {
+		client_send_data_eof(client);
+		client_close_data_connection(client);
+		client_send_transfer_complete(client);
+	} else {
+		client_close_data_connection(client);
+		client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPVITA_EOL);
+	}
+}
+
+/* Buffered reader over the data connection for the delta stream */
+typedef struct {
+	ftpvita_client_info_t *client;
+	unsigned char *buf;
+	unsigned int size;
+	unsigned int pos;
+	unsigned int len;
+} delta_stream;
+
+/* Returns the buffered bytes, 0 at the end of the stream, < 0 on error */
+static int delta_fill(delta_stream *st)
+{
+	int ret;
+
+	if (st->pos < st->len)
+		return st->len - st->pos;
+
+	sched_wait(st->client);
+	if ((ret = client_recv_data_raw(st->client, st->buf, st->size)) <= 0)
+		return ret;
+	sched_account(st->client, ret);
+
+	st->pos = 0;
+	st->len = ret;
+
+	return ret;
+}
+
+static int delta_read(delta_stream *st, unsigned char *out, unsigned int n)
+{
+	unsigned int chunk;
+
+	while (n > 0) {
+		if (delta_fill(st) <= 0)
+			return -1;
+		chunk = st->len - st->pos < n ? st->len - st->pos : n;
+		memcpy(out, st->buf + st->pos, chunk);
+		st->pos += chunk;
+		out += chunk;
+		n -= chunk;
+	}
+
+	return 0;
+}
+
+/* Builds the new file in tmp_fd, returns 0 if the stream was valid and
+ * ended with DELTA_OP_END. A stream that just stops, even between ops,
+ * may have been cut short and is rejected */
+static int delta_apply(delta_stream *st, SceUID old_fd, SceOff old_size, SceUID tmp_fd,
+	unsigned char *copy_buf, unsigned int copy_size, SceOff *out_size, SceUInt64 *out_hash)
+{
+	unsigned char op[13];
+	unsigned int len, chunk;
+	SceOff offset;
+
+	while (1) {
+		if (delta_read(st, op, 1) < 0)
+			return -1;
+
+		switch (op[0]) {
+		case DELTA_OP_END:
+			return 0;
+
+		case DELTA_OP_COPY:
+			if (delta_read(st, op + 1, 12) < 0)
+				return -1;
+			offset = (SceOff)get_be64(op + 1);
+			len = get_be32(op + 9);
+			if (old_fd < 0 || offset < 0 || offset + len > old_size)
+				return -1;
+
+			while (len > 0) {
+				chunk = len < copy_size ? len : copy_size;
+				if (sceIoPread(old_fd, copy_buf, chunk, offset) != (int)chunk ||
+				    sceIoWrite(tmp_fd, copy_buf, chunk) != (int)chunk)
+					return -1;
+				*out_hash = fnv1a64(*out_hash, copy_buf, chunk);
+				*out_size += chunk;
+				offset += chunk;
+				len -= chunk;
+			}
+			break;
+
+		case DELTA_OP_LITERAL:
+			if (delta_read(st, op + 1, 4) < 0)
+				return -1;
+			len = get_be32(op + 1);
+
+			/* Written straight from the receive buffer */
+			while (len > 0) {
+				if (delta_fill(st) <= 0)
+					return -1;
+				chunk = st->len - st->pos < len ? st->len - st->pos : len;
+				if (sceIoWrite(tmp_fd, st->buf + st->pos, chunk) != (int)chunk)
+					return -1;
+				*out_hash = fnv1a64(*out_hash, st->buf + st->pos, chunk);
+				*out_size += chunk;
+				st->pos += chunk;
+				len -= chunk;
+			}
+			break;
+
+		default:
+			return -1;
+		}
+	}
+}
+
+static void cmd_SITE_DELTA_func(ftpvita_client_info_t *client)
+{
+	char arg[FTPVITA_PATH_MAX];
+	char path[FTPVITA_PATH_MAX];
+	char tmp_path[FTPVITA_PATH_MAX + 8];
+	char old_path[FTPVITA_PATH_MAX + 16];
+	char msg[FTPVITA_PATH_MAX + 128];
+	const char *vita_path;
+	delta_stream st;
+	unsigned char *copy_buf;
+	unsigned int buf_size;
+	SceOff old_size = 0;
+	SceOff new_size = 0;
+	SceUInt64 new_hash = FNV64_INIT;
+	SceUID old_fd, tmp_fd;
+	int had_old;
+	int ret;
+
+	if (sscanf(client->recv_cmd_args, "%[^\r\n\t]", arg) < 1) {
+		client_send_ctrl_msg(client, "501 Usage: SITE DELTA <file>" FTPVITA_EOL);
+		return;
+	}
+
+	gen_ftp_fullpath_from(client, arg, path, sizeof(path));
+	vita_path = get_vita_path(path);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.delta", vita_path);
+	snprintf(old_path, sizeof(old_path), "%s.old", tmp_path);
+
+	/* Without an old file the stream can only carry literals */
+	if ((old_fd = sceIoOpen(vita_path, SCE_O_RDONLY, 0)) >= 0)
+		old_size = sceIoLseek(old_fd, 0, SCE_SEEK_END);
+	had_old = old_fd >= 0;
+
+	if ((tmp_fd = sceIoOpen(tmp_path, SCE_O_CREAT | SCE_O_WRONLY | SCE_O_TRUNC, 0777)) < 0) {
+		if (old_fd >= 0)
+			sceIoClose(old_fd);
+		client_send_ctrl_msg(client, "550 Could not create the file." FTPVITA_EOL);
+		return;
+	}
+
+	if (device_io_acquire(client, vita_path, 1) < 0) {
+		sceIoClose(tmp_fd);
+		sceIoRemove(tmp_path);
+		if (old_fd >= 0)
+			sceIoClose(old_fd);
+		client_send_xfer_dequeued(client);
+		return;
+	}
+
+	/* The buffer is split between the stream and the copies */
+	sched_xfer_begin(client, FTP_XFER_BULK);
+	buf_size = sched_buf_size(client, 0) & ~1;
+	st.client = client;
+	st.size = buf_size / 2;
+	st.pos = st.len = 0;
+	st.buf = xfer_buf_alloc(buf_size);
+	if (st.buf == NULL) {
+		sched_xfer_end(client);
+		device_io_release(client);
+		sceIoClose(tmp_fd);
+		sceIoRemove(tmp_path);
+		if (old_fd >= 0)
+			sceIoClose(old_fd);
+		client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
+		return;
+	}
+	copy_buf = st.buf + st.size;
+
+	client_open_data_connection(client);
+	client_send_ctrl_msg(client, "150 Opening Image mode data transfer for delta." FTPVITA_EOL);
+
+	ret = delta_apply(&st, old_fd, old_size, tmp_fd, copy_buf, buf_size - st.size, &new_size, &new_hash);
+
+	/* Drain whatever follows an explicit end */
+	while (ret == 0 && delta_fill(&st) > 0)
+		st.pos = st.len;
+
+	sceIoClose(tmp_fd);
+	if (old_fd >= 0)
+		sceIoClose(old_fd);
+	xfer_buf_free(st.buf, buf_size);
+	sched_xfer_end(client);
+	device_io_release(client);
+	client_close_data_connection(client);
+
+	if (ret == 0 && !client->data_error) {
+		/* The old file is set aside until the new one is in place */
+		if (had_old && sceIoRename(vita_path, old_path) < 0) {
+			ret = -1;
+		} else if (sceIoRename(tmp_path, vita_path) < 0) {
+			if (had_old)
+				sceIoRename(old_path, vita_path);
+			ret = -1;
+		} else if (had_old) {
+			sceIoRemove(old_path);
+		}
+
+		if (ret < 0) {
+			xfer_event(client, FTPVITA_XFER_ABORTED, vita_path);
+			snprintf(msg, sizeof(msg), "550 Could not replace the file, the new one is kept as %s." FTPVITA_EOL,
+				tmp_path);
+			client_send_ctrl_msg(client, msg);
+			return;
+		}
+
+		path_changed(vita_path);
+		xfer_event(client, FTPVITA_XFER_RECEIVED, vita_path);
+		snprintf(msg, sizeof(msg), "226 Delta applied, %lld bytes, fnv64 %016llX." FTPVITA_EOL,
+			new_size, new_hash);
+		client_send_ctrl_msg(client, msg);
+	} else {
+		sceIoRemove(tmp_path);
+		xfer_event(client, FTPVITA_XFER_ABORTED, vita_path);
+		client_send_ctrl_msg(client, "426 Invalid delta stream; file left unchanged." FTPVITA_EOL);
+	}
+}
+
+static void cmd_SITE_RATE_func(ftpvita_client_info_t *client)
+{
+	char msg[128];
+	unsigned int global_kb, session_kb;
+	int n = sscanf(client->recv_cmd_args, "%u %u", &global_kb, &session_kb);
+
+	if (n >= 1) {
+		sceKernelLockMutex(sched_mtx, 1, NULL);
+		global_bucket.rate = global_kb * 1024;
+		if (n >= 2)
+			session_rate_limit = session_kb * 1024;
+		sceKernelUnlockMutex(sched_mtx, 1);
+	}
+
+	snprintf(msg, sizeof(msg), "200 Rate limits: global %u KB/s, session %u KB/s (0 is unlimited)" FTPVITA_EOL,
+		global_bucket.rate / 1024, session_rate_limit / 1024);
+	client_send_ctrl_msg(client, msg);
+}
+
+static void cmd_SITE_SCHED_func(ftpvita_client_info_t *client)
+{
+	static const char *state_names[FTPVITA_LOAD_STATES] = {"idle", "contended"};
+	char msg[160];
+	char slots[16];
+	int i;
+	unsigned int kbps;
+	ftpvita_sched_stats_t stats;
+
+	ftpvita_get_sched_stats(&stats);
+
+	snprintf(msg, sizeof(msg), "211-Load state: %s, probe latency %u us, policy errors %u" FTPVITA_EOL,
+		state_names[stats.state], stats.probe_latency, stats.policy_errors);
+	client_send_ctrl_msg(client, msg);
+
+	for (i = 0; i < FTPVITA_LOAD_STATES; i++) {
+		kbps = stats.time_us[i] ? (unsigned int)(stats.bytes[i] * 1000000 / 1024 / stats.time_us[i]) : 0;
+		snprintf(msg, sizeof(msg), " %s: %llu s, %llu bytes, %u KB/s, entered %u times" FTPVITA_EOL,
+			state_names[i], stats.time_us[i] / 1000000, stats.bytes[i], kbps, stats.entered[i]);
+		client_send_ctrl_msg(client, msg);
+	}
+
+	/* Devices with running or queued transfers */
+	for (i = 0; i < MAX_DEVICES; i++) {
+		sceKernelLockMutex(sched_mtx, 1, NULL);
+		if (!device_list[i].valid || (device_list[i].io_active == 0 && device_list[i].io_waiting == 0)) {
+			sceKernelUnlockMutex(sched_mtx, 1);
+			continue;
+		}
+		if (device_list[i].io_slots)
+			snprintf(slots, sizeof(slots), "%u", device_list[i].io_slots);
+		else
+			snprintf(slots, sizeof(slots), "unlimited");
+		snprintf(msg, sizeof(msg), " %s %u of %s transfers running, %u waiting" FTPVITA_EOL,
+			device_list[i].name, device_list[i].io_active, slots, device_list[i].io_waiting);
+		sceKernelUnlockMutex(sched_mtx, 1);
+		client_send_ctrl_msg(client, msg);
+	}
+
+	client_send_ctrl_msg(client, "211 End" FTPVITA_EOL);
+}
+
+static void cmd_SITE_MEM_func(ftpvita_client_info_t *client)
+{
+	char msg[160];
+	ftpvita_client_info_t *it;
+	unsigned int sessions = 0;
+	unsigned int arena_used = 0;
+	unsigned int slot;
+	unsigned int xfer_bufs, xfer_bufs_peak;
+	unsigned int fidx_entries = 0;
+	unsigned int fidx_bytes = 0;
+	int i;
+
+	sceKernelLockMutex(client_list_mtx, 1, NULL);
+	for (slot = 0; slot < MAX_SESSIONS; slot++) {
+		if ((it = session_slots[slot].client) != NULL) {
+			sessions++;
+			arena_used += strlen(it->cur_path) + strlen(it->rename_path) + 2;
+		}
+	}
+	sceKernelUnlockMutex(client_list_mtx, 1);
+
+	sceKernelLockMutex(sched_mtx, 1, NULL);
+	xfer_bufs = mem_xfer_bufs;
+	xfer_bufs_peak = mem_xfer_bufs_peak;
+	sceKernelUnlockMutex(sched_mtx, 1);
+
+	snprintf(msg, sizeof(msg), "211-Sessions: %u of %u, %u bytes state + %u bytes stack each" FTPVITA_EOL,
+		sessions, max_sessions, (unsigned int)sizeof(ftpvita_client_info_t), client_stack_size);
+	client_send_ctrl_msg(client, msg);
+	snprintf(msg, sizeof(msg), " Session total: %u bytes, path arenas: %u of %u bytes used" FTPVITA_EOL,
+		sessions * ((unsigned int)sizeof(ftpvita_client_info_t) + client_stack_size),
+		arena_used, sessions * FTPVITA_SESSION_ARENA_SIZE);
+	client_send_ctrl_msg(client, msg);
+	snprintf(msg, sizeof(msg), " Last shutdown: %u sessions in %llu us" FTPVITA_EOL,
+		shutdown_sessions, shutdown_time);
+	client_send_ctrl_msg(client, msg);
+	snprintf(msg, sizeof(msg), " Transfer buffers: %u bytes, peak %u, budget %u" FTPVITA_EOL,
+		xfer_bufs, xfer_bufs_peak, file_buf_size);
+	client_send_ctrl_msg(client, msg);
+	snprintf(msg, sizeof(msg), " Net pool: %u bytes, device list: %u bytes" FTPVITA_EOL,
+		net_memory ? net_init_size : 0, (unsigned int)sizeof(device_list));
+	client_send_ctrl_msg(client, msg);
+	snprintf(msg, sizeof(msg), " DU cache: %u entries, %u hits, %u misses" FTPVITA_EOL,
+		DU_CACHE_ENTRIES, du_cache_hits, du_cache_misses);
+	client_send_ctrl_msg(client, msg);
+	snprintf(msg, sizeof(msg), " Prefetch: %u of %u bytes, %u hits, %u late, %u wasted, %u over cap" FTPVITA_EOL,
+		(unsigned int)prefetch_bytes, prefetch_max, prefetch_hits, prefetch_late, prefetch_wasted, prefetch_capped);
+	client_send_ctrl_msg(client, msg);
+	sceKernelLockMutex(fidx_mtx, 1, NULL);
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (fidx_list[i]) {
+			fidx_entries += fidx_list[i]->count - 1;
+			fidx_bytes += fidx_list[i]->cap * sizeof(fidx_node) + fidx_list[i]->names_cap +
+				fidx_list[i]->hash_cap * sizeof(unsigned int);
+		}
+	}
+	sceKernelUnlockMutex(fidx_mtx, 1);
+	snprintf(msg, sizeof(msg), " Filename index: %u entries, %u bytes" FTPVITA_EOL, fidx_entries, fidx_bytes);
+	client_send_ctrl_msg(client, msg);
+	snprintf(msg, sizeof(msg), " Log ring: %u bytes, %u records pending, %u dropped" FTPVITA_EOL,
+		(unsigned int)sizeof(log_ring), (unsigned int)(log_head - log_tail), (unsigned int)log_dropped);
+	client_send_ctrl_msg(client, msg);
+	client_send_ctrl_msg(client, "211 End" FTPVITA_EOL);
+}
+
+/* SITE TRACE [RESET|JSON]: latency histograms per traced name, JSON sends
+ * the recent spans over the data connection in Chrome trace event format */
+static void cmd_SITE_TRACE_func(ftpvita_client_info_t *client)
+{
+	char msg[192];
+	char arg[8] = "";
+	const trace_span *span;
+	trace_stat *stat;
+	list_batch batch;
+	int count;
+	int first = 1;
+	int head;
+	int pos;
+	int i;
+
+	sscanf(client->recv_cmd_args, "%7s", arg);
+
+	if (name_equal_nocase(arg, "RESET")) {
+		trace_reset();
+		client_send_ctrl_msg(client, "200 Trace statistics cleared." FTPVITA_EOL);
+		return;
+	}
+
+	if (name_equal_nocase(arg, "JSON")) {
+		if (list_batch_init(&batch, client) < 0) {
+			client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
+			return;
+		}
+
+		client_send_ctrl_msg(client, "150 Sending trace events." FTPVITA_EOL);
+		client_open_data_connection(client);
+
+		list_batch_add(&batch, "{\"traceEvents\":[", 16);
+		head = trace_head;
+		for (pos = head > TRACE_RING_SLOTS ? head - TRACE_RING_SLOTS : 0; pos < head; pos++) {
+			span = &trace_ring[pos & TRACE_RING_MASK];
+			if (span->seq != pos + 1)
+				continue;
+			count = snprintf(msg, sizeof(msg),
+				"%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":1,\"tid\":%d}",
+				first ? "" : ",", span->name, trace_cat_names[span->cat], span->start, span->dur, span->session);
+			list_batch_add(&batch, msg, count);
+			first = 0;
+		}
+		list_batch_add(&batch, "\n]}\n", 4);
+
+		list_batch_free(&batch);
+		client_send_data_eof(client);
+		client_close_data_connection(client);
+		client_send_transfer_complete(client);
+		return;
+	}
+
+	client_send_ctrl_msg(client, "211-Latency in us: count, average, p50, p90, p99, max" FTPVITA_EOL);
+	for (i = 0; i < trace_stat_count; i++) {
+		stat = &trace_stats[i];
+		if ((count = stat->count) == 0)
+			continue;
+		snprintf(msg, sizeof(msg), " %-4s %-12s %8d %8llu %8u %8u %8u %8d" FTPVITA_EOL,
+			trace_cat_names[stat->cat], stat->name, count, stat->total / count,
+			trace_percentile(stat, count, 500), trace_percentile(stat, count, 900),
+			trace_percentile(stat, count, 990), stat->max);
+		client_send_ctrl_msg(client, msg);
+	}
+	snprintf(msg, sizeof(msg), "211 %s, %d spans recorded" FTPVITA_EOL,
+		trace_enabled ? "Tracing on" : "Tracing off", trace_head);
+	client_send_ctrl_msg(client, msg);
+}
+
+static void cmd_SITE_WEIGHT_func(ftpvita_client_info_t *client)
+{
+	char msg[64];
+	unsigned int weight;
+
+	if (sscanf(client->recv_cmd_args, "%u", &weight) < 1 || weight < 1 || weight > SCHED_MAX_WEIGHT) {
+		client_send_ctrl_msg(client, "501 Weight must be between 1 and 16." FTPVITA_EOL);
+		return;
+	}
+
+	/* The running transfer keeps its weight until it ends */
+	sceKernelLockMutex(sched_mtx, 1, NULL);
+	if (client->xfer_class != FTP_XFER_NONE) {
+		sched_total_weight = sched_total_weight - client->xfer_weight + weight;
+		if (client->xfer_device >= 0)
+			device_list[client->xfer_device].xfer_weight += weight - client->xfer_weight;
+		else
+			sched_other_weight += weight - client->xfer_weight;
+	}
+	client->xfer_weight = weight;
+	sceKernelUnlockMutex(sched_mtx, 1);
+	config_generation++;
+
+	snprintf(msg, sizeof(msg), "200 Transfer weight set to %u." FTPVITA_EOL, weight);
+	client_send_ctrl_msg(client, msg);
+}
+
+/* Settings for the config file and SITE SET/GET */
+
+#define TUNABLE_STARTUP 1
+
+typedef struct {
+	const char *name;
+	unsigned int *value;
+	unsigned int min;
+	unsigned int max;
+	int flags;
+	void (*apply)(void);
+} tunable_entry;
+
+static void pasv_pool_trim(void);
+
+static const tunable_entry tunable_table[] = {
+	{"port", &ftp_port, 1, 65535, TUNABLE_STARTUP, NULL},
+	{"http_port", &http_port, 0, 65535, TUNABLE_STARTUP, NULL},
+	{"net_init_size", &net_init_size, 16 * 1024, 1024 * 1024, TUNABLE_STARTUP, NULL},
+	{"file_buf_size", &file_buf_size, MIN_XFER_BUF_SIZE, 64 * 1024 * 1024, 0, NULL},
+	{"interactive_size", &interactive_xfer_size, 0, 64 * 1024 * 1024, 0, NULL},
+	{"client_stack_size", &client_stack_size, 0x3000, 0x40000, 0, NULL},
+	{"max_sessions", &max_sessions, 1, MAX_SESSIONS, 0, NULL},
+	{"rate_global", &global_bucket.rate, 0, 0xFFFFFFFF, 0, NULL},
+	{"rate_session", &session_rate_limit, 0, 0xFFFFFFFF, 0, NULL},
+	{"pasv_port_min", &pasv_port_min, 1024, 65535, 0, pasv_pool_trim},
+	{"pasv_port_max", &pasv_port_max, 1024, 65535, 0, pasv_pool_trim},
+	{"data_sndbuf", &data_sndbuf, 0, 1024 * 1024, 0, pasv_pool_trim},
+	{"data_rcvbuf", &data_rcvbuf, 0, 1024 * 1024, 0, pasv_pool_trim},
+	{"log_level", &log_level, LOG_LEVEL_NOTIF, LOG_LEVEL_DEBUG, 0, NULL},
+	{"log_file_size", &log_file_size, 16 * 1024, 16 * 1024 * 1024, 0, NULL},
+	{"find_index_max", &fidx_max_nodes, 0, 1024 * 1024, 0, NULL},
+	{"list_max_depth", &list_max_depth, 0, 255, 0, NULL},
+	{"list_stack_size", &list_stack_size, 4 * 1024, 1024 * 1024, 0, NULL},
+	{"trace", &trace_enabled, 0, 1, 0, NULL},
+	{"prefetch_size", &prefetch_size, 0, 16 * 1024 * 1024, 0, NULL},
+	{"prefetch_max", &prefetch_max, 0, 64 * 1024 * 1024, 0, NULL},
+	{NULL, NULL, 0, 0, 0, NULL}
+};
+
+static struct {
+	tunable_entry entry;
+	int valid;
+} custom_tunables[MAX_CUSTOM_TUNABLES];
+
+static const tunable_entry *tunable_find(const char *name)
+{
+	int i;
+	for (i = 0; tunable_table[i].name; i++) {
+		if (strcmp(name, tunable_table[i].name) == 0)
+			return &tunable_table[i];
+	}
+	for (i = 0; i < MAX_CUSTOM_TUNABLES; i++) {
+		if (custom_tunables[i].valid && strcmp(name, custom_tunables[i].entry.name) == 0)
+			return &custom_tunables[i].entry;
+	}
+	return NULL;
+}
+
+/* Parses decimal, 0x hex and K/M suffixed values */
+static int tunable_parse(const char *str, unsigned int *value)
+{
+	char *end;
+	unsigned long val = strtoul(str, &end, 0);
+
+	if (end == str)
+		return -1;
+	if (*end == 'K' || *end == 'k')
+		val *= 1024;
+	else if (*end == 'M' || *end == 'm')
+		val *= 1024 * 1024;
+
+	*value = (unsigned int)val;
+	return 0;
+}
+
+/* Returns 0 on success, -1 for unknown settings, -2 for bad values */
+static int tunable_set(const char *name, const char *str)
+{
+	unsigned int value;
+	const tunable_entry *entry = tunable_find(name);
+
+	if (entry == NULL)
+		return -1;
+	if (tunable_parse(str, &value) < 0 || value < entry->min || value > entry->max)
+		return -2;
+
+	*entry->value = value;
+	config_generation++;
+	if (entry->apply)
+		entry->apply();
+
+	return 0;
+}
+
+static void cmd_SITE_SET_func(ftpvita_client_info_t *client)
+{
+	char msg[128];
+	char name[32];
+	char value[32];
+	const tunable_entry *entry;
+
+	if (sscanf(client->recv_cmd_args, "%31s %31s", name, value) < 2) {
+		client_send_ctrl_msg(client, "501 Usage: SITE SET <name> <value>" FTPVITA_EOL);
+		return;
+	}
+
+	switch (tunable_set(name, value)) {
+	case 0:
+		entry = tunable_find(name);
+		snprintf(msg, sizeof(msg), "200 %s = %u%s" FTPVITA_EOL, name, *entry->value,
+			(entry->flags & TUNABLE_STARTUP) ? " (applies on restart)" : "");
+		client_send_ctrl_msg(client, msg);
+		break;
+	case -1:
+		client_send_ctrl_msg(client, "501 Unknown setting." FTPVITA_EOL);
+		break;
+	default:
+		client_send_ctrl_msg(client, "501 Value out of range." FTPVITA_EOL);
+		break;
+	}
+}
+
+static void cmd_SITE_GET_func(ftpvita_client_info_t *client)
+{
+	char msg[128];
+	char name[32];
+	int i;
+	const tunable_entry *entry;
+
+	if (sscanf(client->recv_cmd_args, "%31s", name) == 1) {
+		if ((entry = tunable_find(name)) == NULL) {
+			client_send_ctrl_msg(client, "501 Unknown setting." FTPVITA_EOL);
+			return;
+		}
+		snprintf(msg, sizeof(msg), "200 %s = %u" FTPVITA_EOL, entry->name, *entry->value);
+		client_send_ctrl_msg(client, msg);
+		return;
+	}
+
+	client_send_ctrl_msg(client, "211-Settings:" FTPVITA_EOL);
+	for (i = 0; tunable_table[i].name; i++) {
+		snprintf(msg, sizeof(msg), " %s = %u" FTPVITA_EOL, tunable_table[i].name, *tunable_table[i].value);
+		client_send_ctrl_msg(client, msg);
+	}
+	for (i = 0; i < MAX_CUSTOM_TUNABLES; i++) {
+		if (custom_tunables[i].valid) {
+			snprintf(msg, sizeof(msg), " %s = %u" FTPVITA_EOL, custom_tunables[i].entry.name,
+				*custom_tunables[i].entry.value);
+			client_send_ctrl_msg(client, msg);
+		}
+	}
+	client_send_ctrl_msg(client, "211 End" FTPVITA_EOL);
+}
+
+#define add_site_entry(name) {#name, cmd_SITE_##name##_func}
+static const cmd_dispatch_entry site_dispatch_table[] = {
+	add_site_entry(BLOCKSUMS),
+	add_site_entry(DELTA),
+	add_site_entry(DU),
+	add_site_entry(FIND),
+	add_site_entry(GET),
+	add_site_entry(MEM),
+	add_site_entry(MSTAT),
+	add_site_entry(RATE),
+	add_site_entry(SCHED),
+	add_site_entry(SET),
+	add_site_entry(TRACE),
+	add_site_entry(WEIGHT),
+	{NULL, NULL}
+};
+
+static void cmd_SITE_func(ftpvita_client_info_t *client)
+{
+	int i;
+	int len;
+	char sub[16];
+
+	if (sscanf(client->recv_cmd_args, "%15s%n", sub, &len) < 1) {
+		client_send_ctrl_msg(client, "501 Missing SITE command." FTPVITA_EOL);
+		return;
+	}
+
+	for (i = 0; sub[i]; i++) {
+		if (sub[i] >= 'a' && sub[i] <= 'z')
+			sub[i] -= 'a' - 'A';
+	}
+
+	/* The subcommand arguments follow the subcommand name */
+	client->recv_cmd_args += len;
+	while (*client->recv_cmd_args == ' ')
+		client->recv_cmd_args++;
+
+	for (i = 0; site_dispatch_table[i].cmd; i++) {
+		if (strcmp(sub, site_dispatch_table[i].cmd) == 0) {
+			site_dispatch_table[i].func(client);
+			return;
+		}
+	}
+	// Check for custom SITE commands
+	for (i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
+		if (custom_site_dispatchers[i].valid) {
+			if (strcmp(sub, custom_site_dispatchers[i].cmd) == 0) {
+				custom_site_dispatchers[i].func(client);
+				return;
+			}
+		}
+	}
+
+	client_send_ctrl_msg(client, "504 Sorry, SITE command not implemented." FTPVITA_EOL);
+}
+
+#define add_entry(name) {#name, cmd_##name##_func}
+static const cmd_dispatch_entry cmd_dispatch_table[] = {
+	add_entry(NOOP),
+	add_entry(USER),
+	add_entry(PASS),
+	add_entry(QUIT),
+	add_entry(SYST),
+	add_entry(PASV),
+	add_entry(EPSV),
+	add_entry(PORT),
+	add_entry(LIST),
+	add_entry(NLST),
+	add_entry(MLSD),
+	add_entry(MLST),
+	add_entry(PWD),
+	add_entry(CWD),
+	add_entry(TYPE),
+	add_entry(MODE),
+	add_entry(CDUP),
+	add_entry(RETR),
+	add_entry(STOR),
+	add_entry(DELE),
+	add_entry(RMD),
+	add_entry(MKD),
+	add_entry(RNFR),
+	add_entry(RNTO),
+	add_entry(SIZE),
+	add_entry(MDTM),
+	add_entry(MFMT),
+	add_entry(REST),
+	add_entry(FEAT),
+	add_entry(OPTS),
+	add_entry(APPE),
+	add_entry(SITE),
+	add_entry(ABOR),
+	add_entry(STAT),
+	{NULL, NULL}
+};
+
+static cmd_dispatch_func get_dispatch_func(const char *cmd)
+{
+	int i;
+	for(i = 0; cmd_dispatch_table[i].cmd && cmd_dispatch_table[i].func; i++) {
+		if (strcmp(cmd, cmd_dispatch_table[i].cmd) == 0) {
+			return cmd_dispatch_table[i].func;
+		}
+	}
+	// Check for custom commands
+	for(i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
+		if (custom_command_dispatchers[i].valid) {
+			if (strcmp(cmd, custom_command_dispatchers[i].cmd) == 0) {
+				return custom_command_dispatchers[i].func;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Counts a new session against max_sessions, 0 if there is room */
+static int session_reserve(void)
+{
+	if (sceKernelAtomicAddAndGet32(&number_clients, 1) > (int)max_sessions) {
+		sceKernelAtomicSubAndGet32(&number_clients, 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Claims a registry slot for a reserved session, returns its ID */
+static int session_claim(void)
+{
+	unsigned int generation;
+	int slot;
+
+	for (slot = 0; slot < MAX_SESSIONS; slot++) {
+		if (sceKernelAtomicCompareAndSet32(&session_slots[slot].used, 0, 1) == 0)
+			break;
+	}
+	if (slot == MAX_SESSIONS)
+		return -1;
+
+	generation = ++session_slots[slot].generation & ((1 << (31 - SESSION_SLOT_BITS)) - 1);
+	return (generation << SESSION_SLOT_BITS) | slot;
+}
+
+static void session_release(int id)
+{
+	int slot = id & ((1 << SESSION_SLOT_BITS) - 1);
+
+	session_slots[slot].thid = -1;
+	sceKernelAtomicGetAndSet32(&session_slots[slot].used, 0);
+	sceKernelAtomicSubAndGet32(&number_clients, 1);
+}
+
+static void client_list_add(ftpvita_client_info_t *client)
+{
+	int slot = client->num & ((1 << SESSION_SLOT_BITS) - 1);
+
+	/* Publish the client in its slot */
+	sceKernelLockMutex(client_list_mtx, 1, NULL);
+	session_slots[slot].client = client;
+	session_slots[slot].thid = client->thid;
+	client->restore_point = 0;
+	sceKernelUnlockMutex(client_list_mtx, 1);
+
+	/* Wake up the load probe */
+	sceKernelSignalSema(load_sema, 1);
+	activity_touch();
+	activity_signal();
+}
+
+static void client_list_delete(ftpvita_client_info_t *client)
+{
+	int slot = client->num & ((1 << SESSION_SLOT_BITS) - 1);
+
+	/* Remove the client from the registry */
+	sceKernelLockMutex(client_list_mtx, 1, NULL);
+	session_slots[slot].client = NULL;
+	sceKernelUnlockMutex(client_list_mtx, 1);
+
+	prefetch_release(slot);
+	session_release(client->num);
+	activity_signal();
+}
+
+/* Aborts every session at once, then waits for them. The sessions wind
+ * down in parallel and remove themselves from the registry */
+static void client_list_thread_end()
+{
+	ftpvita_client_info_t *it;
+	SceUID thids[MAX_SESSIONS];
+	SceUInt64 start = sceKernelGetProcessTimeWide();
+	unsigned int count = 0;
+	unsigned int i;
+	const int data_abort_flags = SCE_NET_SOCKET_ABORT_FLAG_RCV_PRESERVATION |
+				SCE_NET_SOCKET_ABORT_FLAG_SND_PRESERVATION;
+
+	/* Wake up the transfers queued for a device */
+	sessions_closing = 1;
+	sceKernelSetEventFlag(device_evf, (1u << MAX_DEVICES) - 1);
+	sceKernelLockMutex(client_list_mtx, 1, NULL);
+
+	/* Iterate over the sessions and close their sockets */
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		if ((it = session_slots[i].client) == NULL)
+			continue;
+		thids[count++] = it->thid;
+
+		/* Abort the client's control socket, only abort
+		 * receiving data so we can still send control messages */
+		sceNetSocketAbort(it->ctrl_sockfd,
+			SCE_NET_SOCKET_ABORT_FLAG_RCV_PRESERVATION);
+
+		/* If there's an open data connection, abort it */
+		if (it->data_con_type != FTP_DATA_CONNECTION_NONE) {
+			sceNetSocketAbort(it->data_sockfd, data_abort_flags);
+			if (it->data_con_type == FTP_DATA_CONNECTION_PASSIVE &&
+				it->pasv_sockfd >= 0) {
+				sceNetSocketAbort(it->pasv_sockfd, data_abort_flags);
+			}
+		}
+	}
+
+	sceKernelUnlockMutex(client_list_mtx, 1);
+
+	/* Wait until the client threads end, a thread already gone
+	 * returns right away */
+	for (i = 0; i < count; i++)
+		sceKernelWaitThreadEnd(thids[i], NULL, NULL);
+
+	sessions_closing = 0;
+	shutdown_sessions = count;
+	shutdown_time = sceKernelGetProcessTimeWide() - start;
+	INFO("%u sessions closed in %llu us\n", shutdown_sessions, shutdown_time);
+}
+
+/* Splits the received line, cmd must hold 16 chars */
+static void client_parse_cmd(ftpvita_client_info_t *client, char *cmd)
+{
+	/* The command is the first chars until the first space */
+	cmd[0] = '\0';
+	sscanf(client->recv_buffer, "%15s", cmd);
+
+	client->recv_cmd_args = strchr(client->recv_buffer, ' ');
+	if (client->recv_cmd_args)
+		client->recv_cmd_args++; /* Skip the space */
+	else
+		client->recv_cmd_args = client->recv_buffer;
+}
+
+static int client_thread(SceSize args, void *argp)
+{
+	char cmd[16];
+	cmd_dispatch_func dispatch_func;
+	ftpvita_client_info_t *client = *(ftpvita_client_info_t **)argp;
+	SceUInt64 trace_start;
+	int i;
+
+	DEBUG("Client thread %i started!\n", client->num);
+
+	client_send_ctrl_msg(client, "220 FTPVita Server ready." FTPVITA_EOL);
+
+	while (1) {
+		memset(client->recv_buffer, 0, sizeof(client->recv_buffer));
+
+		client->n_recv = sceNetRecv(client->ctrl_sockfd, client->recv_buffer, sizeof(client->recv_buffer) - 1, 0);
+		if (client->n_recv > 0 &&
+			(client->n_recv = telnet_strip(client->recv_buffer, client->n_recv)) == 0) {
+			/* Only telnet commands */
+			continue;
+		} else if (client->n_recv > 0) {
+			client->recv_buffer[client->n_recv] = '\0';
+
+			DEBUG("Received %i bytes from client number %i:\n",
+				client->n_recv, client->num);
+
+			INFO("\t%i> %s", client->num, client->recv_buffer);
+
+			activity_touch();
+
+			client_parse_cmd(client, cmd);
+
+			/* Wait 1 ms before sending any data */
+			sceKernelDelayThread(1*1000);
+
+			if ((dispatch_func = get_dispatch_func(cmd))) {
+				trace_start = trace_begin();
+				dispatch_func(client);
+				for (i = 0; cmd[i]; i++)
+					cmd[i] = ascii_upper(cmd[i]);
+				trace_end(TRACE_CMD, cmd, client, trace_start);
+			} else {
+				client_send_ctrl_msg(client, "502 Sorry, command not implemented. :(" FTPVITA_EOL);
+			}
+
+		} else if (client->n_recv == 0) {
+			/* Value 0 means connection closed by the remote peer */
+			INFO("Connection closed by the client %i.\n", client->num);
+			/* Delete itself from the client list */
+			client_list_delete(client);
+			break;
+		} else if (client->n_recv == SCE_NET_ERROR_EINTR) {
+			/* Socket aborted (ftpvita_fini() called) */
+			INFO("Client %i socket aborted.\n", client->num);
+			client_list_delete(client);
+			break;
+		} else {
+			/* Other errors */
+			INFO("Client %i socket error: 0x%08X\n", client->num, client->n_recv);
+			client_list_delete(client);
+			break;
+		}
+	}
+
+	/* Close the client's socket */
+	sceNetSocketClose(client->ctrl_sockfd);
+
+	/* If there's an open data connection, close it */
+	client_release_data(client);
+
+	DEBUG("Client thread %i exiting!\n", client->num);
+
+	free(client);
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+/* Allocates the session of an accepted connection and starts its thread,
+ * the session must have been reserved with session_reserve() */
+static void client_spawn(int sockfd, const SceNetSockaddrIn *addr, SceKernelThreadEntry entry, const char *kind,
+	unsigned int stack_size)
+{
+	char remote_ip[16];
+	char client_thread_name[64];
+	ftpvita_client_info_t *client;
+	SceUID client_thid;
+	int id;
+
+	/* Get the client's IP address */
+	sceNetInetNtop(SCE_NET_AF_INET,
+		&addr->sin_addr.s_addr,
+		remote_ip,
+		sizeof(remote_ip));
+
+	if ((id = session_claim()) < 0 || (client = malloc(sizeof(*client))) == NULL) {
+		INFO("No room for client (%s) from %s\n", kind, remote_ip);
+		if (id >= 0)
+			session_release(id);
+		else
+			sceKernelAtomicSubAndGet32(&number_clients, 1);
+		sceNetSocketClose(sockfd);
+		return;
+	}
+
+	INFO("Client %i connected (%s), IP: %s port: %i\n",
+		id, kind, remote_ip, addr->sin_port);
+
+	/* Create a new thread for the client */
+	snprintf(client_thread_name, sizeof(client_thread_name), "FTPVita_%s_%i_thread",
+		kind, id);
+
+	client_thid = sceKernelCreateThread(
+		client_thread_name, entry,
+		load_policy_priority(), stack_size,
+		0, load_policy_affinity(), NULL);
+
+	DEBUG("Client %i thread UID: 0x%08X\n", id, client_thid);
+
+	if (client_thid < 0) {
+		free(client);
+		session_release(id);
+		sceNetSocketClose(sockfd);
+		return;
+	}
+
+	/* Initialize the ftpvita_client_info_t struct for the new client */
+	client->num = id;
+	client->thid = client_thid;
+	client->ctrl_sockfd = sockfd;
+	client->data_con_type = FTP_DATA_CONNECTION_NONE;
+	client->pasv_sockfd = -1;
+	client->pasv_slot = -1;
+	client->transfer_mode = FTP_TRANSFER_MODE_STREAM;
+	client->data_open = 0;
+	client->data_error = 0;
+	client->block_remaining = 0;
+	client->block_eof = 0;
+	client->xfer_class = FTP_XFER_NONE;
+	client->xfer_weight = 1;
+	client->xfer_device = -1;
+	client->xfer_aborted = 0;
+	client->reply_open = 0;
+	client->rate_limit = 0;
+	memset(&client->bucket, 0, sizeof(client->bucket));
+	client->xfer_bytes = 0;
+	client->xfer_start = 0;
+	session_init_paths(client);
+	memcpy(&client->addr, addr, sizeof(client->addr));
+
+	/* Add the new client to the client list */
+	client_list_add(client);
+
+	/* Start the client thread */
+	sceKernelStartThread(client_thid, sizeof(client), &client);
+}
+
+static int server_thread(SceSize args, void *argp)
+{
+	int ret;
+	UNUSED(ret);
+
+	SceNetSockaddrIn serveraddr;
+
+	DEBUG("Server thread started!\n");
+
+	/* Fill the server's address */
+	serveraddr.sin_family = SCE_NET_AF_INET;
+	serveraddr.sin_addr.s_addr = sceNetHtonl(SCE_NET_INADDR_ANY);
+	serveraddr.sin_port = sceNetHtons(ftp_port);
+
+	/* Bind the server's address to the socket */
+	ret = sceNetBind(server_sockfd, (SceNetSockaddr *)&serveraddr, sizeof(serveraddr));
+	DEBUG("sceNetBind(): 0x%08X\n", ret);
+
+	/* Start listening */
+	ret = sceNetListen(server_sockfd, 128);
+	DEBUG("sceNetListen(): 0x%08X\n", ret);
+
+	while (1) {
+		/* Accept clients */
+		SceNetSockaddrIn clientaddr;
+		int client_sockfd;
+		unsigned int addrlen = sizeof(clientaddr);
+
+		DEBUG("Waiting for incoming connections...\n");
+
+		client_sockfd = sceNetAccept(server_sockfd, (SceNetSockaddr *)&clientaddr, &addrlen);
+		if (client_sockfd >= 0) {
+			DEBUG("New connection, client fd: 0x%08X\n", client_sockfd);
+
+			/* Enforce the session limit before allocating anything */
+			if (session_reserve() < 0) {
+				INFO("Session limit reached, rejecting client\n");
+				sceNetSend(client_sockfd, "421 Too many connections, try again later." FTPVITA_EOL,
+					strlen("421 Too many connections, try again later." FTPVITA_EOL), 0);
+				sceNetSocketClose(client_sockfd);
+				continue;
+			}
+
+			client_spawn(client_sockfd, &clientaddr, client_thread, "client", client_stack_size);
+		} else {
+			/* if sceNetAccept returns < 0, it means that the listening
+			 * socket has been closed, this means that we want to
+			 * finish the server thread. Otherwise the socket died
+			 * with the network and the net thread rebinds it */
+			DEBUG("Server socket closed, 0x%08X\n", client_sockfd);
+			if (net_listening)
+				sceKernelSetEventFlag(net_evf, NET_EVENT_LISTEN_FAILED);
+			break;
+		}
+	}
+
+	DEBUG("Server thread exiting!\n");
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+/* HTTP frontend:
+ * HTTP connections are sessions like the FTP ones, so they count against
+ * max_sessions, go through the transfer scheduler and are torn down by
+ * ftpvita_fini(). Paths are the same as on FTP (/ux0:/foo/bar), "/"
+ * lists the devices. */
+
+/* Per connection buffers for paths and their encoded forms, too big for
+ * the session thread's stack */
+typedef struct {
+	char target[FTPVITA_PATH_MAX];
+	char path[FTPVITA_PATH_MAX];
+	char name[FTPVITA_PATH_MAX];
+	char href[FTPVITA_PATH_MAX * 3];
+	char line[FTPVITA_PATH_MAX * 3 + 256];
+} http_scratch;
+
+typedef struct {
+	ftpvita_client_info_t *client;
+	http_scratch *scratch;
+	char *buf;
+	int len;
+	int keep_alive;
+	int http10;
+} http_conn;
+
+/* Body writer, chunked unless the client speaks HTTP/1.0 */
+typedef struct {
+	http_conn *conn;
+	char *buf;
+	unsigned int len;
+} http_body;
+
+static int http_send_raw(ftpvita_client_info_t *client, const void *buf, unsigned int len)
+{
+	unsigned int sent = 0;
+	int ret;
+
+	while (sent < len) {
+		ret = sceNetSend(client->ctrl_sockfd, (const char *)buf + sent, len - sent, 0);
+		if (ret <= 0)
+			return -1;
+		sent += ret;
+	}
+
+	return sent;
+}
+
+static int http_send_headers(http_conn *conn, const char *status, const char *content_type,
+	SceOff content_length, const char *extra)
+{
+	char headers[512];
+	char length[48];
+	int len;
+
+	if (content_length >= 0)
+		snprintf(length, sizeof(length), "Content-Length: %lld\r\n", content_length);
+	else if (!conn->http10)
+		snprintf(length, sizeof(length), "Transfer-Encoding: chunked\r\n");
+	else
+		length[0] = '\0';
+
+	len = snprintf(headers, sizeof(headers),
+		"HTTP/1.1 %s\r\n"
+		"Server: FTPVita\r\n"
+		"Content-Type: %s\r\n"
+		"%s"
+		"%s"
+		"Connection: %s\r\n"
+		"\r\n",
+		status, content_type, length, extra ? extra : "",
+		conn->keep_alive ? "keep-alive" : "close");
+
+	return http_send_raw(conn->client, headers, len);
+}
+
+static void http_send_error(http_conn *conn, const char *status, const char *extra, int head)
+{
+	char body[64];
+	int len = snprintf(body, sizeof(body), "%s\n", status);
+
+	http_send_headers(conn, status, "text/plain", len, extra);
+	if (!head)
+		http_send_raw(conn->client, body, len);
+}
+
+static void http_body_flush(http_body *body)
+{
+	char size[16];
+	int len;
+
+	if (body->len == 0)
+		return;
+
+	if (!body->conn->http10) {
+		len = snprintf(size, sizeof(size), "%X\r\n", body->len);
+		http_send_raw(body->conn->client, size, len);
+	}
+	http_send_raw(body->conn->client, body->buf, body->len);
+	if (!body->conn->http10)
+		http_send_raw(body->conn->client, "\r\n", 2);
+
+	body->len = 0;
+}
+
+static void http_body_add(http_body *body, const char *str)
+{
+	unsigned int len = strlen(str);
+
+	if (body->len + len > HTTP_BODY_BUF_SIZE)
+		http_body_flush(body);
+	if (len > HTTP_BODY_BUF_SIZE)
+		len = HTTP_BODY_BUF_SIZE;
+
+	memcpy(body->buf + body->len, str, len);
+	body->len += len;
+}
+
+static void http_body_end(http_body *body)
+{
+	http_body_flush(body);
+	if (!body->conn->http10)
+		http_send_raw(body->conn->client, "0\r\n\r\n", 5);
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = ascii_lower(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+static void http_url_decode(char *s)
+{
+	char *out = s;
+
+	while (*s) {
+		if (s[0] == '%' && hex_value(s[1]) >= 0 && hex_value(s[2]) >= 0) {
+			*out++ = (hex_value(s[1]) << 4) | hex_value(s[2]);
+			s += 3;
+		} else {
+			*out++ = *s++;
+		}
+	}
+	*out = '\0';
+}
+
+static void http_url_encode(char *out, unsigned int size, const char *s)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	unsigned char c;
+	unsigned int len = 0;
+
+	while ((c = *s++) && len + 4 < size) {
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+		    c == '-' || c == '_' || c == '.' || c == '~' || c == '/' || c == ':') {
+			out[len++] = c;
+		} else {
+			out[len++] = '%';
+			out[len++] = hex[c >> 4];
+			out[len++] = hex[c & 0xF];
+		}
+	}
+	out[len] = '\0';
+}
+
+static void http_html_escape(char *out, unsigned int size, const char *s)
+{
+	const char *rep;
+	unsigned int len = 0;
+	unsigned int n;
+
+	for (; *s && len + 7 < size; s++) {
+		switch (*s) {
+		case '&': rep = "&amp;"; break;
+		case '<': rep = "&lt;"; break;
+		case '>': rep = "&gt;"; break;
+		case '"': rep = "&quot;"; break;
+		default: rep = NULL; break;
+		}
+		if (rep) {
+			n = strlen(rep);
+			memcpy(out + len, rep, n);
+			len += n;
+		} else {
+			out[len++] = *s;
+		}
+	}
+	out[len] = '\0';
+}
+
+/* Returns the value if line is the header name (case-insensitive) */
+static const char *http_header_value(const char *line, const char *name)
+{
+	while (*name) {
+		if (ascii_lower(*line++) != *name++)
+			return NULL;
+	}
+	if (*line++ != ':')
+		return NULL;
+	while (*line == ' ' || *line == '\t')
+		line++;
+	return line;
+}
+
+/* Only single "bytes=" ranges are honoured, anything else gets the whole
+ * file. Returns 1 for a range, 0 for the whole file, -1 if the range is
+ * not satisfiable. */
+static int http_parse_range(const char *value, SceOff size, SceOff *start, SceOff *end)
+{
+	char *p;
+	long long a, b;
+
+	if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ','))
+		return 0;
+	value += 6;
+
+	if (*value == '-') {
+		b = strtoll(value + 1, &p, 10);
+		if (p == value + 1)
+			return 0;
+		if (b <= 0 || size == 0)
+			return -1;
+		*start = b > size ? 0 : size - b;
+		*end = size - 1;
+		return 1;
+	}
+
+	a = strtoll(value, &p, 10);
+	if (p == value || *p != '-')
+		return 0;
+	p++;
+
+	if (*p >= '0' && *p <= '9') {
+		b = strtoll(p, NULL, 10);
+		if (b < a)
+			return 0;
+	} else {
+		b = size - 1;
+	}
+
+	if (a >= size)
+		return -1;
+
+	*start = a;
+	*end = b >= size ? size - 1 : b;
+	return 1;
+}
+
+static int http_device_exported(const char *vita_path)
+{
+	const char *colon = strchr(vita_path, ':');
+	size_t len;
+	int i;
+
+	if (colon == NULL)
+		return 0;
+	len = colon - vita_path + 1;
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (device_list[i].valid && strncmp(device_list[i].name, vita_path, len) == 0 &&
+		    device_list[i].name[len] == '\0')
+			return 1;
+	}
+
+	return 0;
+}
+
+static void http_send_index(http_conn *conn, const char *path, int head)
+{
+	http_scratch *scratch = conn->scratch;
+	http_body body;
+	SceIoDirent dirent;
+	SceUID dir = -1;
+	int i;
+
+	if (strcmp(path, "/") != 0 && (dir = sceIoDopen(get_vita_path(path))) < 0) {
+		http_send_error(conn, "404 Not Found", NULL, head);
+		return;
+	}
+
+	body.conn = conn;
+	body.len = 0;
+	if (head || (body.buf = malloc(HTTP_BODY_BUF_SIZE)) == NULL) {
+		if (dir >= 0)
+			sceIoDclose(dir);
+		if (head)
+			http_send_headers(conn, "200 OK", "text/html; charset=utf-8", -1, NULL);
+		else
+			http_send_error(conn, "503 Service Unavailable", NULL, 0);
+		return;
+	}
+
+	/* Without a length HTTP/1.0 clients read up to the close */
+	if (conn->http10)
+		conn->keep_alive = 0;
+	http_send_headers(conn, "200 OK", "text/html; charset=utf-8", -1, NULL);
+
+	http_html_escape(scratch->name, sizeof(scratch->name), path);
+	snprintf(scratch->line, sizeof(scratch->line), "<!DOCTYPE html><html><head><meta charset=\"utf-8\">"
+		"<title>Index of %s</title></head><body><h1>Index of %s</h1><pre>", scratch->name, scratch->name);
+	http_body_add(&body, scratch->line);
+	if (strcmp(path, "/") != 0)
+		http_body_add(&body, "<a href=\"../\">../</a>\n");
+
+	if (dir < 0) {
+		for (i = 0; i < MAX_DEVICES; i++) {
+			if (device_list[i].valid) {
+				http_url_encode(scratch->href, sizeof(scratch->href), device_list[i].name);
+				http_html_escape(scratch->name, sizeof(scratch->name), device_list[i].name);
+				snprintf(scratch->line, sizeof(scratch->line), "<a href=\"/%s/\">%s/</a>\n",
+					scratch->href, scratch->name);
+				http_body_add(&body, scratch->line);
+			}
+		}
+	} else {
+		memset(&dirent, 0, sizeof(dirent));
+		while (sceIoDread(dir, &dirent) > 0) {
+			http_url_encode(scratch->href, sizeof(scratch->href), dirent.d_name);
+			http_html_escape(scratch->name, sizeof(scratch->name), dirent.d_name);
+			if (SCE_STM_ISDIR(dirent.d_stat.st_mode))
+				snprintf(scratch->line, sizeof(scratch->line), "<a href=\"%s/\">%s/</a>\n",
+					scratch->href, scratch->name);
+			else
+				snprintf(scratch->line, sizeof(scratch->line), "<a href=\"%s\">%s</a>  %lld\n",
+					scratch->href, scratch->name, dirent.d_stat.st_size);
+			http_body_add(&body, scratch->line);
+			memset(&dirent, 0, sizeof(dirent));
+		}
+		sceIoDclose(dir);
+	}
+
+	http_body_add(&body, "</pre></body></html>\n");
+	http_body_end(&body);
+	free(body.buf);
+}
+
+static void http_send_file(http_conn *conn, const char *path, const SceIoStat *stat,
+	const char *range, int head)
+{
+	ftpvita_client_info_t *client = conn->client;
+	char extra[128];
+	unsigned char *buffer;
+	unsigned int op_buf_size;
+	SceOff start = 0;
+	SceOff end = stat->st_size - 1;
+	int partial = 0;
+	SceUID fd;
+
+	if (range && (partial = http_parse_range(range, stat->st_size, &start, &end)) < 0) {
+		snprintf(extra, sizeof(extra), "Content-Range: bytes */%lld\r\n", stat->st_size);
+		http_send_error(conn, "416 Range Not Satisfiable", extra, head);
+		return;
+	}
+
+	if (partial)
+		snprintf(extra, sizeof(extra), "Accept-Ranges: bytes\r\nContent-Range: bytes %lld-%lld/%lld\r\n",
+			start, end, stat->st_size);
+	else
+		snprintf(extra, sizeof(extra), "Accept-Ranges: bytes\r\n");
+
+	if (head) {
+		http_send_headers(conn, partial ? "206 Partial Content" : "200 OK",
+			"application/octet-stream", end - start + 1, extra);
+		return;
+	}
+
+	if ((fd = sceIoOpen(get_vita_path(path), SCE_O_RDONLY, 0)) < 0) {
+		http_send_error(conn, "404 Not Found", NULL, 0);
+		return;
+	}
+	sceIoLseek(fd, start, SCE_SEEK_SET);
+
+	/* Same device queue, scheduling and buffer budget as RETR */
+	if (device_io_acquire(client, get_vita_path(path), 0) < 0) {
+		sceIoClose(fd);
+		http_send_error(conn, "503 Service Unavailable", NULL, 0);
+		return;
+	}
+	sched_xfer_begin(client, end - start + 1 <= interactive_xfer_size ? FTP_XFER_INTERACTIVE : FTP_XFER_BULK);
+	op_buf_size = sched_buf_size(client, end - start + 1);
+	if ((buffer = xfer_buf_alloc(op_buf_size)) == NULL) {
+		sched_xfer_end(client);
+		device_io_release(client);
+		sceIoClose(fd);
+		http_send_error(conn, "503 Service Unavailable", NULL, 0);
+		return;
+	}
+
+	http_send_headers(conn, partial ? "206 Partial Content" : "200 OK",
+		"application/octet-stream", end - start + 1, extra);
+
+	if (send_file_data(client, fd, end - start + 1, &buffer, &op_buf_size, http_send_raw) < 0) {
+		/* The length was promised, the connection can't be reused */
+		conn->keep_alive = 0;
+		xfer_event(client, FTPVITA_XFER_ABORTED, get_vita_path(path));
+	} else {
+		xfer_event(client, FTPVITA_XFER_SENT, get_vita_path(path));
+	}
+
+	sceIoClose(fd);
+	xfer_buf_free(buffer, op_buf_size);
+	sched_xfer_end(client);
+	device_io_release(client);
+}
+
+/* Any ".." segment would climb out of the device */
+static int http_path_climbs(const char *path)
+{
+	const char *seg = path;
+
+	while (seg) {
+		if (seg[0] == '.' && seg[1] == '.' && (seg[2] == '/' || seg[2] == '\0'))
+			return 1;
+		if ((seg = strchr(seg, '/')) != NULL)
+			seg++;
+	}
+
+	return 0;
+}
+
+static void http_handle_request(http_conn *conn)
+{
+	http_scratch *scratch = conn->scratch;
+	char method[8];
+	char *target = scratch->target;
+	char *path = scratch->path;
+	char version[16];
+	const char *range = NULL;
+	const char *value;
+	char *line, *next, *query;
+	SceIoStat stat;
+	int head;
+	size_t len;
+
+	if (sscanf(conn->buf, "%7s %1023s %15s", method, target, version) < 3) {
+		conn->keep_alive = 0;
+		http_send_error(conn, "400 Bad Request", NULL, 0);
+		return;
+	}
+
+	conn->http10 = strcmp(version, "HTTP/1.0") == 0;
+	conn->keep_alive = !conn->http10;
+
+	/* Headers follow the request line, one per line */
+	for (line = strstr(conn->buf, "\r\n"); line && line[2] != '\r'; line = next) {
+		line += 2;
+		next = strstr(line, "\r\n");
+		if (next)
+			*next = '\0';
+
+		if ((value = http_header_value(line, "range")) != NULL) {
+			range = value;
+		} else if ((value = http_header_value(line, "connection")) != NULL) {
+			if (name_equal_nocase(value, "close"))
+				conn->keep_alive = 0;
+			else if (name_equal_nocase(value, "keep-alive"))
+				conn->keep_alive = 1;
+		}
+
+		if (next)
+			*next = '\r';
+		else
+			break;
+	}
+
+	head = strcmp(method, "HEAD") == 0;
+	if (!head && strcmp(method, "GET") != 0) {
+		conn->keep_alive = 0;
+		http_send_error(conn, "405 Method Not Allowed", "Allow: GET, HEAD\r\n", 0);
+		return;
+	}
+
+	if ((query = strchr(target, '?')) != NULL)
+		*query = '\0';
+	http_url_decode(target);
+
+	if (target[0] != '/' || http_path_climbs(target)) {
+		http_send_error(conn, "400 Bad Request", NULL, head);
+		return;
+	}
+
+	snprintf(path, sizeof(scratch->path), "%s", target);
+	path_normalize(path);
+
+	if (strcmp(path, "/") == 0) {
+		http_send_index(conn, path, head);
+		return;
+	}
+
+	if (!http_device_exported(get_vita_path(path)) || sceIoGetstat(get_vita_path(path), &stat) < 0) {
+		http_send_error(conn, "404 Not Found", NULL, head);
+		return;
+	}
+
+	if (SCE_STM_ISDIR(stat.st_mode)) {
+		/* Relative links in the index need the trailing slash */
+		len = strlen(target);
+		if (target[len - 1] != '/') {
+			http_url_encode(scratch->href, sizeof(scratch->href), target);
+			snprintf(scratch->line, sizeof(scratch->line), "Location: %s/\r\n", scratch->href);
+			http_send_error(conn, "301 Moved Permanently", scratch->line, head);
+			return;
+		}
+		http_send_index(conn, path, head);
+		return;
+	}
+
+	http_send_file(conn, path, &stat, range, head);
+}
+
+/* Reads up to the blank line ending the request headers. Returns the
+ * header length, 0 if the peer closed and < 0 on error or timeout. */
+static int http_read_request(http_conn *conn)
+{
+	char *end;
+	int ret;
+
+	while (1) {
+		conn->buf[conn->len] = '\0';
+		if ((end = strstr(conn->buf, "\r\n\r\n")) != NULL)
+			return end - conn->buf + 4;
+
+		if (conn->len >= HTTP_HEADER_MAX)
+			return -1;
+
+		ret = sceNetRecv(conn->client->ctrl_sockfd, conn->buf + conn->len, HTTP_HEADER_MAX - conn->len, 0);
+		if (ret <= 0)
+			return ret;
+		conn->len += ret;
+	}
+}
+
+static int http_client_thread(SceSize args, void *argp)
+{
+	ftpvita_client_info_t *client = *(ftpvita_client_info_t **)argp;
+	unsigned int timeout = HTTP_KEEPALIVE_TIMEOUT;
+	SceUInt64 trace_start;
+	http_conn conn;
+	int ret;
+
+	DEBUG("HTTP client thread %i started!\n", client->num);
+
+	/* Idle keep-alive connections give their session back */
+	sceNetSetsockopt(client->ctrl_sockfd, SCE_NET_SOL_SOCKET, SCE_NET_SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	conn.client = client;
+	conn.len = 0;
+	conn.buf = malloc(HTTP_HEADER_MAX + 1);
+	conn.scratch = malloc(sizeof(*conn.scratch));
+
+	while (conn.buf && conn.scratch) {
+		ret = http_read_request(&conn);
+		if (ret <= 0)
+			break;
+
+		activity_touch();
+		INFO("\t%i> %.*s\n", client->num, (int)(strchr(conn.buf, '\r') - conn.buf), conn.buf);
+
+		trace_start = trace_begin();
+		http_handle_request(&conn);
+		trace_end(TRACE_CMD, "HTTP", client, trace_start);
+
+		/* Keep anything pipelined after this request */
+		memmove(conn.buf, conn.buf + ret, conn.len - ret);
+		conn.len -= ret;
+
+		if (!conn.keep_alive)
+			break;
+	}
+
+	client_list_delete(client);
+
+	free(conn.scratch);
+	free(conn.buf);
+	sceNetSocketClose(client->ctrl_sockfd);
+
+	DEBUG("HTTP client thread %i exiting!\n", client->num);
+
+	free(client);
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+static int http_server_thread(SceSize args, void *argp)
+{
+	SceNetSockaddrIn serveraddr;
+	SceNetSockaddrIn clientaddr;
+	unsigned int addrlen;
+	int client_sockfd;
+	int ret;
+	UNUSED(ret);
+
+	DEBUG("HTTP server thread started!\n");
+
+	serveraddr.sin_family = SCE_NET_AF_INET;
+	serveraddr.sin_addr.s_addr = sceNetHtonl(SCE_NET_INADDR_ANY);
+	serveraddr.sin_port = sceNetHtons(http_port);
+
+	ret = sceNetBind(http_server_sockfd, (SceNetSockaddr *)&serveraddr, sizeof(serveraddr));
+	DEBUG("HTTP sceNetBind(): 0x%08X\n", ret);
+
+	ret = sceNetListen(http_server_sockfd, 128);
+	DEBUG("HTTP sceNetListen(): 0x%08X\n", ret);
+
+	while (1) {
+		addrlen = sizeof(clientaddr);
+		client_sockfd = sceNetAccept(http_server_sockfd, (SceNetSockaddr *)&clientaddr, &addrlen);
+		if (client_sockfd < 0) {
+			DEBUG("HTTP server socket closed, 0x%08X\n", client_sockfd);
+			if (net_listening)
+				sceKernelSetEventFlag(net_evf, NET_EVENT_LISTEN_FAILED);
+			break;
+		}
+
+		if (session_reserve() < 0) {
+			INFO("Session limit reached, rejecting HTTP client\n");
+			sceNetSend(client_sockfd, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+				strlen("HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"), 0);
+			sceNetSocketClose(client_sockfd);
+			continue;
+		}
+
+		client_spawn(client_sockfd, &clientaddr, http_client_thread, "http", HTTP_CLIENT_STACK_SIZE);
+	}
+
+	DEBUG("HTTP server thread exiting!\n");
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+static void net_listen_start(void)
+{
+	server_sockfd = sceNetSocket("FTPVita_server_sock", SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, 0);
+	DEBUG("Server socket fd: %d\n", server_sockfd);
+	server_thid = sceKernelCreateThread("FTPVita_server_thread",
+		server_thread, FTP_THREAD_PRIORITY, FTP_THREAD_STACK_SIZE, 0, 0, NULL);
+	DEBUG("Server thread UID: 0x%08X\n", server_thid);
+
+	if (http_port) {
+		http_server_sockfd = sceNetSocket("FTPVita_http_sock", SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, 0);
+		http_server_thid = sceKernelCreateThread("FTPVita_http_thread",
+			http_server_thread, FTP_THREAD_PRIORITY, FTP_THREAD_STACK_SIZE, 0, 0, NULL);
+		DEBUG("HTTP server thread UID: 0x%08X\n", http_server_thid);
+	}
+
+	net_listening = 1;
+	sceKernelStartThread(server_thid, 0, NULL);
+	if (http_server_thid >= 0)
+		sceKernelStartThread(http_server_thid, 0, NULL);
+}
+
+static void net_listen_stop(void)
+{
+	if (!net_listening)
+		return;
+	net_listening = 0;
+
+	/* In order to "stop" the blocking sceNetAccept,
+	 * we have to close the server socket; this way
+	 * the accept call will return an error */
+	sceNetSocketClose(server_sockfd);
+	sceKernelWaitThreadEnd(server_thid, NULL, NULL);
+	server_sockfd = -1;
+	server_thid = -1;
+
+	if (http_server_thid >= 0) {
+		sceNetSocketClose(http_server_sockfd);
+		sceKernelWaitThreadEnd(http_server_thid, NULL, NULL);
+		http_server_sockfd = -1;
+		http_server_thid = -1;
 	}
+}
 
-	/* Close the client's socket */
-	sceNetSocketClose(client->ctrl_sockfd);
+static void pasv_pool_close(void)
+{
+	int i;
 
-	/* If there's an open data connection, close it */
-	if (client->data_con_type != FTP_DATA_CONNECTION_NONE) {
-		sceNetSocketClose(client->data_sockfd);
-		if (client->data_con_type == FTP_DATA_CONNECTION_PASSIVE) {
-			sceNetSocketClose(client->pasv_sockfd);
+	sceKernelLockMutex(pasv_pool_mtx, 1, NULL);
+	for (i = 0; i < MAX_PASV_LISTENERS; i++) {
+		if (pasv_pool[i].sockfd >= 0) {
+			sceNetSocketClose(pasv_pool[i].sockfd);
+			pasv_pool[i].sockfd = -1;
 		}
+		pasv_pool[i].owner = NULL;
 	}
+	sceKernelUnlockMutex(pasv_pool_mtx, 1);
+}
 
-	DEBUG("Client thread %i exiting!\n", client->num);
-
-	free(client);
-
-	sceKernelExitDeleteThread(0);
-	return 0;
+/* Sockets don't survive a lost link or a suspend, the sessions are ended
+ * right away so clients see the disconnect and can reconnect */
+static void net_down(void)
+{
+	net_listen_stop();
+	client_list_thread_end();
+	pasv_pool_close();
 }
 
-static int server_thread(SceSize args, void *argp)
+static void net_update(void)
 {
-	int ret;
-	UNUSED(ret);
+	SceNetCtlInfo info;
+	SceNetInAddr addr;
+	int state;
+
+	if (sceNetCtlInetGetState(&state) < 0 || state != SCE_NET_CTL_STATE_IPOBTAINED ||
+	    sceNetCtlInetGetInfo(SCE_NET_CTL_INFO_IP_ADDRESS, &info) < 0) {
+		if (net_listening) {
+			NOTIFICATION("Network lost, closing all sessions\n");
+			net_down();
+		}
+		return;
+	}
 
-	SceNetSockaddrIn serveraddr;
+	sceNetInetPton(SCE_NET_AF_INET, info.ip_address, &addr);
 
-	DEBUG("Server thread started!\n");
+	/* Connections made to the old address are gone */
+	if (net_listening && addr.s_addr != vita_addr.s_addr) {
+		INFO("IP address changed to %s\n", info.ip_address);
+		net_down();
+	}
 
-	/* Create server socket */
-	server_sockfd = sceNetSocket("FTPVita_server_sock",
-		SCE_NET_AF_INET,
-		SCE_NET_SOCK_STREAM,
-		0);
+	vita_addr = addr;
 
-	DEBUG("Server socket fd: %d\n", server_sockfd);
+	if (!net_listening) {
+		INFO("Listening on %s:%u\n", info.ip_address, ftp_port);
+		net_listen_start();
+		if (addr_cb)
+			addr_cb(info.ip_address, ftp_port);
+	}
+}
 
-	/* Fill the server's address */
-	serveraddr.sin_family = SCE_NET_AF_INET;
-	serveraddr.sin_addr.s_addr = sceNetHtonl(SCE_NET_INADDR_ANY);
-	serveraddr.sin_port = sceNetHtons(FTP_PORT);
+static void *net_ctl_callback(int event_type, void *arg)
+{
+	DEBUG("netctl event %i\n", event_type);
+	sceKernelSetEventFlag(net_evf, NET_EVENT_CHANGED);
+	return NULL;
+}
 
-	/* Bind the server's address to the socket */
-	ret = sceNetBind(server_sockfd, (SceNetSockaddr *)&serveraddr, sizeof(serveraddr));
-	DEBUG("sceNetBind(): 0x%08X\n", ret);
+static int net_thread(SceSize args, void *argp)
+{
+	unsigned int timeout;
+	unsigned int bits;
+	int ret;
 
-	/* Start listening */
-	ret = sceNetListen(server_sockfd, 128);
-	DEBUG("sceNetListen(): 0x%08X\n", ret);
+	ret = sceNetCtlInetRegisterCallback(net_ctl_callback, NULL, &netctl_cid);
+	DEBUG("sceNetCtlInetRegisterCallback(): 0x%08X\n", ret);
 
-	while (1) {
-		/* Accept clients */
-		SceNetSockaddrIn clientaddr;
-		int client_sockfd;
-		unsigned int addrlen = sizeof(clientaddr);
+	/* The state before the callback was registered */
+	net_update();
 
-		DEBUG("Waiting for incoming connections...\n");
+	while (net_thread_run) {
+		sceNetCtlCheckCallback();
 
-		client_sockfd = sceNetAccept(server_sockfd, (SceNetSockaddr *)&clientaddr, &addrlen);
-		if (client_sockfd >= 0) {
-			DEBUG("New connection, client fd: 0x%08X\n", client_sockfd);
+		timeout = NET_CHECK_INTERVAL;
+		bits = 0;
+		ret = sceKernelWaitEventFlag(net_evf, NET_EVENT_CHANGED | NET_EVENT_LISTEN_FAILED | NET_EVENT_STOP,
+			SCE_KERNEL_EVF_WAITMODE_OR | SCE_KERNEL_EVF_WAITMODE_CLEAR_ALL, &bits, &timeout);
+		if (ret < 0 || (bits & NET_EVENT_STOP))
+			continue;
 
-			/* Get the client's IP address */
-			char remote_ip[16];
-			sceNetInetNtop(SCE_NET_AF_INET,
-				&clientaddr.sin_addr.s_addr,
-				remote_ip,
-				sizeof(remote_ip));
-
-			INFO("Client %i connected, IP: %s port: %i\n",
-				number_clients, remote_ip, clientaddr.sin_port);
-
-			/* Create a new thread for the client */
-			char client_thread_name[64];
-			sprintf(client_thread_name, "FTPVita_client_%i_thread",
-				number_clients);
-
-			SceUID client_thid = sceKernelCreateThread(
-				client_thread_name, client_thread,
-				0x10000100, 0x10000, 0, 0, NULL);
-
-			DEBUG("Client %i thread UID: 0x%08X\n", number_clients, client_thid);
-
-			/* Allocate the ftpvita_client_info_t struct for the new client */
-			ftpvita_client_info_t *client = malloc(sizeof(*client));
-			client->num = number_clients;
-			client->thid = client_thid;
-			client->ctrl_sockfd = client_sockfd;
-			client->data_con_type = FTP_DATA_CONNECTION_NONE;
-			strcpy(client->cur_path, FTP_DEFAULT_PATH);
-			memcpy(&client->addr, &clientaddr, sizeof(client->addr));
-
-			/* Add the new client to the client list */
-			client_list_add(client);
-
-			/* Start the client thread */
-			sceKernelStartThread(client_thid, sizeof(client), &client);
-		} else {
-			/* if sceNetAccept returns < 0, it means that the listening
-			 * socket has been closed, this means that we want to
-			 * finish the server thread */
-			DEBUG("Server socket closed, 0x%08X\n", client_sockfd);
-			break;
+		if (bits & NET_EVENT_LISTEN_FAILED) {
+			/* The link may still be reported up for a moment
+			 * after the sockets died */
+			INFO("Listening socket failed, rebinding\n");
+			net_down();
+			sceKernelDelayThread(NET_RETRY_DELAY);
 		}
+
+		net_update();
 	}
 
-	DEBUG("Server thread exiting!\n");
+	if (netctl_cid >= 0) {
+		sceNetCtlInetUnregisterCallback(netctl_cid);
+		netctl_cid = -1;
+	}
 
 	sceKernelExitDeleteThread(0);
 	return 0;
@@ -1096,16 +6873,20 @@ int ftpvita_init(char *vita_ip, unsigned short *vita_port)
 		return -1;
 	}
 
+	/* Start the log drain thread first, records logged so far are
+	 * waiting in the ring */
+	log_start();
+
 	/* Init Net */
 	ret = sceNetShowNetstat();
 	if (ret == 0) {
 		DEBUG("Net is already initialized.\n");
 		net_init = -1;
 	} else if (ret == SCE_NET_ERROR_ENOTINIT) {
-		net_memory = malloc(NET_INIT_SIZE);
+		net_memory = malloc(net_init_size);
 
 		initparam.memory = net_memory;
-		initparam.size = NET_INIT_SIZE;
+		initparam.size = net_init_size;
 		initparam.flags = 0;
 
 		ret = net_init = sceNetInit(&initparam);
@@ -1123,53 +6904,118 @@ int ftpvita_init(char *vita_ip, unsigned short *vita_port)
 	if (netctl_init < 0 && netctl_init != NET_CTL_ERROR_NOT_TERMINATED)
 		goto error_netctlinit;
 
-	sceNetCtlInetGetState(&ret);
-
-	while (ret != SCE_NET_CTL_STATE_IPOBTAINED) {
-		sceNetCtlInetGetState(&ret);
-		sceKernelDelayThread(10000);
-	}
-
-	/* Get IP address */
-	ret = sceNetCtlInetGetInfo(SCE_NET_CTL_INFO_IP_ADDRESS, &info);
-	DEBUG("sceNetCtlInetGetInfo(): 0x%08X\n", ret);
-	if (ret < 0)
-		goto error_netctlgetinfo;
-
-	/* Return data */
-	strcpy(vita_ip, info.ip_address);
-	*vita_port = FTP_PORT;
-
-	/* Save the IP of PSVita to a global variable */
-	sceNetInetPton(SCE_NET_AF_INET, info.ip_address, &vita_addr);
-
-	/* Create server thread */
-	server_thid = sceKernelCreateThread("FTPVita_server_thread",
-		server_thread, 0x10000100, 0x10000, 0, 0, NULL);
-	DEBUG("Server thread UID: 0x%08X\n", server_thid);
+	/* Return data, the IP is empty if the network isn't up yet, the
+	 * address callback reports it once it is */
+	vita_ip[0] = '\0';
+	if (sceNetCtlInetGetState(&ret) >= 0 && ret == SCE_NET_CTL_STATE_IPOBTAINED &&
+	    sceNetCtlInetGetInfo(SCE_NET_CTL_INFO_IP_ADDRESS, &info) >= 0)
+		strcpy(vita_ip, info.ip_address);
+	*vita_port = ftp_port;
+
+	/* Create the network thread, it starts the listeners */
+	net_evf = sceKernelCreateEventFlag("FTPVita_net_evf", 0, 0, NULL);
+	net_thid = sceKernelCreateThread("FTPVita_net_thread",
+		net_thread, NET_THREAD_PRIORITY, 0x2000, 0, 0, NULL);
+	DEBUG("Net thread UID: 0x%08X\n", net_thid);
+
+	/* Create the load probe thread, it runs above the transfer threads
+	 * on the user cores, where a game would compete with them */
+	memset(&load_stats, 0, sizeof(load_stats));
+	load_stats.state = FTPVITA_LOAD_CONTENDED;
+	load_stamp = sceKernelGetProcessTimeWide();
+	load_sema = sceKernelCreateSema("FTPVita_load_sema", 0, 0, 1, NULL);
+	load_thid = sceKernelCreateThread("FTPVita_load_thread",
+		load_thread, FTP_THREAD_PRIORITY_BOOST - 1, 0x1000, 0, FTP_CPU_MASK_USER, NULL);
+	DEBUG("Load probe thread UID: 0x%08X\n", load_thid);
+
+	/* Create the trace statistics mutex */
+	trace_mtx = sceKernelCreateMutex("FTPVita_trace_mutex", 0, 0, NULL);
+	DEBUG("Trace mutex UID: 0x%08X\n", trace_mtx);
 
 	/* Create the client list mutex */
 	client_list_mtx = sceKernelCreateMutex("FTPVita_client_list_mutex", 0, 0, NULL);
 	DEBUG("Client list mutex UID: 0x%08X\n", client_list_mtx);
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		session_slots[i].used = 0;
+		session_slots[i].thid = -1;
+		session_slots[i].client = NULL;
+	}
+	number_clients = 0;
+
+	/* Create the PASV listener pool mutex */
+	pasv_pool_mtx = sceKernelCreateMutex("FTPVita_pasv_pool_mutex", 0, 0, NULL);
+	DEBUG("PASV pool mutex UID: 0x%08X\n", pasv_pool_mtx);
+	for (i = 0; i < MAX_PASV_LISTENERS; i++) {
+		pasv_pool[i].sockfd = -1;
+		pasv_pool[i].owner = NULL;
+	}
 
-	/* Init device list */
+	/* Create the activity event flag */
+	activity_evf = sceKernelCreateEventFlag("FTPVita_activity_evf", 0, 0, NULL);
+	DEBUG("Activity event flag UID: 0x%08X\n", activity_evf);
+	last_activity = sceKernelGetProcessTimeWide();
+
+	/* Create the upload journal mutex, partial uploads left by the last
+	 * run can be resumed */
+	journal_mtx = sceKernelCreateMutex("FTPVita_journal_mutex", 0, 0, NULL);
+	DEBUG("Journal mutex UID: 0x%08X\n", journal_mtx);
+	journal_load();
+
+	/* Create the SITE DU cache mutex */
+	du_cache_mtx = sceKernelCreateMutex("FTPVita_du_cache_mutex", 0, 0, NULL);
+	DEBUG("DU cache mutex UID: 0x%08X\n", du_cache_mtx);
+
+	/* Create the filename index thread, it crawls the devices in the
+	 * background below the transfer threads */
+	fidx_mtx = sceKernelCreateMutex("FTPVita_fidx_mutex", 0, 0, NULL);
+	fidx_sema = sceKernelCreateSema("FTPVita_fidx_sema", 0, 0, 1, NULL);
+	fidx_thid = sceKernelCreateThread("FTPVita_fidx_thread",
+		fidx_thread, FIDX_THREAD_PRIORITY, 0x2000, 0, 0, NULL);
+	DEBUG("Filename index thread UID: 0x%08X\n", fidx_thid);
+
+	/* Create the prefetch thread, it reads ahead below the transfer threads */
+	memset(prefetch, 0, sizeof(prefetch));
+	prefetch_mtx = sceKernelCreateMutex("FTPVita_prefetch_mutex", 0, 0, NULL);
+	prefetch_sema = sceKernelCreateSema("FTPVita_prefetch_sema", 0, 0, MAX_SESSIONS, NULL);
+	prefetch_thid = sceKernelCreateThread("FTPVita_prefetch_thread",
+		prefetch_thread, PREFETCH_THREAD_PRIORITY, 0x2000, 0, 0, NULL);
+	DEBUG("Prefetch thread UID: 0x%08X\n", prefetch_thid);
+
+	/* Create the transfer scheduler mutex */
+	sched_mtx = sceKernelCreateMutex("FTPVita_sched_mutex", 0, 0, NULL);
+	DEBUG("Scheduler mutex UID: 0x%08X\n", sched_mtx);
+	sched_total_weight = 0;
+	sched_interactive_count = 0;
+	sched_xfer_count = 0;
+	sched_other_count = 0;
+	sched_other_weight = 0;
 	for (i = 0; i < MAX_DEVICES; i++) {
-		device_list[i].valid = 0;
+		device_list[i].io_active = 0;
+		device_list[i].io_waiting = 0;
+		device_list[i].xfer_count = 0;
+		device_list[i].xfer_weight = 0;
 	}
+	device_evf = sceKernelCreateEventFlag("FTPVita_device_evf", SCE_KERNEL_EVF_ATTR_MULTI, 0, NULL);
+	DEBUG("Device event flag UID: 0x%08X\n", device_evf);
 
-	for (i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
-		custom_command_dispatchers[i].valid = 0;
-	}
+	/* Start the network thread */
+	net_thread_run = 1;
+	sceKernelStartThread(net_thid, 0, NULL);
 
-	/* Start the server thread */
-	sceKernelStartThread(server_thid, 0, NULL);
+	load_thread_run = 1;
+	sceKernelStartThread(load_thid, 0, NULL);
+
+	fidx_thread_run = 1;
+	sceKernelStartThread(fidx_thid, 0, NULL);
+
+	prefetch_thread_run = 1;
+	sceKernelStartThread(prefetch_thid, 0, NULL);
 
 	ftp_initialized = 1;
 
 	return 0;
 
 error_netctlinit:
-error_netctlgetinfo:
 error_netinit:
 error_netstat:
 	if (net_init == 0) {
@@ -1185,30 +7031,82 @@ error_netstat:
 		net_memory = NULL;
 	}
 
+	log_stop();
+
 	return ret;
 }
 
 void ftpvita_fini()
 {
-	if (ftp_initialized) {
-		/* In order to "stop" the blocking sceNetAccept,
-		 * we have to close the server socket; this way
-		 * the accept call will return an error */
-		sceNetSocketClose(server_sockfd);
+	int i;
 
-		/* Wait until the server threads ends */
-		sceKernelWaitThreadEnd(server_thid, NULL, NULL);
+	if (ftp_initialized) {
+		/* Stop following the network state first, then the listeners */
+		net_thread_run = 0;
+		sceKernelSetEventFlag(net_evf, NET_EVENT_STOP);
+		sceKernelWaitThreadEnd(net_thid, NULL, NULL);
+		sceKernelDeleteEventFlag(net_evf);
+		net_listen_stop();
+
+		/* Stop the load probe */
+		load_thread_run = 0;
+		sceKernelSignalSema(load_sema, 1);
+		sceKernelWaitThreadEnd(load_thid, NULL, NULL);
+		sceKernelDeleteSema(load_sema);
 
 		/* To close the clients we have to do the same:
 		 * we have to iterate over all the clients
 		 * and shutdown their sockets */
 		client_list_thread_end();
 
+		/* Stop the prefetch thread, the sessions released their heads */
+		prefetch_thread_run = 0;
+		sceKernelSignalSema(prefetch_sema, 1);
+		sceKernelWaitThreadEnd(prefetch_thid, NULL, NULL);
+		sceKernelDeleteSema(prefetch_sema);
+		sceKernelDeleteMutex(prefetch_mtx);
+
+		/* Stop the index thread, it saves the indexes on the way out */
+		fidx_thread_run = 0;
+		sceKernelSignalSema(fidx_sema, 1);
+		sceKernelWaitThreadEnd(fidx_thid, NULL, NULL);
+		sceKernelDeleteSema(fidx_sema);
+		sceKernelDeleteMutex(fidx_mtx);
+		for (i = 0; i < MAX_DEVICES; i++) {
+			if (fidx_list[i]) {
+				fidx_free(fidx_list[i]);
+				fidx_list[i] = NULL;
+			}
+		}
+
+		/* Close the PASV listeners */
+		pasv_pool_close();
+		sceKernelDeleteMutex(pasv_pool_mtx);
+
 		/* Delete the client list mutex */
 		sceKernelDeleteMutex(client_list_mtx);
+		sceKernelDeleteMutex(sched_mtx);
+		sceKernelDeleteEventFlag(device_evf);
+		sceKernelDeleteMutex(du_cache_mtx);
+		sceKernelDeleteMutex(journal_mtx);
+		sceKernelDeleteMutex(trace_mtx);
+		du_cache_clear();
+		sceKernelDeleteEventFlag(activity_evf);
+
+		/* Devices and extensions can be registered before ftpvita_init(),
+		 * so they are reset here instead */
+		for (i = 0; i < MAX_DEVICES; i++) {
+			device_list[i].valid = 0;
+		}
 
-		client_list = NULL;
-		number_clients = 0;
+		for (i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
+			custom_command_dispatchers[i].valid = 0;
+			custom_site_dispatchers[i].valid = 0;
+		}
+
+		for (i = 0; i < MAX_CUSTOM_TUNABLES; i++) {
+			custom_tunables[i].valid = 0;
+		}
 
 		if (netctl_init == 0)
 			sceNetCtlTerm();
@@ -1221,6 +7119,9 @@ void ftpvita_fini()
 		net_init = -1;
 		net_memory = NULL;
 		ftp_initialized = 0;
+
+		/* Flush everything logged during shutdown */
+		log_stop();
 	}
 }
 
@@ -1232,9 +7133,13 @@ int ftpvita_is_initialized()
 int ftpvita_add_device(const char *devname)
 {
 	int i;
+	if (strlen(devname) >= MAX_DEVNAME)
+		return 0;
+
 	for (i = 0; i < MAX_DEVICES; i++) {
 		if (!device_list[i].valid) {
 			strcpy(device_list[i].name, devname);
+			device_list[i].io_slots = DEFAULT_DEVICE_IO_SLOTS;
 			device_list[i].valid = 1;
 			return 1;
 		}
@@ -1254,24 +7159,217 @@ int ftpvita_del_device(const char *devname)
 	return 0;
 }
 
+int ftpvita_set_device_io_slots(const char *devname, unsigned int slots)
+{
+	int i;
+
+	if (slots > MAX_SESSIONS)
+		return 0;
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (device_list[i].valid && strcmp(devname, device_list[i].name) == 0) {
+			/* Queued transfers check the new limit when woken up */
+			device_list[i].io_slots = slots;
+			if (ftp_initialized)
+				sceKernelSetEventFlag(device_evf, 1u << i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void ftpvita_set_log_file(const char *path)
+{
+	if (path)
+		snprintf(log_path, sizeof(log_path), "%s", path);
+	else
+		log_path[0] = '\0';
+}
+
+void ftpvita_set_upload_journal(const char *path)
+{
+	if (path)
+		snprintf(journal_path, sizeof(journal_path), "%s", path);
+	else
+		journal_path[0] = '\0';
+}
+
+void ftpvita_set_index_dir(const char *path)
+{
+	if (path)
+		snprintf(fidx_dir, sizeof(fidx_dir), "%s", path);
+	else
+		fidx_dir[0] = '\0';
+}
+
 void ftpvita_set_notif_log_cb(ftpvita_log_cb_t cb)
 {
-	notif_log_cb = cb;
+	log_cbs[LOG_LEVEL_NOTIF] = cb;
 }
 
 void ftpvita_set_info_log_cb(ftpvita_log_cb_t cb)
 {
-	info_log_cb = cb;
+	log_cbs[LOG_LEVEL_INFO] = cb;
 }
 
 void ftpvita_set_debug_log_cb(ftpvita_log_cb_t cb)
 {
-	debug_log_cb = cb;
+	log_cbs[LOG_LEVEL_DEBUG] = cb;
+}
+
+void ftpvita_set_xfer_cb(ftpvita_xfer_cb_t cb)
+{
+	xfer_cb = cb;
+}
+
+void ftpvita_set_addr_cb(ftpvita_addr_cb_t cb)
+{
+	addr_cb = cb;
 }
 
 void ftpvita_set_file_buf_size(unsigned int size)
 {
 	file_buf_size = size;
+	config_generation++;
+}
+
+int ftpvita_get_device_count()
+{
+	int i;
+	int count = 0;
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (device_list[i].valid)
+			count++;
+	}
+	return count;
+}
+
+int ftpvita_load_config(const char *path)
+{
+	SceUID fd;
+	int size;
+	int applied = 0;
+	unsigned int slots;
+	char *buf, *line, *next, *value, *end;
+
+	if ((fd = sceIoOpen(path, SCE_O_RDONLY, 0)) < 0)
+		return fd;
+
+	buf = malloc(MAX_CONFIG_SIZE + 1);
+	if (buf == NULL) {
+		sceIoClose(fd);
+		return -1;
+	}
+
+	size = sceIoRead(fd, buf, MAX_CONFIG_SIZE);
+	sceIoClose(fd);
+	if (size < 0) {
+		free(buf);
+		return size;
+	}
+	buf[size] = '\0';
+
+	for (line = buf; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		/* Strip comments and surrounding whitespace */
+		if ((end = strchr(line, '#')))
+			*end = '\0';
+		while (*line == ' ' || *line == '\t')
+			line++;
+		if ((value = strchr(line, '=')) == NULL)
+			continue;
+		*value++ = '\0';
+		while (*value == ' ' || *value == '\t')
+			value++;
+		for (end = value + strlen(value); end > value && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'); end--)
+			end[-1] = '\0';
+		for (end = line + strlen(line); end > line && (end[-1] == ' ' || end[-1] == '\t'); end--)
+			end[-1] = '\0';
+
+		if (strcmp(line, "device") == 0) {
+			/* device = <name> [<concurrent transfers>] */
+			slots = DEFAULT_DEVICE_IO_SLOTS;
+			if ((end = strpbrk(value, " \t"))) {
+				*end++ = '\0';
+				if (tunable_parse(end, &slots) < 0 || slots > MAX_SESSIONS) {
+					INFO("Config: bad setting %s = %s %s\n", line, value, end);
+					continue;
+				}
+			}
+			if (ftpvita_add_device(value) && ftpvita_set_device_io_slots(value, slots))
+				applied++;
+		} else if (tunable_set(line, value) == 0) {
+			applied++;
+		} else {
+			INFO("Config: bad setting %s = %s\n", line, value);
+		}
+	}
+
+	free(buf);
+
+	return applied;
+}
+
+void ftpvita_set_max_sessions(unsigned int sessions)
+{
+	/* Applies to new connections only */
+	max_sessions = sessions;
+}
+
+void ftpvita_set_pasv_port_range(unsigned short min_port, unsigned short max_port)
+{
+	if (min_port == 0 || max_port < min_port)
+		return;
+
+	pasv_port_min = min_port;
+	pasv_port_max = max_port;
+	pasv_pool_trim();
+}
+
+void ftpvita_get_sched_stats(ftpvita_sched_stats_t *stats)
+{
+	sceKernelLockMutex(sched_mtx, 1, NULL);
+	memcpy(stats, &load_stats, sizeof(*stats));
+	/* Account the time spent in the current state so far */
+	stats->time_us[stats->state] += sceKernelGetProcessTimeWide() - load_stamp;
+	sceKernelUnlockMutex(sched_mtx, 1);
+}
+
+void ftpvita_get_activity(ftpvita_activity_t *activity)
+{
+	activity->sessions = number_clients;
+	activity->transfers = sched_xfer_count;
+	activity->idle_us = sceKernelGetProcessTimeWide() - last_activity;
+	activity->wakeups = activity_wakeups;
+}
+
+int ftpvita_wait_activity(unsigned int timeout_us)
+{
+	int ret;
+	SceUInt32 pattern;
+	SceUInt32 timeout = timeout_us;
+
+	if (!ftp_initialized)
+		return -1;
+
+	ret = sceKernelWaitEventFlag(activity_evf, ACTIVITY_EVENT,
+		SCE_KERNEL_EVF_WAITMODE_OR | SCE_KERNEL_EVF_WAITMODE_CLEAR_ALL,
+		&pattern, timeout_us ? &timeout : NULL);
+	activity_wakeups++;
+
+	if (ret == SCE_KERNEL_ERROR_WAIT_TIMEOUT)
+		return 0;
+	return ret < 0 ? ret : 1;
+}
+
+void ftpvita_set_rate_limits(unsigned int global_rate, unsigned int session_rate)
+{
+	/* Picked up by the running transfers at their next buffer */
+	global_bucket.rate = global_rate;
+	session_rate_limit = session_rate;
 }
 
 int ftpvita_ext_add_custom_command(const char *cmd, cmd_dispatch_func func)
@@ -1300,6 +7398,50 @@ int ftpvita_ext_del_custom_command(const char *cmd)
 	return 0;
 }
 
+int ftpvita_ext_add_site_command(const char *cmd, cmd_dispatch_func func)
+{
+	int i;
+	for (i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
+		if (!custom_site_dispatchers[i].valid) {
+			custom_site_dispatchers[i].cmd = cmd;
+			custom_site_dispatchers[i].func = func;
+			custom_site_dispatchers[i].valid = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int ftpvita_ext_del_site_command(const char *cmd)
+{
+	int i;
+	for (i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
+		if (custom_site_dispatchers[i].valid && strcmp(cmd, custom_site_dispatchers[i].cmd) == 0) {
+			custom_site_dispatchers[i].valid = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int ftpvita_ext_add_tunable(const char *name, unsigned int *value, unsigned int min, unsigned int max)
+{
+	int i;
+	for (i = 0; i < MAX_CUSTOM_TUNABLES; i++) {
+		if (!custom_tunables[i].valid) {
+			custom_tunables[i].entry.name = name;
+			custom_tunables[i].entry.value = value;
+			custom_tunables[i].entry.min = min;
+			custom_tunables[i].entry.max = max;
+			custom_tunables[i].entry.flags = 0;
+			custom_tunables[i].entry.apply = NULL;
+			custom_tunables[i].valid = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
 void ftpvita_ext_client_send_ctrl_msg(ftpvita_client_info_t *client, const char *msg)
 {
 	client_send_ctrl_msg(client, msg);
@@ -1309,3 +7451,107 @@ void ftpvita_ext_client_send_data_msg(ftpvita_client_info_t *client, const char
 {
 	client_send_data_msg(client, str);
 }
+
+int ftpvita_ext_open_data(ftpvita_client_info_t *client, SceOff size_hint)
+{
+	if (client->data_con_type == FTP_DATA_CONNECTION_NONE) {
+		client_send_ctrl_msg(client, "425 Use PORT or PASV first." FTPVITA_EOL);
+		return -1;
+	}
+
+	sched_xfer_begin(client, size_hint > 0 && size_hint <= interactive_xfer_size ?
+		FTP_XFER_INTERACTIVE : FTP_XFER_BULK);
+
+	client_open_data_connection(client);
+	if (client->data_error) {
+		sched_xfer_end(client);
+		client_release_data(client);
+		client_send_ctrl_msg(client, "425 Can't open data connection." FTPVITA_EOL);
+		return -1;
+	}
+
+	return 0;
+}
+
+void ftpvita_ext_close_data(ftpvita_client_info_t *client, int ok)
+{
+	sched_xfer_end(client);
+
+	if (ok && !client->data_error) {
+		client_send_data_eof(client);
+		client_close_data_connection(client);
+		client_send_transfer_complete(client);
+	} else {
+		client_close_data_connection(client);
+		client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPVITA_EOL);
+	}
+}
+
+void *ftpvita_ext_lease_buffer(ftpvita_client_info_t *client, SceOff size_hint, unsigned int *size)
+{
+	void *buf;
+
+	*size = sched_buf_size(client, size_hint);
+	if ((buf = xfer_buf_alloc(*size)) == NULL)
+		*size = 0;
+
+	return buf;
+}
+
+void ftpvita_ext_release_buffer(void *buf, unsigned int size)
+{
+	if (buf)
+		xfer_buf_free(buf, size);
+}
+
+int ftpvita_ext_send_data(ftpvita_client_info_t *client, const void *buf, unsigned int len)
+{
+	SceUInt64 trace_start;
+	int ret;
+
+	if (client->data_error)
+		return -1;
+
+	sched_wait(client);
+	trace_start = trace_begin();
+	ret = client_send_data_raw(client, buf, len);
+	trace_end(TRACE_XFER, "send", client, trace_start);
+	if (ret < 0)
+		return ret;
+	sched_account(client, len);
+
+	return ret;
+}
+
+int ftpvita_ext_recv_data(ftpvita_client_info_t *client, void *buf, unsigned int len)
+{
+	SceUInt64 trace_start;
+	int ret;
+
+	if (client->data_error)
+		return -1;
+
+	sched_wait(client);
+	trace_start = trace_begin();
+	ret = client_recv_data_raw(client, buf, len);
+	trace_end(TRACE_XFER, "recv", client, trace_start);
+	if (ret < 0)
+		client->data_error = 1;
+	else if (ret > 0)
+		sched_account(client, ret);
+
+	return ret;
+}
+
+void ftpvita_ext_get_progress(ftpvita_client_info_t *client, SceOff *bytes, SceUInt64 *elapsed_us)
+{
+	if (bytes)
+		*bytes = client->xfer_bytes;
+	if (elapsed_us)
+		*elapsed_us = sceKernelGetProcessTimeWide() - client->xfer_start;
+}
+
+int ftpvita_ext_is_cancelled(ftpvita_client_info_t *client)
+{
+	return client->data_error || sessions_closing || !ftp_initialized;
+}
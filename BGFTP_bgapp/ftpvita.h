@@ -12,18 +12,100 @@
 #define PATH_MAX 4096
 #endif
 
+/* Longest path accepted from clients, the PSVita's own limit */
+#define FTPVITA_PATH_MAX 1024
+/* Shared storage for the current and the rename path of a session */
+#define FTPVITA_SESSION_ARENA_SIZE 1536
+
 typedef void (*ftpvita_log_cb_t)(const char *);
 
-/* Returns PSVita's IP and FTP port. 0 on success */
+typedef enum {
+	FTPVITA_XFER_SENT,
+	FTPVITA_XFER_RECEIVED,
+	FTPVITA_XFER_ABORTED,
+	FTPVITA_XFER_EVENTS
+} ftpvita_xfer_event_t;
+
+/* Called on the transfer thread when a file transfer ends, must not block */
+typedef void (*ftpvita_xfer_cb_t)(ftpvita_xfer_event_t event, const char *name,
+	SceOff bytes, SceUInt64 elapsed_us);
+
+/* Called on the network thread whenever the server starts listening on a
+ * new IP address: at startup, after a reconnect or resume from sleep */
+typedef void (*ftpvita_addr_cb_t)(const char *vita_ip, unsigned short vita_port);
+
+/* Returns PSVita's IP and FTP port without waiting for the network, the IP
+ * is empty if it isn't up yet. 0 on success */
 int ftpvita_init(char *vita_ip, unsigned short *vita_port);
 void ftpvita_fini();
 int ftpvita_is_initialized();
 int ftpvita_add_device(const char *devname);
 int ftpvita_del_device(const char *devname);
+/* Transfers running at once on an added device, more are queued until one
+ * ends. 0 is unlimited, devices start with 1 */
+int ftpvita_set_device_io_slots(const char *devname, unsigned int slots);
+/* Log records up to the log_level setting are appended to this file by a
+ * background thread, it is rotated to <path>.1 at log_file_size bytes */
+void ftpvita_set_log_file(const char *path);
+/* Partial uploads are remembered in this file so they can be resumed
+ * after the application restarts */
+void ftpvita_set_upload_journal(const char *path);
+/* SITE FIND keeps its filename indexes in this directory across restarts */
+void ftpvita_set_index_dir(const char *path);
 void ftpvita_set_notif_log_cb(ftpvita_log_cb_t cb);
 void ftpvita_set_info_log_cb(ftpvita_log_cb_t cb);
 void ftpvita_set_debug_log_cb(ftpvita_log_cb_t cb);
+/* Replaces the per-file notifications */
+void ftpvita_set_xfer_cb(ftpvita_xfer_cb_t cb);
+void ftpvita_set_addr_cb(ftpvita_addr_cb_t cb);
 void ftpvita_set_file_buf_size(unsigned int size);
+/* Rates are in bytes per second, 0 means unlimited */
+void ftpvita_set_rate_limits(unsigned int global_rate, unsigned int session_rate);
+void ftpvita_set_max_sessions(unsigned int max_sessions);
+/* Ports used by the passive mode listener pool */
+void ftpvita_set_pasv_port_range(unsigned short min_port, unsigned short max_port);
+int ftpvita_get_device_count();
+/* Loads "name = value" settings and "device = ux0:" lines, can be
+ * called before ftpvita_init(). Returns the number of applied lines */
+int ftpvita_load_config(const char *path);
+
+typedef enum {
+	FTPVITA_LOAD_IDLE,
+	FTPVITA_LOAD_CONTENDED,
+	FTPVITA_LOAD_STATES
+} ftpvita_load_state_t;
+
+typedef struct {
+	/* Current load state */
+	ftpvita_load_state_t state;
+	/* Average wakeup latency measured by the load probe, in microseconds */
+	unsigned int probe_latency;
+	/* Per load state: time spent in it, bytes transferred and times entered */
+	SceUInt64 time_us[FTPVITA_LOAD_STATES];
+	SceUInt64 bytes[FTPVITA_LOAD_STATES];
+	unsigned int entered[FTPVITA_LOAD_STATES];
+	/* Failed thread priority or affinity changes */
+	unsigned int policy_errors;
+} ftpvita_sched_stats_t;
+
+void ftpvita_get_sched_stats(ftpvita_sched_stats_t *stats);
+
+typedef struct {
+	/* Connected sessions */
+	int sessions;
+	/* Running transfers */
+	int transfers;
+	/* Time since the last command or transferred buffer, in microseconds */
+	SceUInt64 idle_us;
+	/* Returns from ftpvita_wait_activity() */
+	unsigned int wakeups;
+} ftpvita_activity_t;
+
+void ftpvita_get_activity(ftpvita_activity_t *activity);
+/* Blocks until a session connects or disconnects, a transfer starts or ends,
+ * or a command arrives after a quiet period. timeout_us 0 waits forever.
+ * Returns 1 on activity, 0 on timeout, < 0 on error */
+int ftpvita_wait_activity(unsigned int timeout_us);
 
 /* Extended functionality */
 
@@ -35,8 +117,28 @@ typedef enum {
 	FTP_DATA_CONNECTION_PASSIVE,
 } DataConnectionType;
 
+typedef enum {
+	FTP_TRANSFER_MODE_STREAM,
+	FTP_TRANSFER_MODE_BLOCK,
+} TransferMode;
+
+typedef enum {
+	FTP_XFER_NONE,
+	FTP_XFER_INTERACTIVE,
+	FTP_XFER_BULK,
+} TransferClass;
+
+typedef struct {
+	/* Bytes per second, 0 means unlimited */
+	unsigned int rate;
+	/* Available bytes, negative when in debt */
+	SceInt64 tokens;
+	/* Time of the last refill in microseconds */
+	SceUInt64 stamp;
+} ftpvita_token_bucket_t;
+
 typedef struct ftpvita_client_info {
-	/* Client number */
+	/* Session ID, unique while the server runs */
 	int num;
 	/* Thread UID */
 	SceUID thid;
@@ -49,6 +151,20 @@ typedef struct ftpvita_client_info {
 	/* PASV mode client socket */
 	SceNetSockaddrIn pasv_sockaddr;
 	int pasv_sockfd;
+	/* Leased PASV listener, -1 if none. data_sockfd is the
+	 * listener's socket while in passive mode */
+	int pasv_slot;
+	/* MODE B keeps the data connection open between transfers */
+	TransferMode transfer_mode;
+	int data_open;
+	int data_error;
+	/* Set when ABOR ended the transfer, until ABOR is replied to */
+	int xfer_aborted;
+	/* Set while a multi-line reply is being sent */
+	int reply_open;
+	/* MODE B receive state */
+	unsigned int block_remaining;
+	int block_eof;
 	/* Remote client net info */
 	SceNetSockaddrIn addr;
 	/* Receive buffer attributes */
@@ -56,15 +172,24 @@ typedef struct ftpvita_client_info {
 	char recv_buffer[512];
 	/* Points to the character after the first space */
 	const char *recv_cmd_args;
-	/* Current working directory */
-	char cur_path[PATH_MAX];
-	/* Rename path */
-	char rename_path[PATH_MAX];
-	/* Client list */
-	struct ftpvita_client_info *next;
-	struct ftpvita_client_info *prev;
-	/* Offset for transfer resume */
-	unsigned int restore_point;
+	/* Current working directory, in path_arena */
+	char *cur_path;
+	/* Rename path, in path_arena */
+	char *rename_path;
+	/* Offset for transfer resume, negative for APPE */
+	SceOff restore_point;
+	/* Transfer scheduling */
+	TransferClass xfer_class;
+	unsigned int xfer_weight;
+	/* Device whose I/O slot the transfer holds, -1 if none */
+	int xfer_device;
+	unsigned int rate_limit;
+	ftpvita_token_bucket_t bucket;
+	/* Progress of the running or last transfer */
+	SceOff xfer_bytes;
+	SceUInt64 xfer_start;
+	/* Holds cur_path followed by rename_path */
+	char path_arena[FTPVITA_SESSION_ARENA_SIZE];
 } ftpvita_client_info_t;
 
 
@@ -72,7 +197,33 @@ typedef void (*cmd_dispatch_func)(ftpvita_client_info_t *client); // Command han
 
 int ftpvita_ext_add_custom_command(const char *cmd, cmd_dispatch_func func);
 int ftpvita_ext_del_custom_command(const char *cmd);
+/* SITE subcommands, recv_cmd_args points to the subcommand arguments */
+int ftpvita_ext_add_site_command(const char *cmd, cmd_dispatch_func func);
+int ftpvita_ext_del_site_command(const char *cmd);
+/* Exposes an application setting to the config file and SITE SET/GET */
+int ftpvita_ext_add_tunable(const char *name, unsigned int *value, unsigned int min, unsigned int max);
 void ftpvita_ext_client_send_ctrl_msg(ftpvita_client_info_t *client, const char *msg);
 void ftpvita_ext_client_send_data_msg(ftpvita_client_info_t *client, const char *str);
 
+/* Streaming over the data connection, for handlers that send or receive
+ * binary data. The handler replies 150 and then calls open_data, which
+ * replies 425 itself and returns < 0 if there is no data connection.
+ * size_hint is the expected transfer size, 0 if unknown. Every open_data
+ * that returned 0 must be paired with close_data, which replies 226 if ok
+ * is set and the connection didn't fail, 426 otherwise */
+int ftpvita_ext_open_data(ftpvita_client_info_t *client, SceOff size_hint);
+void ftpvita_ext_close_data(ftpvita_client_info_t *client, int ok);
+/* Buffers from the transfer budget, sized like RETR/STOR buffers.
+ * Returns NULL if out of memory */
+void *ftpvita_ext_lease_buffer(ftpvita_client_info_t *client, SceOff size_hint, unsigned int *size);
+void ftpvita_ext_release_buffer(void *buf, unsigned int size);
+/* Rate limited and accounted like RETR/STOR. send returns < 0 on error,
+ * recv returns the received bytes, 0 at the end of the upload, < 0 on error */
+int ftpvita_ext_send_data(ftpvita_client_info_t *client, const void *buf, unsigned int len);
+int ftpvita_ext_recv_data(ftpvita_client_info_t *client, void *buf, unsigned int len);
+void ftpvita_ext_get_progress(ftpvita_client_info_t *client, SceOff *bytes, SceUInt64 *elapsed_us);
+/* Non-zero once the data connection failed or the server is closing the
+ * sessions, the handler should stop and call close_data */
+int ftpvita_ext_is_cancelled(ftpvita_client_info_t *client);
+
 #endif
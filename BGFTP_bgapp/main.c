@@ -2,6 +2,8 @@
  * Copyright (c) 2020 Graphene
  */
 
+#include <stdio.h>
+
 #include <registrymgr.h>
 #include <appmgr.h>
 #include <libsysmodule.h>
@@ -27,6 +29,20 @@ extern unsigned int	sce_process_preload_disabled = (SCE_PROCESS_PRELOAD_DISABLED
 // Libc parameters
 unsigned int	sceLibcHeapSize = 14 * 1024 * 1024;
 
+// Power management parameters
+#define POWER_TICK_INTERVAL		(1000 * 1000)
+#define DEFAULT_IDLE_TIMEOUT	(5 * 60)
+
+#define DATA_DIR			"ur0:data/BGFTP"
+#define CONFIG_PATH			DATA_DIR "/config.txt"
+#define LOG_PATH			DATA_DIR "/ftp.log"
+#define JOURNAL_PATH		DATA_DIR "/uploads.jnl"
+
+static unsigned int	idle_timeout = DEFAULT_IDLE_TIMEOUT;
+static unsigned int	power_ticks = 0;
+static SceUInt64	suspend_held_time = 0;
+static SceUInt64	suspend_released_time = 0;
+
 void sendNotification(const char *text, ...)
 {
 	SceNotificationUtilSendParam param;
@@ -54,16 +70,8 @@ void sendNotification(const char *text, ...)
 	sceNotificationUtilSendNotification(&param);
 }
 
-void ftpvita_init_app()
+void addDefaultDevices()
 {
-	char vita_ip[16];
-	int state;
-	unsigned short vita_port;
-
-	ftpvita_set_file_buf_size(6 * 1024 * 1024);
-
-	ftpvita_init(vita_ip, &vita_port);
-
 	ftpvita_add_device("ux0:");
 	ftpvita_add_device("ur0:");
 	ftpvita_add_device("uma0:");
@@ -82,12 +90,187 @@ void ftpvita_init_app()
 
 	ftpvita_add_device("app0:");
 	ftpvita_add_device("savedata0:");
+}
+
+// Notification dispatcher parameters
+#define DEFAULT_NOTIF_INTERVAL	5
+
+static unsigned int	notif_interval = DEFAULT_NOTIF_INTERVAL;
+static SceUID		notif_evf;
+
+/* Pending batch, updated by the transfer threads with atomics only */
+static volatile int			notif_files[FTPVITA_XFER_EVENTS];
+static volatile SceInt64	notif_bytes;
+static volatile int			notif_batch_start;
+static volatile int			notif_name_lock;
+static char					notif_name[256];
+
+void formatSize(char *buf, SceSize size, SceUInt64 bytes)
+{
+	static const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+	SceUInt64 scaled = bytes * 10;
+	int unit = 0;
+
+	while (scaled >= 1024 * 10 && unit < 4) {
+		scaled /= 1024;
+		unit++;
+	}
+
+	sceClibSnprintf(buf, size, "%u.%u %s", (unsigned int)(scaled / 10), (unsigned int)(scaled % 10), units[unit]);
+}
+
+/* Transfer callback, runs on the transfer threads and never blocks */
+void queueXferNotification(ftpvita_xfer_event_t event, const char *name, SceOff bytes, SceUInt64 elapsed_us)
+{
+	int prev;
+	int start = (int)((sceKernelGetProcessTimeWide() - elapsed_us) / 1000) | 1;
+
+	sceKernelAtomicAddAndGet32(&notif_files[event], 1);
+	sceKernelAtomicAddAndGet64(&notif_bytes, bytes);
+
+	/* Keep the earliest transfer start of the batch for the rate */
+	do {
+		prev = notif_batch_start;
+		if (prev != 0 && prev <= start)
+			break;
+	} while (sceKernelAtomicCompareAndSet32(&notif_batch_start, prev, start) != prev);
+
+	/* The name is only shown for single file batches, skip it if the
+	 * dispatcher is reading it */
+	if (sceKernelAtomicCompareAndSet32(&notif_name_lock, 0, 1) == 0) {
+		strncpy(notif_name, name, sizeof(notif_name) - 1);
+		notif_name_lock = 0;
+	}
+
+	sceKernelSetEventFlag(notif_evf, 1);
+}
+
+int notificationThread(SceSize args, void *argp)
+{
+	static const char *single_fmt[FTPVITA_XFER_EVENTS] = {
+		"Send completed: %s", "Receive completed: %s", "Receive aborted: %s"
+	};
+	int i, total, single, start;
+	int files[FTPVITA_XFER_EVENTS];
+	SceUInt64 bytes, now, elapsed_ms;
+	SceUInt64 last_sent = 0;
+	char name[256];
+	char size_str[32];
+	char rate_str[32];
+
+	while (1) {
+		sceKernelWaitEventFlag(notif_evf, 1, SCE_KERNEL_EVF_WAITMODE_OR | SCE_KERNEL_EVF_WAITMODE_CLEAR_ALL, NULL, NULL);
+
+		/* The first file after a quiet period is shown right away,
+		 * anything after it is collected for the rest of the interval */
+		now = sceKernelGetProcessTimeWide();
+		if (last_sent && now - last_sent < (SceUInt64)notif_interval * 1000000)
+			sceKernelDelayThread((SceUInt32)((SceUInt64)notif_interval * 1000000 - (now - last_sent)));
+
+		total = 0;
+		single = 0;
+		for (i = 0; i < FTPVITA_XFER_EVENTS; i++) {
+			files[i] = sceKernelAtomicGetAndSet32(&notif_files[i], 0);
+			total += files[i];
+			if (files[i])
+				single = i;
+		}
+		bytes = sceKernelAtomicGetAndSet64(&notif_bytes, 0);
+		start = sceKernelAtomicGetAndSet32(&notif_batch_start, 0);
 
+		if (total == 0)
+			continue;
+
+		last_sent = sceKernelGetProcessTimeWide();
+
+		if (total == 1) {
+			while (sceKernelAtomicCompareAndSet32(&notif_name_lock, 0, 1) != 0)
+				sceKernelDelayThread(1000);
+			sceClibSnprintf(name, sizeof(name), "%s", notif_name);
+			notif_name_lock = 0;
+
+			sendNotification(single_fmt[single], name);
+			continue;
+		}
+
+		elapsed_ms = (last_sent / 1000 - (SceUInt32)start) & 0xFFFFFFFF;
+		if (elapsed_ms == 0)
+			elapsed_ms = 1;
+
+		formatSize(size_str, sizeof(size_str), bytes);
+		formatSize(rate_str, sizeof(rate_str), bytes * 1000 / elapsed_ms);
+
+		if (files[FTPVITA_XFER_ABORTED])
+			sendNotification("Sent %i, received %i files, %i aborted\n%s at %s/s",
+				files[FTPVITA_XFER_SENT], files[FTPVITA_XFER_RECEIVED],
+				files[FTPVITA_XFER_ABORTED], size_str, rate_str);
+		else
+			sendNotification("Sent %i, received %i files\n%s at %s/s",
+				files[FTPVITA_XFER_SENT], files[FTPVITA_XFER_RECEIVED], size_str, rate_str);
+	}
+
+	return 0;
+}
+
+void addrChanged(const char *vita_ip, unsigned short vita_port)
+{
 	sendNotification("IP: %s\nPort: %i", vita_ip, vita_port);
 }
 
+void ftpvita_init_app()
+{
+	char vita_ip[16];
+	int state;
+	unsigned short vita_port;
+
+	/* Defaults, overridden by the config file */
+	ftpvita_set_file_buf_size(6 * 1024 * 1024);
+	ftpvita_ext_add_tunable("idle_timeout", &idle_timeout, 0, 24 * 60 * 60);
+	ftpvita_ext_add_tunable("notif_interval", &notif_interval, 0, 60 * 60);
+	ftpvita_load_config(CONFIG_PATH);
+
+	sceIoMkdir(DATA_DIR, 0777);
+	ftpvita_set_log_file(LOG_PATH);
+	ftpvita_set_index_dir(DATA_DIR);
+	ftpvita_set_upload_journal(JOURNAL_PATH);
+
+	/* The address is notified once the network is up, and again
+	 * whenever it changes */
+	ftpvita_set_addr_cb(addrChanged);
+	ftpvita_init(vita_ip, &vita_port);
+
+	if (ftpvita_get_device_count() == 0)
+		addDefaultDevices();
+}
+
+void sitePowerCmd(ftpvita_client_info_t *client)
+{
+	char msg[160];
+	unsigned int timeout;
+	ftpvita_activity_t activity;
+
+	if (sscanf(client->recv_cmd_args, "%u", &timeout) == 1)
+		idle_timeout = timeout;
+
+	ftpvita_get_activity(&activity);
+
+	sceClibSnprintf(msg, sizeof(msg), "211-Idle timeout: %u s, sessions: %i, transfers: %i" FTPVITA_EOL,
+		idle_timeout, activity.sessions, activity.transfers);
+	ftpvita_ext_client_send_ctrl_msg(client, msg);
+	sceClibSnprintf(msg, sizeof(msg), " Wakeups: %u, power ticks: %u" FTPVITA_EOL,
+		activity.wakeups, power_ticks);
+	ftpvita_ext_client_send_ctrl_msg(client, msg);
+	sceClibSnprintf(msg, sizeof(msg), " Suspend held: %llu s, released: %llu s" FTPVITA_EOL,
+		suspend_held_time / 1000000, suspend_released_time / 1000000);
+	ftpvita_ext_client_send_ctrl_msg(client, msg);
+	ftpvita_ext_client_send_ctrl_msg(client, "211 End" FTPVITA_EOL);
+}
+
 int main()
 {
+	ftpvita_activity_t activity;
+	SceUInt64 now, last;
+	int hold;
 	/* BG application*/
 
 	sceSysmoduleLoadModule(SCE_SYSMODULE_NOTIFICATION_UTIL);
@@ -102,12 +285,40 @@ int main()
 #endif
 	ftpvita_set_notif_log_cb(sendNotification);
 
+	/* Per-file notifications are coalesced by a dispatcher thread */
+	notif_evf = sceKernelCreateEventFlag("BGFTP_notif_evf", 0, 0, NULL);
+	sceKernelStartThread(sceKernelCreateThread("BGFTP_notif_thread", notificationThread,
+		SCE_KERNEL_LOWEST_PRIORITY_USER, 0x4000, 0, 0, NULL), 0, NULL);
+	ftpvita_set_xfer_cb(queueXferNotification);
+
 	ftpvita_init_app();
 
+	ftpvita_ext_add_site_command("POWER", sitePowerCmd);
+
 	/* main loop */
 
+	/* Auto suspend is held off while transfers run and for idle_timeout
+	 * seconds after the last command, otherwise we sleep until the
+	 * FTP core reports activity */
+	last = sceKernelGetProcessTimeWide();
+	hold = 1;
+
 	while (1) {
-		sceKernelPowerTick(SCE_KERNEL_POWER_TICK_DISABLE_AUTO_SUSPEND);
-		sceKernelDelayThread(10000);
+		ftpvita_get_activity(&activity);
+
+		now = sceKernelGetProcessTimeWide();
+		if (hold)
+			suspend_held_time += now - last;
+		else
+			suspend_released_time += now - last;
+		last = now;
+
+		hold = activity.transfers > 0 || activity.idle_us < (SceUInt64)idle_timeout * 1000000;
+		if (hold) {
+			sceKernelPowerTick(SCE_KERNEL_POWER_TICK_DISABLE_AUTO_SUSPEND);
+			power_ticks++;
+		}
+
+		ftpvita_wait_activity(hold ? POWER_TICK_INTERVAL : 0);
 	}
 }
@@ -0,0 +1,322 @@
+/*
+ * Host microbenchmarks of the per-command and per-buffer routines in
+ * ftpvita.c. ftpvita.c is built in here against the stand-ins in
+ * platform.c, so the numbers track changes to the routines themselves,
+ * not to the console's libc or kernel.
+ *
+ * bench [-s] [baseline]
+ *  Runs every benchmark and compares it to the baseline file, a line of
+ *  "<name> <ns/op> <allocs/op>" each. Exits 1 if one got slower by more
+ *  than BENCH_REGRESSION percent or allocates more. -s saves the results
+ *  as the new baseline instead.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Allocations made by ftpvita.c, counted by wrapping its allocator */
+static unsigned long bench_allocs = 0;
+
+static void *bench_malloc(size_t size)
+{
+	bench_allocs++;
+	return malloc(size);
+}
+
+static void *bench_calloc(size_t count, size_t size)
+{
+	bench_allocs++;
+	return calloc(count, size);
+}
+
+static void *bench_realloc(void *ptr, size_t size)
+{
+	bench_allocs++;
+	return realloc(ptr, size);
+}
+
+static char *bench_strdup(const char *str)
+{
+	bench_allocs++;
+	return strdup(str);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(ptr, size) bench_realloc(ptr, size)
+#define strdup(str) bench_strdup(str)
+
+#include "../BGFTP_bgapp/ftpvita.c"
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+
+/* Each run takes at least BENCH_MIN_TIME of CPU time, the best of
+ * BENCH_RUNS counts */
+#define BENCH_MIN_TIME (50 * 1000)
+#define BENCH_MAX_ITERATIONS (1 << 24)
+#define BENCH_RUNS 5
+/* Slowdown over the baseline reported as a regression, in percent */
+#define BENCH_REGRESSION 20
+
+/* Results are stored here so the compiler can't drop the calls */
+static volatile cmd_dispatch_func bench_sink;
+
+typedef struct {
+	ftpvita_client_info_t *client;
+	list_batch batch;
+	SceIoStat stat;
+	char out[FTPVITA_PATH_MAX];
+} bench_ctx;
+
+typedef struct {
+	const char *name;
+	void (*func)(bench_ctx *ctx, unsigned int iterations);
+} bench_entry;
+
+typedef struct {
+	char name[32];
+	unsigned int ns;
+	double allocs;
+} bench_result;
+
+static void bench_list_format(bench_ctx *ctx, unsigned int iterations)
+{
+	while (iterations--)
+		gen_list_format(ctx->out, sizeof(ctx->out), 0, &ctx->stat, "PCSE00000_savedata.bin");
+}
+
+static void bench_dispatch(bench_ctx *ctx, unsigned int iterations)
+{
+	static const char *const verbs[] = {"RETR", "STOR", "LIST", "NOOP", "SITE", "XXXX"};
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++)
+		bench_sink = get_dispatch_func(verbs[i % (sizeof(verbs) / sizeof(*verbs))]);
+}
+
+static void bench_fullpath(bench_ctx *ctx, unsigned int iterations)
+{
+	ctx->client->recv_cmd_args = "savedata/PCSE00000/sce_sys/param.sfo";
+	while (iterations--)
+		gen_ftp_fullpath(ctx->client, ctx->out, sizeof(ctx->out));
+}
+
+static void bench_dir_up(bench_ctx *ctx, unsigned int iterations)
+{
+	while (iterations--) {
+		strcpy(ctx->out, "/ux0:/data/savedata/PCSE00000");
+		dir_up(ctx->out);
+	}
+}
+
+static void bench_parse_cmd(bench_ctx *ctx, unsigned int iterations)
+{
+	char cmd[16];
+
+	snprintf(ctx->client->recv_buffer, sizeof(ctx->client->recv_buffer), "STOR savedata/param.sfo" FTPVITA_EOL);
+	while (iterations--)
+		client_parse_cmd(ctx->client, cmd);
+}
+
+static void bench_xfer_buf(bench_ctx *ctx, unsigned int iterations)
+{
+	while (iterations--)
+		xfer_buf_free(xfer_buf_alloc(MIN_XFER_BUF_SIZE), MIN_XFER_BUF_SIZE);
+}
+
+/* The budget changes before every refresh, between two sizes, so each
+ * one reallocates the buffer like a transfer does after SITE CONFIG */
+static void bench_buf_refresh(bench_ctx *ctx, unsigned int iterations)
+{
+	unsigned int saved_size = file_buf_size;
+	unsigned int size = MIN_XFER_BUF_SIZE;
+	unsigned int generation = config_generation;
+	unsigned char *buffer = xfer_buf_alloc(size);
+
+	while (iterations--) {
+		file_buf_size = file_buf_size == 2 * MIN_XFER_BUF_SIZE ? 4 * MIN_XFER_BUF_SIZE : 2 * MIN_XFER_BUF_SIZE;
+		config_generation++;
+		buffer = xfer_buf_refresh(ctx->client, buffer, &size, 0, &generation);
+	}
+	xfer_buf_free(buffer, size);
+
+	file_buf_size = saved_size;
+	config_generation++;
+}
+
+/* Listing lines go into the batch, which is emptied instead of sent */
+static void bench_list_batch(bench_ctx *ctx, unsigned int iterations)
+{
+	while (iterations--) {
+		if (ctx->batch.len > LIST_BATCH_SIZE / 2)
+			ctx->batch.len = 0;
+		list_batch_add_line(&ctx->batch, "-rw-r--r-- 1 vita vita 4096 Jan 1  2020 param.sfo");
+	}
+}
+
+static const bench_entry bench_table[] = {
+	{"list_format", bench_list_format},
+	{"dispatch", bench_dispatch},
+	{"fullpath", bench_fullpath},
+	{"dir_up", bench_dir_up},
+	{"parse_cmd", bench_parse_cmd},
+	{"xfer_buf", bench_xfer_buf},
+	{"buf_refresh", bench_buf_refresh},
+	{"list_batch", bench_list_batch},
+	{NULL, NULL}
+};
+
+#define BENCH_COUNT (sizeof(bench_table) / sizeof(*bench_table) - 1)
+
+/* CPU time of the process in microseconds, so time spent preempted by
+ * other processes on the host doesn't count */
+static SceUInt64 bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (SceUInt64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void bench_run(bench_ctx *ctx, const bench_entry *bench, bench_result *result)
+{
+	unsigned int iterations;
+	unsigned int ns;
+	unsigned long allocs;
+	SceUInt64 start, elapsed;
+	int run;
+
+	snprintf(result->name, sizeof(result->name), "%s", bench->name);
+	result->ns = 0;
+
+	for (run = 0; run < BENCH_RUNS; run++) {
+		/* Double the iterations until the run is long enough to time */
+		for (iterations = 16; ; iterations *= 2) {
+			allocs = bench_allocs;
+			start = bench_time();
+			bench->func(ctx, iterations);
+			elapsed = bench_time() - start;
+			allocs = bench_allocs - allocs;
+			if (elapsed >= BENCH_MIN_TIME || iterations >= BENCH_MAX_ITERATIONS)
+				break;
+		}
+
+		ns = elapsed * 1000 / iterations;
+		if (run == 0 || ns < result->ns)
+			result->ns = ns;
+		result->allocs = (double)allocs / iterations;
+	}
+}
+
+static int bench_load(const char *path, bench_result *baseline, int max)
+{
+	FILE *fp;
+	int count = 0;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	while (count < max && fscanf(fp, "%31s %u %lf", baseline[count].name, &baseline[count].ns,
+		&baseline[count].allocs) == 3)
+		count++;
+	fclose(fp);
+
+	return count;
+}
+
+static int bench_save(const char *path, const bench_result *results, int count)
+{
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(path, "w")) == NULL)
+		return -1;
+	for (i = 0; i < count; i++)
+		fprintf(fp, "%s %u %.2f\n", results[i].name, results[i].ns, results[i].allocs);
+
+	return fclose(fp);
+}
+
+static const bench_result *bench_find(const bench_result *baseline, int count, const char *name)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (strcmp(baseline[i].name, name) == 0)
+			return &baseline[i];
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	bench_result results[BENCH_COUNT];
+	bench_result baseline[BENCH_COUNT];
+	const bench_result *base;
+	const char *path = "baseline.txt";
+	bench_ctx ctx;
+	int baseline_count;
+	int regressions = 0;
+	int save = 0;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0)
+			save = 1;
+		else
+			path = argv[i];
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	if ((ctx.client = calloc(1, sizeof(*ctx.client))) == NULL)
+		return 1;
+	ctx.client->xfer_device = -1;
+	ctx.client->xfer_weight = 1;
+	session_init_paths(ctx.client);
+	session_set_cur_path(ctx.client, "/ux0:/data");
+	ctx.stat.st_size = 123456;
+	ctx.stat.st_mtime.year = 2020;
+	ctx.stat.st_mtime.month = 1;
+	ctx.stat.st_mtime.day = 1;
+	if (list_batch_init(&ctx.batch, ctx.client) < 0)
+		return 1;
+
+	baseline_count = save ? 0 : bench_load(path, baseline, BENCH_COUNT);
+
+	printf("%-12s %10s %10s %10s\n", "Benchmark", "ns/op", "allocs/op", "baseline");
+	for (i = 0; i < (int)BENCH_COUNT; i++) {
+		bench_run(&ctx, &bench_table[i], &results[i]);
+
+		if ((base = bench_find(baseline, baseline_count, results[i].name)) != NULL) {
+			int slower = results[i].ns > base->ns + base->ns * BENCH_REGRESSION / 100 ||
+				results[i].allocs > base->allocs + 0.005;
+
+			printf("%-12s %10u %10.2f %10u %+d%%%s\n", results[i].name, results[i].ns, results[i].allocs,
+				base->ns, base->ns ? (int)(((long long)results[i].ns - base->ns) * 100 / base->ns) : 0,
+				slower ? " REGRESSION" : "");
+			regressions += slower;
+		} else {
+			printf("%-12s %10u %10.2f %10s\n", results[i].name, results[i].ns, results[i].allocs, "-");
+		}
+	}
+
+	free(ctx.batch.buf);
+	free(ctx.client);
+
+	if (save) {
+		if (bench_save(path, results, BENCH_COUNT) < 0) {
+			fprintf(stderr, "Could not write %s\n", path);
+			return 1;
+		}
+		printf("Saved as the baseline in %s\n", path);
+	} else if (baseline_count < 0) {
+		printf("No baseline in %s, run with -s to save one\n", path);
+	}
+
+	return regressions ? 1 : 0;
+}
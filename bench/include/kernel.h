@@ -0,0 +1,124 @@
+#pragma once
+
+/* Host stand-in for the SDK header, only what bench needs to build ftpvita.c */
+
+#include <scetypes.h>
+#include <string.h>
+typedef int SceMode;
+typedef SceInt64 SceIoOff;
+#ifndef SCE_DATETIME_DEFINED
+#define SCE_DATETIME_DEFINED
+typedef struct { unsigned short year, month, day, hour, minute, second; unsigned int microsecond; } SceDateTime;
+#endif
+typedef struct { SceMode st_mode; unsigned int st_attr; SceOff st_size; SceDateTime st_ctime, st_atime, st_mtime; unsigned int st_private[6]; } SceIoStat;
+typedef struct { SceIoStat d_stat; char d_name[256]; void *d_private; int dummy; } SceIoDirent;
+typedef int (*SceKernelThreadEntry)(SceSize, void*);
+typedef SceUInt32 SceKernelUseconds;
+typedef struct { SceSize size; } SceKernelThreadOptParam;
+#define SCE_O_RDONLY 1
+#define SCE_O_WRONLY 2
+#define SCE_O_RDWR 3
+#define SCE_O_CREAT 0x200
+#define SCE_O_TRUNC 0x400
+#define SCE_O_APPEND 0x100
+#define SCE_O_EXCL 0x800
+#define SCE_SEEK_SET 0
+#define SCE_SEEK_CUR 1
+#define SCE_SEEK_END 2
+#define SCE_STM_ISDIR(m) (((m) & 0xf000) == 0x1000)
+#define SCE_STM_ISREG(m) (((m) & 0xf000) == 0x2000)
+#define SCE_CST_MT 0x0020
+#define SCE_CST_SIZE 0x0004
+#define SCE_KERNEL_DEFAULT_PRIORITY_USER 0x10000100
+#define SCE_KERNEL_HIGHEST_PRIORITY_USER 64
+#define SCE_KERNEL_LOWEST_PRIORITY_USER 191
+#define SCE_KERNEL_STACK_SIZE_DEFAULT_USER_MAIN 0x40000
+#define SCE_KERNEL_THREAD_STACK_SIZE_MIN 0x1000
+#define SCE_KERNEL_THREAD_CPU_AFFINITY_MASK_DEFAULT 0
+#define SCE_KERNEL_CPU_MASK_USER_0 0x10000
+#define SCE_KERNEL_CPU_MASK_USER_1 0x20000
+#define SCE_KERNEL_CPU_MASK_USER_2 0x40000
+#define SCE_KERNEL_CPU_MASK_SYSTEM 0x80000
+#define SCE_KERNEL_CPU_MASK_USER_ALL 0x70000
+#define SCE_KERNEL_POWER_TICK_DEFAULT 0
+#define SCE_KERNEL_POWER_TICK_DISABLE_AUTO_SUSPEND 1
+#define SCE_KERNEL_EVF_ATTR_MULTI 0x1000
+#define SCE_KERNEL_EVF_ATTR_TH_FIFO 0
+#define SCE_KERNEL_EVF_WAITMODE_OR 1
+#define SCE_KERNEL_EVF_WAITMODE_AND 0
+#define SCE_KERNEL_EVF_WAITMODE_CLEAR_ALL 2
+#define SCE_KERNEL_EVF_WAITMODE_CLEAR_PAT 4
+#define SCE_KERNEL_ERROR_WAIT_TIMEOUT 0x80028005
+#define SCE_KERNEL_ERROR_WAIT_CANCEL 0x80028007
+#define SCE_KERNEL_MUTEX_ATTR_RECURSIVE 2
+#define SCE_KERNEL_SEMA_ATTR_TH_FIFO 0
+#define SCE_KERNEL_COND_ATTR_TH_FIFO 0
+#define SCE_KERNEL_ATTR_TH_FIFO 0
+#define SCE_ERROR_ERRNO_ENOENT 0x80010002
+#define SCE_ERROR_ERRNO_EEXIST 0x80010011
+SceUID sceIoOpen(const char*,int,SceMode);
+int sceIoClose(SceUID);
+int sceIoRead(SceUID,void*,SceSize);
+int sceIoWrite(SceUID,const void*,SceSize);
+int sceIoLseek32(SceUID,int,int);
+SceOff sceIoLseek(SceUID,SceOff,int);
+int sceIoPread(SceUID,void*,SceSize,SceOff);
+int sceIoPwrite(SceUID,const void*,SceSize,SceOff);
+int sceIoRemove(const char*);
+int sceIoRename(const char*,const char*);
+int sceIoMkdir(const char*,SceMode);
+int sceIoRmdir(const char*);
+SceUID sceIoDopen(const char*);
+int sceIoDread(SceUID,SceIoDirent*);
+int sceIoDclose(SceUID);
+int sceIoGetstat(const char*,SceIoStat*);
+int sceIoChstat(const char*,const SceIoStat*,unsigned int);
+int sceIoGetstatByFd(SceUID,SceIoStat*);
+int sceIoSyncByFd(SceUID,int);
+int sceIoChstatByFd(SceUID,const SceIoStat*,unsigned int);
+SceUID sceKernelCreateThread(const char*,SceKernelThreadEntry,int,SceSize,SceUInt32,int,const SceKernelThreadOptParam*);
+int sceKernelStartThread(SceUID,SceSize,const void*);
+int sceKernelExitDeleteThread(int);
+int sceKernelWaitThreadEnd(SceUID,int*,SceKernelUseconds*);
+int sceKernelDeleteThread(SceUID);
+int sceKernelDelayThread(SceKernelUseconds);
+int sceKernelChangeThreadPriority(SceUID,int);
+int sceKernelChangeThreadCpuAffinityMask(SceUID,int);
+int sceKernelGetThreadId(void);
+SceUID sceKernelCreateMutex(const char*,SceUInt32,int,void*);
+int sceKernelDeleteMutex(SceUID);
+int sceKernelLockMutex(SceUID,int,SceKernelUseconds*);
+int sceKernelUnlockMutex(SceUID,int);
+int sceKernelTryLockMutex(SceUID,int);
+SceUID sceKernelCreateSema(const char*,SceUInt32,int,int,void*);
+int sceKernelDeleteSema(SceUID);
+int sceKernelWaitSema(SceUID,int,SceKernelUseconds*);
+int sceKernelSignalSema(SceUID,int);
+int sceKernelPollSema(SceUID,int);
+SceUID sceKernelCreateEventFlag(const char*,SceUInt32,SceUInt32,void*);
+int sceKernelDeleteEventFlag(SceUID);
+int sceKernelSetEventFlag(SceUID,SceUInt32);
+int sceKernelClearEventFlag(SceUID,SceUInt32);
+int sceKernelWaitEventFlag(SceUID,SceUInt32,SceUInt32,SceUInt32*,SceKernelUseconds*);
+int sceKernelPollEventFlag(SceUID,SceUInt32,SceUInt32,SceUInt32*);
+SceUID sceKernelCreateCond(const char*,SceUInt32,SceUID,void*);
+int sceKernelDeleteCond(SceUID);
+int sceKernelWaitCond(SceUID,SceKernelUseconds*);
+int sceKernelSignalCond(SceUID);
+int sceKernelSignalCondAll(SceUID);
+SceUInt64 sceKernelGetProcessTimeWide(void);
+SceUInt32 sceKernelGetProcessTimeLow(void);
+int sceKernelPowerTick(int);
+int sceKernelExitProcess(int);
+int sceKernelAtomicAddAndGet32(volatile int*,int);
+int sceKernelAtomicSubAndGet32(volatile int*,int);
+int sceKernelAtomicGetAndAdd32(volatile int*,int);
+int sceKernelAtomicCompareAndSet32(volatile int*,int,int);
+int sceKernelAtomicGetAndSet32(volatile int*,int);
+int sceKernelAtomicGetAndSub32(volatile int*,int);
+SceInt64 sceKernelAtomicAddAndGet64(volatile SceInt64*,SceInt64);
+SceInt64 sceKernelAtomicGetAndSet64(volatile SceInt64*,SceInt64);
+int sceClibVsnprintf(char*,SceSize,const char*,va_list);
+int sceClibSnprintf(char*,SceSize,const char*,...);
+void *sceClibMemset(void*,int,SceSize);
+int sceClibPrintf(const char*,...);
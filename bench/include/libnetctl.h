@@ -0,0 +1,22 @@
+#pragma once
+
+/* Host stand-in for the SDK header, only what bench needs to build ftpvita.c */
+
+#include <scetypes.h>
+typedef union { char ip_address[16]; char ssid[33]; unsigned int mtu; } SceNetCtlInfo;
+#define SCE_NET_CTL_STATE_DISCONNECTED 0
+#define SCE_NET_CTL_STATE_CONNECTING 1
+#define SCE_NET_CTL_STATE_IPOBTAINING 2
+#define SCE_NET_CTL_STATE_IPOBTAINED 3
+#define SCE_NET_CTL_EVENT_TYPE_DISCONNECTED 1
+#define SCE_NET_CTL_EVENT_TYPE_DISCONNECT_REQ_FINISHED 2
+#define SCE_NET_CTL_EVENT_TYPE_IPOBTAINED 3
+#define SCE_NET_CTL_INFO_IP_ADDRESS 14
+typedef void *(*SceNetCtlCallback)(int event_type, void *arg);
+int sceNetCtlInit(void);
+void sceNetCtlTerm(void);
+int sceNetCtlInetGetState(int*);
+int sceNetCtlInetGetInfo(int,SceNetCtlInfo*);
+int sceNetCtlInetRegisterCallback(SceNetCtlCallback,void*,int*);
+int sceNetCtlInetUnregisterCallback(int);
+int sceNetCtlCheckCallback(void);
@@ -0,0 +1,74 @@
+#pragma once
+
+/* Host stand-in for the SDK header, only what bench needs to build ftpvita.c */
+
+#include <scetypes.h>
+typedef struct { unsigned int s_addr; } SceNetInAddr;
+typedef struct { unsigned char sin_len, sin_family; unsigned short sin_port; SceNetInAddr sin_addr; unsigned short sin_vport; char sin_zero[6]; } SceNetSockaddrIn;
+typedef struct { unsigned char sa_len, sa_family; char sa_data[14]; } SceNetSockaddr;
+typedef struct { void *memory; int size; int flags; } SceNetInitParam;
+typedef unsigned int SceNetSocklen_t;
+typedef struct { int fd; int events; int revents; } SceNetEpollEventDummy;
+typedef union { void *ptr; int fd; unsigned int u32; SceUInt64 u64; } SceNetEpollData;
+typedef struct { unsigned int events; unsigned int reserved; SceUInt64 system; SceNetEpollData data; } SceNetEpollEvent;
+typedef struct { int l_onoff; int l_linger; } SceNetLinger;
+#define SCE_NET_AF_INET 2
+#define SCE_NET_SOCK_STREAM 1
+#define SCE_NET_SOCK_DGRAM 2
+#define SCE_NET_INADDR_ANY 0
+#define SCE_NET_SOL_SOCKET 0xffff
+#define SCE_NET_SO_REUSEADDR 4
+#define SCE_NET_SO_KEEPALIVE 8
+#define SCE_NET_SO_SNDBUF 0x1001
+#define SCE_NET_SO_RCVBUF 0x1002
+#define SCE_NET_SO_RCVTIMEO 0x1006
+#define SCE_NET_SO_SNDTIMEO 0x1005
+#define SCE_NET_SO_NBIO 0x1100
+#define SCE_NET_SO_LINGER 0x80
+#define SCE_NET_IPPROTO_TCP 6
+#define SCE_NET_TCP_NODELAY 1
+#define SCE_NET_MSG_DONTWAIT 0x80
+#define SCE_NET_MSG_PEEK 0x2
+#define SCE_NET_MSG_WAITALL 0x40
+#define SCE_NET_EPOLLIN 1
+#define SCE_NET_EPOLLOUT 2
+#define SCE_NET_EPOLLERR 8
+#define SCE_NET_EPOLLHUP 0x10
+#define SCE_NET_EPOLL_CTL_ADD 1
+#define SCE_NET_EPOLL_CTL_MOD 2
+#define SCE_NET_EPOLL_CTL_DEL 3
+#define SCE_NET_ERROR_EINTR 0x80410104
+#define SCE_NET_ERROR_EAGAIN 0x80410123
+#define SCE_NET_ERROR_EWOULDBLOCK 0x80410123
+#define SCE_NET_ERROR_ETIMEDOUT 0x8041013c
+#define SCE_NET_ERROR_ENOTINIT 0x804101c8
+#define SCE_NET_SOCKET_ABORT_FLAG_RCV_PRESERVATION 1
+#define SCE_NET_SOCKET_ABORT_FLAG_SND_PRESERVATION 2
+#define SCE_NET_SHUT_RDWR 2
+int sceNetSocket(const char*,int,int,int);
+int sceNetBind(int,const SceNetSockaddr*,unsigned int);
+int sceNetListen(int,int);
+int sceNetAccept(int,SceNetSockaddr*,unsigned int*);
+int sceNetConnect(int,const SceNetSockaddr*,unsigned int);
+int sceNetSend(int,const void*,unsigned int,int);
+int sceNetRecv(int,void*,unsigned int,int);
+int sceNetSocketClose(int);
+int sceNetSocketAbort(int,int);
+int sceNetGetsockname(int,SceNetSockaddr*,unsigned int*);
+int sceNetSetsockopt(int,int,int,const void*,unsigned int);
+int sceNetGetsockopt(int,int,int,void*,unsigned int*);
+int sceNetShutdown(int,int);
+unsigned int sceNetHtonl(unsigned int);
+unsigned short sceNetHtons(unsigned short);
+unsigned int sceNetNtohl(unsigned int);
+unsigned short sceNetNtohs(unsigned short);
+int sceNetInetPton(int,const char*,void*);
+const char *sceNetInetNtop(int,const void*,char*,unsigned int);
+int sceNetShowNetstat(void);
+int sceNetInit(SceNetInitParam*);
+int sceNetTerm(void);
+int sceNetEpollCreate(const char*,int);
+int sceNetEpollControl(int,int,int,SceNetEpollEvent*);
+int sceNetEpollWait(int,SceNetEpollEvent*,int,int);
+int sceNetEpollDestroy(int);
+int sceNetEpollAbort(int,int);
@@ -0,0 +1,17 @@
+#pragma once
+
+/* Host stand-in for the SDK header, only what bench needs to build ftpvita.c */
+
+#include <scetypes.h>
+#ifndef SCE_DATETIME_DEFINED
+#define SCE_DATETIME_DEFINED
+typedef struct { unsigned short year, month, day, hour, minute, second; unsigned int microsecond; } SceDateTime;
+#endif
+typedef struct { SceUInt64 tick; } SceRtcTick;
+int sceRtcGetCurrentClockLocalTime(SceDateTime*);
+int sceRtcGetCurrentTick(SceRtcTick*);
+int sceRtcGetTick(const SceDateTime*, SceRtcTick*);
+int sceRtcSetTick(SceDateTime*, const SceRtcTick*);
+int sceRtcConvertLocalTimeToUtc(const SceRtcTick*, SceRtcTick*);
+int sceRtcConvertUtcToLocalTime(const SceRtcTick*, SceRtcTick*);
+int sceRtcGetCurrentClock(SceDateTime*, int);
@@ -0,0 +1,23 @@
+#pragma once
+
+/* Host stand-in for the SDK header, only what bench needs to build ftpvita.c */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+typedef int SceUID;
+typedef unsigned int SceSize;
+typedef int SceInt32;
+typedef unsigned int SceUInt32;
+typedef long long SceInt64;
+typedef unsigned long long SceUInt64;
+typedef long long SceOff;
+typedef int SceBool;
+typedef unsigned short SceUInt16;
+typedef unsigned char SceUInt8;
+typedef int SceMode;
+typedef unsigned int SceUIntPtr;
+#define SCE_OK 0
+#define SCE_TRUE 1
+#define SCE_FALSE 0
+#define SCE_NULL NULL
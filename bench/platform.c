@@ -0,0 +1,117 @@
+/*
+ * Host stand-ins for the kernel, I/O, network and RTC calls ftpvita.c links
+ * against. bench only drives the in-memory routines, so file and socket
+ * calls fail, locks always succeed and the clock is the host's.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+
+#include <kernel.h>
+#include <net.h>
+#include <libnetctl.h>
+#include <rtc.h>
+
+#define HOST_ERROR ((int)0x80010002)
+
+SceUID sceIoOpen(const char *path, int flags, SceMode mode) { return HOST_ERROR; }
+int sceIoClose(SceUID fd) { return HOST_ERROR; }
+int sceIoRead(SceUID fd, void *buf, SceSize size) { return HOST_ERROR; }
+int sceIoWrite(SceUID fd, const void *buf, SceSize size) { return HOST_ERROR; }
+int sceIoPread(SceUID fd, void *buf, SceSize size, SceOff offset) { return HOST_ERROR; }
+SceOff sceIoLseek(SceUID fd, SceOff offset, int whence) { return HOST_ERROR; }
+int sceIoRemove(const char *path) { return HOST_ERROR; }
+int sceIoRename(const char *oldpath, const char *newpath) { return HOST_ERROR; }
+int sceIoMkdir(const char *path, SceMode mode) { return HOST_ERROR; }
+int sceIoRmdir(const char *path) { return HOST_ERROR; }
+SceUID sceIoDopen(const char *path) { return HOST_ERROR; }
+int sceIoDread(SceUID fd, SceIoDirent *dir) { return HOST_ERROR; }
+int sceIoDclose(SceUID fd) { return HOST_ERROR; }
+int sceIoGetstat(const char *path, SceIoStat *stat) { return HOST_ERROR; }
+int sceIoGetstatByFd(SceUID fd, SceIoStat *stat) { return HOST_ERROR; }
+int sceIoChstat(const char *path, const SceIoStat *stat, unsigned int bits) { return HOST_ERROR; }
+int sceIoChstatByFd(SceUID fd, const SceIoStat *stat, unsigned int bits) { return HOST_ERROR; }
+int sceIoSyncByFd(SceUID fd, int flag) { return HOST_ERROR; }
+
+SceUID sceKernelCreateThread(const char *name, SceKernelThreadEntry entry, int priority, SceSize stack_size,
+	SceUInt32 attr, int cpu_mask, const SceKernelThreadOptParam *opt) { return HOST_ERROR; }
+int sceKernelStartThread(SceUID thid, SceSize args, const void *argp) { return HOST_ERROR; }
+int sceKernelExitDeleteThread(int status) { return 0; }
+int sceKernelWaitThreadEnd(SceUID thid, int *status, SceKernelUseconds *timeout) { return 0; }
+int sceKernelDelayThread(SceKernelUseconds usec) { return 0; }
+int sceKernelChangeThreadPriority(SceUID thid, int priority) { return 0; }
+int sceKernelChangeThreadCpuAffinityMask(SceUID thid, int mask) { return 0; }
+
+SceUID sceKernelCreateMutex(const char *name, SceUInt32 attr, int count, void *opt) { return 1; }
+int sceKernelDeleteMutex(SceUID mtx) { return 0; }
+int sceKernelLockMutex(SceUID mtx, int count, SceKernelUseconds *timeout) { return 0; }
+int sceKernelUnlockMutex(SceUID mtx, int count) { return 0; }
+SceUID sceKernelCreateSema(const char *name, SceUInt32 attr, int init, int max, void *opt) { return 1; }
+int sceKernelDeleteSema(SceUID sema) { return 0; }
+int sceKernelWaitSema(SceUID sema, int count, SceKernelUseconds *timeout) { return 0; }
+int sceKernelSignalSema(SceUID sema, int count) { return 0; }
+SceUID sceKernelCreateEventFlag(const char *name, SceUInt32 attr, SceUInt32 init, void *opt) { return 1; }
+int sceKernelDeleteEventFlag(SceUID evf) { return 0; }
+int sceKernelSetEventFlag(SceUID evf, SceUInt32 bits) { return 0; }
+int sceKernelClearEventFlag(SceUID evf, SceUInt32 bits) { return 0; }
+int sceKernelWaitEventFlag(SceUID evf, SceUInt32 bits, SceUInt32 mode, SceUInt32 *result,
+	SceKernelUseconds *timeout) { return (int)SCE_KERNEL_ERROR_WAIT_TIMEOUT; }
+
+SceUInt64 sceKernelGetProcessTimeWide(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (SceUInt64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int sceKernelAtomicAddAndGet32(volatile int *ptr, int value) { return __sync_add_and_fetch(ptr, value); }
+int sceKernelAtomicSubAndGet32(volatile int *ptr, int value) { return __sync_sub_and_fetch(ptr, value); }
+int sceKernelAtomicGetAndAdd32(volatile int *ptr, int value) { return __sync_fetch_and_add(ptr, value); }
+int sceKernelAtomicGetAndSet32(volatile int *ptr, int value) { return __sync_lock_test_and_set(ptr, value); }
+int sceKernelAtomicCompareAndSet32(volatile int *ptr, int expect, int value) { return __sync_val_compare_and_swap(ptr, expect, value); }
+SceInt64 sceKernelAtomicAddAndGet64(volatile SceInt64 *ptr, SceInt64 value) { return __sync_add_and_fetch(ptr, value); }
+
+int sceNetInit(SceNetInitParam *param) { return HOST_ERROR; }
+int sceNetTerm(void) { return 0; }
+int sceNetShowNetstat(void) { return HOST_ERROR; }
+int sceNetSocket(const char *name, int domain, int type, int protocol) { return HOST_ERROR; }
+int sceNetBind(int s, const SceNetSockaddr *addr, unsigned int len) { return HOST_ERROR; }
+int sceNetListen(int s, int backlog) { return HOST_ERROR; }
+int sceNetAccept(int s, SceNetSockaddr *addr, unsigned int *len) { return HOST_ERROR; }
+int sceNetConnect(int s, const SceNetSockaddr *addr, unsigned int len) { return HOST_ERROR; }
+int sceNetSend(int s, const void *buf, unsigned int len, int flags) { return HOST_ERROR; }
+int sceNetRecv(int s, void *buf, unsigned int len, int flags) { return HOST_ERROR; }
+int sceNetSocketClose(int s) { return 0; }
+int sceNetSocketAbort(int s, int flags) { return 0; }
+int sceNetSetsockopt(int s, int level, int name, const void *val, unsigned int len) { return 0; }
+unsigned int sceNetHtonl(unsigned int value) { return __builtin_bswap32(value); }
+unsigned short sceNetHtons(unsigned short value) { return __builtin_bswap16(value); }
+int sceNetInetPton(int af, const char *src, void *dst) { return 0; }
+
+const char *sceNetInetNtop(int af, const void *src, char *dst, unsigned int size)
+{
+	const unsigned char *addr = src;
+
+	snprintf(dst, size, "%u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3]);
+	return dst;
+}
+
+int sceNetCtlInit(void) { return HOST_ERROR; }
+void sceNetCtlTerm(void) { }
+int sceNetCtlInetGetState(int *state) { *state = SCE_NET_CTL_STATE_DISCONNECTED; return 0; }
+int sceNetCtlInetGetInfo(int code, SceNetCtlInfo *info) { return HOST_ERROR; }
+int sceNetCtlInetRegisterCallback(SceNetCtlCallback func, void *arg, int *cid) { return HOST_ERROR; }
+int sceNetCtlInetUnregisterCallback(int cid) { return 0; }
+int sceNetCtlCheckCallback(void) { return 0; }
+
+/* Fixed, so list_format always formats the same year */
+int sceRtcGetCurrentClockLocalTime(SceDateTime *time)
+{
+	memset(time, 0, sizeof(*time));
+	time->year = 2020;
+	time->month = 6;
+	time->day = 1;
+	return 0;
+}